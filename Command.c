@@ -0,0 +1,101 @@
+/*! @file Command.c
+ *
+ *  @brief Routines for dispatching received packets to their command handlers.
+ *
+ *  This contains the functions for registering a handler for a command byte and
+ *  for dispatching a packet to it with one table lookup.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Command_module Command module documentation
+ **  @{
+ */
+
+#include "Command.h"
+#include "Stats.h"
+#include <stddef.h>
+
+//!< Struct for one entry of the command table
+typedef struct
+{
+  TCommandHandler handler; /*!< The handler of the command, or NULL if the command is unknown */
+  TCommandRange parameters[3]; /*!< The accepted range of each parameter */
+} TCommandEntry;
+
+static TCommandEntry Table[COMMAND_TABLE_SIZE]; /*!< The command table, indexed by command byte */
+
+/*! @brief Clears the command table.
+ *
+ *  @return bool - TRUE if the command module was successfully initialized.
+ */
+bool Command_Init(void)
+{
+  for (int i = 0; i < COMMAND_TABLE_SIZE; i++)
+    Table[i].handler = NULL;
+  return true;
+}
+
+/*! @brief Registers the handler of a command.
+ *
+ *  @param command The command byte, without the ACK bit.
+ *  @param handler The function that handles the command.
+ *  @param parameters The accepted range of each of the three parameters, or NULL to accept any value.
+ *  @return bool - TRUE if the command was registered, FALSE if it is out of range or already registered.
+ *  @note Assumes that Command_Init has been called.
+ */
+bool Command_Register(const uint8_t command, const TCommandHandler handler,
+    const TCommandRange parameters[3])
+{
+  if (command >= COMMAND_TABLE_SIZE || handler == NULL
+      || Table[command].handler != NULL)
+    return false;
+
+  for (int i = 0; i < 3; i++)
+  {
+    if (parameters)
+      Table[command].parameters[i] = parameters[i];
+    else
+      Table[command].parameters[i] = (TCommandRange) COMMAND_ANY;
+  }
+  Table[command].handler = handler;
+  return true;
+}
+
+/*! @brief Validates the parameters of a packet and calls the handler of its command.
+ *
+ *  Unknown commands and parameters out of range fail without calling any handler.
+ *  @param packet The packet to handle, with the ACK bit already cleared.
+ *  @return TCommandStatus - The result of handling the packet.
+ *  @note Assumes that Command_Init has been called.
+ */
+TCommandStatus Command_Dispatch(const TPacket* const packet)
+{
+  // Unknown commands are refused straight away
+  if (packet->command >= COMMAND_TABLE_SIZE)
+    return COMMAND_FAILED;
+
+  const TCommandEntry* const entry = &Table[packet->command];
+  if (entry->handler == NULL)
+    return COMMAND_FAILED;
+
+  // Check every parameter against the descriptor of the command
+  const uint8_t parameters[3] = { packet->parameter1, packet->parameter2,
+      packet->parameter3 };
+  for (int i = 0; i < 3; i++)
+  {
+    if (parameters[i] < entry->parameters[i].min
+        || parameters[i] > entry->parameters[i].max)
+      return COMMAND_FAILED;
+  }
+
+  uint32_t start = Stats_Now();
+  TCommandStatus status = entry->handler(packet);
+  Stats_Record(&Stats_Commands[packet->command], start);
+  return status;
+}
+
+/*!
+ ** @}
+ */
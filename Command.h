@@ -0,0 +1,105 @@
+/*! @file Command.h
+ *
+ *  @brief Routines for dispatching received packets to their command handlers.
+ *
+ *  This contains the functions for registering a handler for a command byte and
+ *  for dispatching a packet to it with one table lookup.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Command_module Command module documentation
+ **  @{
+ */
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+// new types
+#include "types.h"
+#include "packet.h"
+
+//!< Number of entries in the command table, one for every command byte without the ACK bit
+#define COMMAND_TABLE_SIZE 128
+
+//!< Enum for Tower & PC packet commands with their respective values
+enum Commands
+{
+  TOWER_STARTUP = 0x04, /*!< The command byte for when the tower starts up */
+  SPECIAL_GET_STARTUP_VALUES = 0x04, /*!< The command byte for when the tower starts up (special) */
+  FLASH_PROGRAM_BYTE = 0x07, /*!< The command byte for programming a specific byte in the flash */
+  FLASH_READ_BYTE = 0x08, /*!< The command byte for reading a specific byte in the flash */
+  SPECIAL = 0x09, /*!< The command byte for special operations */
+  PROTOCOL_MODE = 0x0A, /*!< The command byte for getting and setting the protocol of the port, classic packets or frames */
+  TOWER_NUMBER = 0x0B, /*!< The command byte for handling get/set of the tower number */
+  TIME = 0x0C, /*!< The command byte for getting the current value of the tower RTC time */
+  SET_TIME = 0x0C, /*!< The command byte setting the value of the tower RTC */
+  TOWER_MODE = 0x0D, /*!< The command byte for handling get/set of the tower mode */
+  FLASH_READ_BLOCK = 0x0E, /*!< The command byte for streaming a range of the flash out */
+  FLASH_PROGRAM_BLOCK = 0x0F, /*!< The command byte for starting a multi-byte write of the flash */
+  FLASH_BLOCK_DATA = 0x10, /*!< The command byte for packets carrying the next bytes of a flash block */
+  DIAGNOSTICS = 0x11, /*!< The command byte for reading the firmware statistics */
+  TOWER_COMMIT = 0x12, /*!< The command byte for committing the tower number and mode to the flash straight away */
+  TELEMETRY = 0x13, /*!< The command byte for starting and stopping the telemetry stream, and for the samples it sends */
+  POWER = 0x14, /*!< The command byte for selecting the run and sleep modes of the processor */
+  SELF_TEST = 0x15, /*!< The command byte for starting the loopback self-test, and for its results */
+  SELF_TEST_PROBE = 0x16, /*!< The command byte of the packets the self-test sends around the loop */
+  PRINT_FLASH = 0x55 /*!< The command byte for printing our specified flash area */
+};
+
+//!< Enum for the result of handling a command
+typedef enum
+{
+  COMMAND_FAILED, /*!< The command was refused or did not execute */
+  COMMAND_SUCCESS, /*!< The command executed successfully */
+  COMMAND_PENDING /*!< The command has started an operation that will complete later */
+} TCommandStatus;
+
+//!< Struct for the range of values accepted for one packet parameter
+typedef struct
+{
+  uint8_t min; /*!< The smallest accepted value */
+  uint8_t max; /*!< The largest accepted value */
+} TCommandRange;
+
+//!< A range that accepts any parameter value
+#define COMMAND_ANY { 0x00, 0xFF }
+
+//!< A range that accepts a single parameter value
+#define COMMAND_EXACT(value) { (value), (value) }
+
+//!< Type of a command handler, given the packet with the ACK bit already cleared
+typedef TCommandStatus (*TCommandHandler)(const TPacket* const packet);
+
+/*! @brief Clears the command table.
+ *
+ *  @return bool - TRUE if the command module was successfully initialized.
+ */
+bool Command_Init(void);
+
+/*! @brief Registers the handler of a command.
+ *
+ *  @param command The command byte, without the ACK bit.
+ *  @param handler The function that handles the command.
+ *  @param parameters The accepted range of each of the three parameters, or NULL to accept any value.
+ *  @return bool - TRUE if the command was registered, FALSE if it is out of range or already registered.
+ *  @note Assumes that Command_Init has been called.
+ */
+bool Command_Register(const uint8_t command, const TCommandHandler handler,
+    const TCommandRange parameters[3]);
+
+/*! @brief Validates the parameters of a packet and calls the handler of its command.
+ *
+ *  Unknown commands and parameters out of range fail without calling any handler.
+ *  @param packet The packet to handle, with the ACK bit already cleared.
+ *  @return TCommandStatus - The result of handling the packet.
+ *  @note Assumes that Command_Init has been called.
+ */
+TCommandStatus Command_Dispatch(const TPacket* const packet);
+
+#endif
+
+/*!
+ ** @}
+ */
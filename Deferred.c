@@ -0,0 +1,152 @@
+/*! @file Deferred.c
+ *
+ *  @brief Routines for deferring callbacks from interrupts to the main loop.
+ *
+ *  This contains the functions for a lock-free queue of (callback, argument) pairs.
+ *  Interrupts only add to the queue, and the main loop runs the callbacks in order.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Deferred_module Deferred module documentation
+ **  @{
+ */
+/*
+ * Interrupts at different priorities may post at the same time, so a slot is
+ * reserved by moving End forward with LDREX/STREX. The slot is only marked
+ * ready once it has been filled in, and the main loop stops at the first slot
+ * that is not ready yet. Start is only moved by the main loop.
+ */
+
+#include "Deferred.h"
+#include "Event.h"
+#include <stddef.h>
+
+#if (DEFERRED_QUEUE_SIZE & (DEFERRED_QUEUE_SIZE - 1)) != 0
+#error "DEFERRED_QUEUE_SIZE must be a power of two"
+#endif
+
+//!< Mask to wrap a free-running index onto the queue
+#define DEFERRED_MASK (DEFERRED_QUEUE_SIZE - 1)
+
+//!< Struct for one slot of the queue
+typedef struct
+{
+  Callback callback; /*!< The callback function and its arguments pointer */
+  bool volatile ready; /*!< Set once the slot has been filled in */
+} TDeferredSlot;
+
+static TDeferredSlot Queue[DEFERRED_QUEUE_SIZE]; /*!< The queued callbacks */
+static uint16_t volatile Start; /*!< Free-running index of the next callback to run */
+static uint16_t volatile End; /*!< Free-running index of the next slot to reserve */
+
+uint32_t Deferred_Dropped;
+
+/*! @brief Loads a half-word and opens an exclusive access to it.
+ *
+ *  @param address The address of the half-word.
+ *  @return uint16_t - The value read.
+ */
+static inline uint16_t LoadExclusive(uint16_t volatile* const address)
+{
+  uint32_t value;
+  __asm volatile ("ldrexh %0, [%1]" : "=r" (value) : "r" (address) : "memory");
+  return value;
+}
+
+/*! @brief Stores a half-word if the exclusive access is still open.
+ *
+ *  @param address The address of the half-word.
+ *  @param value The value to store.
+ *  @return bool - TRUE if the store failed because another access got in first.
+ */
+static inline bool StoreExclusive(uint16_t volatile* const address,
+    const uint16_t value)
+{
+  uint32_t failed;
+  __asm volatile ("strexh %0, %2, [%1]" : "=&r" (failed) : "r" (address), "r" ((uint32_t) value) : "memory");
+  return failed;
+}
+
+/*! @brief Sets up the deferred callback queue before first use.
+ *
+ *  @return bool - TRUE if the deferred module was successfully initialized.
+ */
+bool Deferred_Init(void)
+{
+  Start = 0;
+  End = 0;
+  Deferred_Dropped = 0;
+
+  for (int i = 0; i < DEFERRED_QUEUE_SIZE; i++)
+    Queue[i].ready = false;
+  return true;
+}
+
+/*! @brief Queues a callback to be run from the main loop.
+ *
+ *  Posts EVENT_DEFERRED to wake the main loop.
+ *  @param function The callback function.
+ *  @param arguments The argument to pass to the callback function.
+ *  @return bool - TRUE if the callback was queued, FALSE if the queue is full.
+ *  @note Safe to call from any interrupt, at any priority.
+ */
+bool Deferred_Post(void (*function)(void*), void* arguments)
+{
+  uint16_t end;
+
+  // Reserve a slot, trying again if another interrupt reserved one first
+  do
+  {
+    end = LoadExclusive(&End);
+    if ((uint16_t) (end - Start) >= DEFERRED_QUEUE_SIZE)
+    {
+      __asm volatile ("clrex" ::: "memory");
+      Deferred_Dropped++;
+      return false;
+    }
+  } while (StoreExclusive(&End, end + 1));
+
+  // Fill in the slot before handing it to the main loop
+  TDeferredSlot* const slot = &Queue[end & DEFERRED_MASK];
+  slot->callback.callbackFunction = function;
+  slot->callback.callbackArguments = arguments;
+  __asm volatile ("dmb" ::: "memory");
+  slot->ready = true;
+
+  Event_Post(EVENT_DEFERRED);
+  return true;
+}
+
+/*! @brief Runs every callback that has been queued.
+ *
+ *  @return void
+ *  @note Assumes that Deferred_Init has been called, call only from the main loop.
+ */
+void Deferred_Run(void)
+{
+  while (Start != End)
+  {
+    TDeferredSlot* const slot = &Queue[Start & DEFERRED_MASK];
+
+    // The interrupt that reserved this slot has not finished filling it in,
+    // it will post another event when it has
+    if (!slot->ready)
+      return;
+
+    Callback callback = slot->callback;
+
+    // Release the slot before running the callback, so it can post again
+    slot->ready = false;
+    __asm volatile ("dmb" ::: "memory");
+    Start++;
+
+    if (callback.callbackFunction)
+      callback.callbackFunction(callback.callbackArguments);
+  }
+}
+
+/*!
+ ** @}
+ */
@@ -0,0 +1,55 @@
+/*! @file Deferred.h
+ *
+ *  @brief Routines for deferring callbacks from interrupts to the main loop.
+ *
+ *  This contains the functions for a lock-free queue of (callback, argument) pairs.
+ *  Interrupts only add to the queue, and the main loop runs the callbacks in order.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Deferred_module Deferred module documentation
+ **  @{
+ */
+
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+// new types
+#include "types.h"
+
+//!< Number of callbacks that can be waiting to run, must be a power of two
+#define DEFERRED_QUEUE_SIZE 16
+
+//! The number of callbacks dropped because the queue was full
+extern uint32_t Deferred_Dropped;
+
+/*! @brief Sets up the deferred callback queue before first use.
+ *
+ *  @return bool - TRUE if the deferred module was successfully initialized.
+ */
+bool Deferred_Init(void);
+
+/*! @brief Queues a callback to be run from the main loop.
+ *
+ *  Posts EVENT_DEFERRED to wake the main loop.
+ *  @param function The callback function.
+ *  @param arguments The argument to pass to the callback function.
+ *  @return bool - TRUE if the callback was queued, FALSE if the queue is full.
+ *  @note Safe to call from any interrupt, at any priority.
+ */
+bool Deferred_Post(void (*function)(void*), void* arguments);
+
+/*! @brief Runs every callback that has been queued.
+ *
+ *  @return void
+ *  @note Assumes that Deferred_Init has been called, call only from the main loop.
+ */
+void Deferred_Run(void);
+
+#endif
+
+/*!
+ ** @}
+ */
@@ -0,0 +1,91 @@
+/*! @file Event.c
+ *
+ *  @brief Routines for posting events from interrupts and waiting for them in the main loop.
+ *
+ *  This contains the functions for a small event loop: interrupts post event bits and the
+ *  main loop sleeps until at least one of them is pending.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Event_module Event module documentation
+ **  @{
+ */
+
+#include "Event.h"
+#include "Stats.h"
+#include "Power.h"
+#include "Cpu.h"
+
+static uint32_t volatile Pending; /*!< The event bits that have not been serviced yet */
+static uint32_t volatile PostTime; /*!< The cycle count when the first pending event was posted */
+
+uint32_t Event_LatencyLast, Event_LatencyMax;
+
+/*! @brief Sets up the event loop.
+ *
+ *  @return bool - TRUE if the event module was successfully initialized.
+ *  @note Assumes that Stats_Init has been called, it starts the cycle counter used for the latency.
+ */
+bool Event_Init(void)
+{
+  Pending = 0;
+  Event_LatencyLast = 0;
+  Event_LatencyMax = 0;
+  return true;
+}
+
+/*! @brief Posts one or more events.
+ *
+ *  @param events The event bits to set.
+ *  @return void
+ *  @note Safe to call from any interrupt.
+ */
+void Event_Post(const uint32_t events)
+{
+  EnterCritical();
+
+  // The latency is timed from the event that wakes the loop
+  if (Pending == 0)
+    PostTime = Stats_Now();
+  Pending |= events;
+
+  ExitCritical();
+}
+
+/*! @brief Waits for at least one event to be pending.
+ *
+ *  The processor sleeps with Power_Sleep while no event is pending. Interrupts
+ *  are disabled around the check so that an event posted just before sleeping
+ *  still wakes the processor.
+ *  @return uint32_t - The pending event bits, which are cleared.
+ *  @note Assumes that Event_Init has been called, call only from the main loop.
+ */
+uint32_t Event_Wait(void)
+{
+  EnterCritical();
+
+  // A pending interrupt ends WFI even while interrupts are masked, it is
+  // then taken as soon as they are enabled again
+  while (Pending == 0)
+  {
+    Power_Sleep();
+    ExitCritical();
+    EnterCritical();
+  }
+
+  uint32_t events = Pending;
+  Pending = 0;
+
+  Event_LatencyLast = Stats_Now() - PostTime;
+  if (Event_LatencyLast > Event_LatencyMax)
+    Event_LatencyMax = Event_LatencyLast;
+
+  ExitCritical();
+  return events;
+}
+
+/*!
+ ** @}
+ */
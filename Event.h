@@ -0,0 +1,64 @@
+/*! @file Event.h
+ *
+ *  @brief Routines for posting events from interrupts and waiting for them in the main loop.
+ *
+ *  This contains the functions for a small event loop: interrupts post event bits and the
+ *  main loop sleeps until at least one of them is pending.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Event_module Event module documentation
+ **  @{
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+// new types
+#include "types.h"
+
+//!< Enum for the event bits, in the order the main loop services them
+typedef enum
+{
+  EVENT_UART_RX = (1 << 0), /*!< A packet has been received and queued by the receive interrupt */
+  EVENT_UART_TX = (1 << 1), /*!< The transmit FIFO has drained */
+  EVENT_FLASH = (1 << 2), /*!< A flash operation has completed */
+  EVENT_DEFERRED = (1 << 3) /*!< A callback has been deferred by an interrupt */
+} TEvent;
+
+//! Cycle counts taken between the first event being posted and the main loop picking it up
+extern uint32_t Event_LatencyLast, /*!< The latency of the last wake-up */
+Event_LatencyMax; /*!< The largest latency seen */
+
+/*! @brief Sets up the event loop.
+ *
+ *  @return bool - TRUE if the event module was successfully initialized.
+ *  @note Assumes that Stats_Init has been called, it starts the cycle counter used for the latency.
+ */
+bool Event_Init(void);
+
+/*! @brief Posts one or more events.
+ *
+ *  @param events The event bits to set.
+ *  @return void
+ *  @note Safe to call from any interrupt.
+ */
+void Event_Post(const uint32_t events);
+
+/*! @brief Waits for at least one event to be pending.
+ *
+ *  The processor sleeps with Power_Sleep while no event is pending. Interrupts
+ *  are disabled around the check so that an event posted just before sleeping
+ *  still wakes the processor.
+ *  @return uint32_t - The pending event bits, which are cleared.
+ *  @note Assumes that Event_Init has been called, call only from the main loop.
+ */
+uint32_t Event_Wait(void);
+
+#endif
+
+/*!
+ ** @}
+ */
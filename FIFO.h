@@ -2,7 +2,8 @@
  *
  *  @brief Routines to implement a FIFO buffer.
  *
- *  This contains the structure and "methods" for accessing a byte-wide FIFO.
+ *  This contains a generator for FIFO ring buffers of any element type and of a
+ *  capacity chosen per instance, with the structure and "methods" for accessing them.
  *
  *  @author Aaron Coelho(10858126)
  *  @date 28/04/2017
@@ -16,45 +17,220 @@
 
 // new types
 #include "types.h"
+#include <string.h>
 
-// Number of bytes in a FIFO
-#define FIFO_SIZE 256
+//!< Orders the buffer access against the index update that publishes it, may be replaced for other targets
+#ifndef FIFO_MEMORY_BARRIER
+#define FIFO_MEMORY_BARRIER() __asm volatile ("dmb" ::: "memory")
+#endif
 
-/*!
- * @struct TFIFO
- */
-typedef struct
-{
-  uint16_t Start; /*!< The index of the position of the oldest data in the FIFO */
-  uint16_t End; /*!< The index of the next available empty position in the FIFO */
-  uint16_t volatile NbBytes; /*!< The number of bytes currently stored in the FIFO */
-  uint8_t Buffer[FIFO_SIZE]; /*!< The actual array of bytes to store the data */
-} TFIFO;
+//@{
+//!< The smallest index type of a FIFO of 2^bits entries, it has to hold a count of up to 2^bits
+#define FIFO_INDEX_1 uint8_t
+#define FIFO_INDEX_2 uint8_t
+#define FIFO_INDEX_3 uint8_t
+#define FIFO_INDEX_4 uint8_t
+#define FIFO_INDEX_5 uint8_t
+#define FIFO_INDEX_6 uint8_t
+#define FIFO_INDEX_7 uint8_t
+#define FIFO_INDEX_8 uint16_t
+#define FIFO_INDEX_9 uint16_t
+#define FIFO_INDEX_10 uint16_t
+#define FIFO_INDEX_11 uint16_t
+#define FIFO_INDEX_12 uint16_t
+#define FIFO_INDEX_13 uint16_t
+#define FIFO_INDEX_14 uint16_t
+#define FIFO_INDEX_15 uint16_t
+//@}
 
-/*! @brief Initialize the FIFO before first use.
- *
- *  @param FIFO A pointer to the FIFO that needs initializing.
- *  @return void
- */
-void FIFO_Init(TFIFO * const FIFO);
+//!< The index type of a FIFO of 2^bits entries, bits must be a plain number from 1 to 15 or a macro of one
+#define FIFO_INDEX(bits) FIFO_INDEX_EXPAND(bits)
+#define FIFO_INDEX_EXPAND(bits) FIFO_INDEX_##bits
 
-/*! @brief Put one character into the FIFO.
+/*! @brief Declares a FIFO type and its functions.
  *
- *  @param FIFO A pointer to a FIFO struct where data is to be stored.
- *  @param data A byte of data to store in the FIFO buffer.
- *  @return bool - TRUE if data is successfully stored in the FIFO.
- *  @note Assumes that FIFO_Init has been called.
- */
-bool FIFO_Put(TFIFO * const FIFO, const uint8_t data);
-
-/*! @brief Get one character from the FIFO.
+ *  The FIFO is a single-producer/single-consumer ring: exactly one context (an ISR
+ *  or the main loop) may add entries and exactly one other context may remove them.
+ *  Start and End run freely and are only wrapped when indexing the Buffer, so the
+ *  number of entries stored is always (End - Start). The capacity is 2^bits entries,
+ *  so the wrap is a mask, and the indices are of the smallest type that holds it.
+ *
+ *  The declared type is Type with a Type##Index index type, and the functions are
+ *
+ *  - prefix_Init(FIFO) to initialize the FIFO before first use,
+ *  - prefix_Put(FIFO, data) and prefix_Get(FIFO, dataPtr) for one entry,
+ *  - prefix_PutBlock(FIFO, data, length), which stores all of the entries or none,
+ *    and prefix_GetBlock(FIFO, data, length), which retrieves up to length entries,
+ *  - prefix_Reserve(FIFO) and prefix_Commit(FIFO) to fill the next entry in place,
+ *  - prefix_Peek(FIFO) and prefix_Release(FIFO) to use the oldest entry in place,
+ *  - prefix_Span(FIFO, data) and prefix_Skip(FIFO, count) to consume the stored
+ *    entries in place, one contiguous span at a time,
+ *  - prefix_Count(FIFO) and prefix_Free(FIFO) for the entries stored and that still fit.
  *
- *  @param FIFO A pointer to a FIFO struct with data to be retrieved.
- *  @param dataPtr A pointer to a memory location to place the retrieved byte.
- *  @return bool - TRUE if data is successfully retrieved from the FIFO.
- *  @note Assumes that FIFO_Init has been called.
+ *  The put functions count the entries that did not fit in Dropped, and keep the
+ *  most entries stored at once in HighWater.
+ *  @param Type The name of the FIFO struct type.
+ *  @param prefix The prefix of the function names.
+ *  @param element The type of one entry.
+ *  @param bits The capacity as a power of two, from 1 to 15.
  */
-bool FIFO_Get(TFIFO * const FIFO, uint8_t * const dataPtr);
+#define FIFO_DECLARE(Type, prefix, element, bits) \
+  typedef FIFO_INDEX(bits) Type##Index; \
+  \
+  typedef struct \
+  { \
+    Type##Index volatile Start; /*!< The count of entries removed so far, only written by the consumer */ \
+    Type##Index volatile End; /*!< The count of entries added so far, only written by the producer */ \
+    Type##Index HighWater; /*!< The most entries that have been stored at once, only written by the producer */ \
+    uint32_t Dropped; /*!< The number of entries that did not fit, only written by the producer */ \
+    element Buffer[1u << (bits)]; /*!< The actual array of entries to store the data */ \
+  } Type; \
+  \
+  static inline void prefix##_Init(Type * const FIFO) \
+  { \
+    FIFO->Start = 0; \
+    FIFO->End = 0; \
+    FIFO->HighWater = 0; \
+    FIFO->Dropped = 0; \
+  } \
+  \
+  static inline Type##Index prefix##_Count(const Type * const FIFO) \
+  { \
+    return (Type##Index) (FIFO->End - FIFO->Start); \
+  } \
+  \
+  static inline Type##Index prefix##_Free(const Type * const FIFO) \
+  { \
+    return (Type##Index) ((1u << (bits)) - prefix##_Count(FIFO)); \
+  } \
+  \
+  static inline void prefix##_Commit(Type * const FIFO) \
+  { \
+    /* Make sure the entry is in the buffer before the consumer can see it */ \
+    FIFO_MEMORY_BARRIER(); \
+    FIFO->End++; \
+    Type##Index count = prefix##_Count(FIFO); \
+    if (count > FIFO->HighWater) \
+      FIFO->HighWater = count; \
+  } \
+  \
+  static inline element* prefix##_Reserve(Type * const FIFO) \
+  { \
+    /* End is ours, Start may be moved by the consumer at any time */ \
+    Type##Index end = FIFO->End; \
+    if ((Type##Index) (end - FIFO->Start) >= (1u << (bits))) \
+      return NULL; \
+    return &FIFO->Buffer[end & ((1u << (bits)) - 1)]; \
+  } \
+  \
+  static inline bool prefix##_Put(Type * const FIFO, const element data) \
+  { \
+    element* const slot = prefix##_Reserve(FIFO); \
+    if (slot == NULL) \
+    { \
+      FIFO->Dropped++; \
+      return false; \
+    } \
+    *slot = data; \
+    prefix##_Commit(FIFO); \
+    return true; \
+  } \
+  \
+  static inline element* prefix##_Peek(Type * const FIFO) \
+  { \
+    /* Start is ours, End may be moved by the producer at any time */ \
+    Type##Index start = FIFO->Start; \
+    if (start == FIFO->End) \
+      return NULL; \
+    /* Make sure the entry is read only after seeing the producer's End */ \
+    FIFO_MEMORY_BARRIER(); \
+    return &FIFO->Buffer[start & ((1u << (bits)) - 1)]; \
+  } \
+  \
+  static inline void prefix##_Skip(Type * const FIFO, const uint16_t count) \
+  { \
+    /* Make sure the entries have been read before the producer can reuse the slots */ \
+    FIFO_MEMORY_BARRIER(); \
+    FIFO->Start += count; \
+  } \
+  \
+  static inline void prefix##_Release(Type * const FIFO) \
+  { \
+    prefix##_Skip(FIFO, 1); \
+  } \
+  \
+  static inline bool prefix##_Get(Type * const FIFO, element * const dataPtr) \
+  { \
+    const element* const slot = prefix##_Peek(FIFO); \
+    if (slot == NULL) \
+      return false; \
+    *dataPtr = *slot; \
+    prefix##_Release(FIFO); \
+    return true; \
+  } \
+  \
+  static inline uint16_t prefix##_Span(Type * const FIFO, \
+      const element ** const data) \
+  { \
+    /* The stored entries up to the end of the buffer, the rest wraps to the start */ \
+    Type##Index start = FIFO->Start; \
+    uint16_t count = (Type##Index) (FIFO->End - start); \
+    uint16_t index = start & ((1u << (bits)) - 1); \
+    if (count > (1u << (bits)) - index) \
+      count = (1u << (bits)) - index; \
+    FIFO_MEMORY_BARRIER(); \
+    *data = &FIFO->Buffer[index]; \
+    return count; \
+  } \
+  \
+  static inline bool prefix##_PutBlock(Type * const FIFO, \
+      const element * const data, const uint16_t length) \
+  { \
+    Type##Index end = FIFO->End; \
+    /* Reserve room for the whole block up front */ \
+    if ((uint16_t) ((1u << (bits)) - (Type##Index) (end - FIFO->Start)) < length) \
+    { \
+      FIFO->Dropped += length; \
+      return false; \
+    } \
+    /* Copy up to the end of the buffer, then wrap around to the start */ \
+    uint16_t index = end & ((1u << (bits)) - 1); \
+    uint16_t first = (1u << (bits)) - index; \
+    if (first > length) \
+      first = length; \
+    memcpy(&FIFO->Buffer[index], data, first * sizeof(element)); \
+    memcpy(FIFO->Buffer, data + first, (length - first) * sizeof(element)); \
+    /* Publish the whole block at once */ \
+    FIFO_MEMORY_BARRIER(); \
+    FIFO->End = end + length; \
+    Type##Index count = prefix##_Count(FIFO); \
+    if (count > FIFO->HighWater) \
+      FIFO->HighWater = count; \
+    return true; \
+  } \
+  \
+  static inline uint16_t prefix##_GetBlock(Type * const FIFO, \
+      element * const data, const uint16_t length) \
+  { \
+    Type##Index start = FIFO->Start; \
+    /* Take whatever is available, up to the requested length */ \
+    uint16_t count = (Type##Index) (FIFO->End - start); \
+    if (count > length) \
+      count = length; \
+    if (count == 0) \
+      return 0; \
+    FIFO_MEMORY_BARRIER(); \
+    /* Copy up to the end of the buffer, then wrap around to the start */ \
+    uint16_t index = start & ((1u << (bits)) - 1); \
+    uint16_t first = (1u << (bits)) - index; \
+    if (first > count) \
+      first = count; \
+    memcpy(data, &FIFO->Buffer[index], first * sizeof(element)); \
+    memcpy(data + first, FIFO->Buffer, (count - first) * sizeof(element)); \
+    /* Release the slots only after the copy is done */ \
+    prefix##_Skip(FIFO, count); \
+    return count; \
+  }
 
 #endif
 
@@ -14,6 +14,8 @@
 
 #include "MK70F12.h"
 #include "FTM.h"
+#include "Deferred.h"
+#include "Stats.h"
 
 //!< FIXED_FREQ_CLK is used to set the CLKS to the fixed clock
 #define FIXED_FREQ_CLK 2
@@ -107,6 +109,7 @@ bool FTM_Set(const TFTMChannel* const aFTMChannel)
     // Set the channel action (configuration)
     FTM0_CnV(n) = FTM0_CNT + aFTMChannel->delayCount;
   }
+  return true;
 }
 
 /*! @brief Starts a timer if set up for output compare.
@@ -122,44 +125,70 @@ bool FTM_StartTimer(const TFTMChannel* const aFTMChannel)
   // Set the counter to interrupt after specified delay
   FTM0_CnV(n) = FTM0_CNT + aFTMChannel->delayCount;
 
+  // The channel flag is set on every match, even with the interrupt off,
+  // so clear any stale one before enabling the interrupt
+  FTM0_CnSC(n) &= ~FTM_CnSC_CHF_MASK;
+
   // Enable the channel interrupt
   FTM0_CnSC(n) |= FTM_CnSC_CHIE_MASK;
 
   // Turn on the FTM and use the FIXED FREQUENCY CLOCK
   FTM0_SC |= FTM_SC_CLKS(FIXED_FREQ_CLK);
+  return true;
+}
+
+/*! @brief Stops a timer from interrupting.
+ *
+ *  @param aFTMChannel is a structure containing the parameters to be used in setting up the timer channel.
+ *  @return void
+ *  @note Assumes the FTM has been initialized.
+ */
+void FTM_StopTimer(const TFTMChannel* const aFTMChannel)
+{
+  FTM0_CnSC(aFTMChannel->channelNb) &= ~FTM_CnSC_CHIE_MASK;
+}
+
+/*! @brief Reads the free running counter of the FTM.
+ *
+ *  @return uint16_t - The current count.
+ *  @note Assumes the FTM has been initialized.
+ */
+uint16_t FTM_Count(void)
+{
+  return FTM0_CNT;
 }
 
 /*! @brief Interrupt service routine for the FTM.
  *
- *  If a timer channel was set up as output compare, then the user callback function will be called.
+ *  For every timer channel that has fired, the user callback function will be called from the main loop.
  *  @note Assumes the FTM has been initialized.
  */
 void __attribute__ ((interrupt))
 FTM0_ISR(void)
 {
-  // Find which channel the interrupt originated from
-  for (int i = 0; i < 1; i++)
-  {
-    // If the Channel Flag bit is set, an event has occurred
-    if (FTM0_CnSC(i) & FTM_CnSC_CHF_MASK)
-    {
-      // Clear the interrupt flag
-      FTM0_CnSC(i) &= ~FTM_CnSC_CHF_MASK;
+  uint32_t start = Stats_Now();
 
-      //Stop any future interrupts from occurring on this channel
-      //FTM0_CnSC(i) &= ~FTM_CnSC_CHIE_MASK;
+  // Every channel flag is in STATUS, clear the ones that are set by
+  // writing 0 to them
+  uint32_t status = FTM0_STATUS & 0xFF;
+  FTM0_STATUS &= ~status;
 
-      // Disable the counter? (Disable every other interrupt channel?)
-      // ^ BAD? Still works because using only 1 channel... better to
-      // not do then :^)
-      //FTM0_SC &= FTM_SC_CLKS(0);
+  // Visit only the channels that have fired, lowest first
+  while (status)
+  {
+    uint8_t n = __builtin_ctz(status);
+    status &= status - 1;
 
-      // Execute the callback function
-      Callback* callback = &Callbacks[i];
-      callback->callbackFunction(callback->callbackArguments);
-      break;
+    // Channels that are stopped still match, so skip them
+    if (FTM0_CnSC(n) & FTM_CnSC_CHIE_MASK)
+    {
+      // Leave the callback function to the main loop
+      Callback* callback = &Callbacks[n];
+      Deferred_Post(callback->callbackFunction, callback->callbackArguments);
     }
   }
+
+  Stats_Record(&Stats_ISRs[STATS_ISR_FTM], start);
 }
 
 /*!
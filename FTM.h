@@ -99,14 +99,20 @@ bool FTM_Set(const TFTMChannel* const aFTMChannel);
  */
 bool FTM_StartTimer(const TFTMChannel* const aFTMChannel);
 
-/*! @brief A callback function that handles specific
- *  callback information
+/*! @brief Stops a timer from interrupting.
  *
- *  @param arguments - An address to the argument struct else NULL
+ *  @param aFTMChannel is a structure containing the parameters to be used in setting up the timer channel.
  *  @return void
  *  @note Assumes the FTM has been initialized.
  */
-void FTM_Callback(void *arguments);
+void FTM_StopTimer(const TFTMChannel* const aFTMChannel);
+
+/*! @brief Reads the free running counter of the FTM.
+ *
+ *  @return uint16_t - The current count.
+ *  @note Assumes the FTM has been initialized.
+ */
+uint16_t FTM_Count(void);
 
 #endif
 
@@ -116,7 +122,7 @@ void FTM_Callback(void *arguments);
 
 /*! @brief Interrupt service routine for the FTM.
  *
- *  If a timer channel was set up as output compare, then the user callback function will be called.
+ *  For every timer channel that has fired, the user callback function will be called from the main loop.
  *  @note Assumes the FTM has been initialized.
  */
 void __attribute__ ((interrupt)) FTM0_ISR(void);
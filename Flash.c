@@ -20,23 +20,63 @@
  */
 
 #include "MK70F12.h"
+#include "Cpu.h"
+#include "Stats.h"
+#include "Power.h"
 #include "Flash.h"
+#include <stddef.h>
+#include <string.h>
 
 // Define the command bytes for FTFE
 #define PROGRAM_PHRASE_COMMAND 0x07 /*!< The flash command value for programming the flash data */
 #define ERASE_FLASH_SECTOR_COMMAND 0x09 /*!< The flash command value for erasing a flash sector */
 
-const static uint8_t FlashBaseAddress[3] = { 0x08, 0x00, 0x00 }; /*!< The base address of the flash section we are working in */
-// TODO - Make this variable name ALL CAPITALSED
-
 //!< Struct to store current command and data of Flash
 typedef struct tfccob
 {
   uint8_t command; /*<! The command that is to be executed */
-  uint8_t data[FLASH_SIZE]; /*!< An array to store the current state of the flash before executing the command */
+  uint32_t address; /*!< The flash address the command operates on */
+  uint8_t data[8]; /*!< The phrase to program */
 } TFCCOB;
 
-static TFCCOB CommonCommandObject; /*!< Global static variable that will be used for executing commands */
+//!< Buffer that stores the current state of the data region while a write is being built
+static uint8_t DataBuffer[FLASH_SIZE];
+
+//!< RAM image of the data region, includes writes that are still waiting in the queue
+static uint8_t DataImage[FLASH_SIZE];
+
+//!< Number of bits in one word of the allocation map
+#define FLASH_MAP_BITS 32
+
+//!< Allocation map of the data region, one bit per byte which is set once the byte is in use
+static uint32_t AllocationMap[(FLASH_SIZE + FLASH_MAP_BITS - 1) / FLASH_MAP_BITS];
+
+//!< Number of commands that can be waiting to run, must be a power of two
+#define FLASH_QUEUE_SIZE 32
+
+// Rewriting the data region queues one erase and one program per phrase
+#if FLASH_DATA_PHRASES + 1 > FLASH_QUEUE_SIZE || FLASH_DATA_PHRASES * 8 > FLASH_SECTOR_SIZE
+#error "FLASH_DATA_PHRASES must fit in one sector and in the command queue"
+#endif
+
+//!< Struct for a command waiting in the queue
+typedef struct
+{
+  TFCCOB commandObject; /*!< The command to execute */
+  bool endChain; /*!< TRUE for the last command of a chain, where the chain status is reported and reset */
+  void (*userFunction)(bool, void*); /*!< Called when the chain ends, or NULL */
+  void *userArguments; /*!< The arguments passed to userFunction */
+} TFlashRequest;
+
+//@{
+//!< Queue of flash commands, the oldest one is the one running on the FTFE
+static TFlashRequest Queue[FLASH_QUEUE_SIZE];
+static uint8_t volatile QueueStart = 0;
+static uint8_t volatile QueueEnd = 0;
+//@}
+
+//!< Combined result of every command since the last completion callback
+static bool ChainStatus = true;
 
 /*! @brief Set the command of the TFCCOB for later execution.
  *
@@ -48,89 +88,323 @@ static TFCCOB CommonCommandObject; /*!< Global static variable that will be used
 static void SetupCommand(TFCCOB* commandCommonObject, uint8_t command)
 {
   commandCommonObject->command = command;
+  commandCommonObject->address = FLASH_DATA_START;
 }
 
 /*! @brief Set the data phrase bytes into the respective FTFE registers.
  *
+ *  @param commandCommonObject A pointer to the object holding the phrase to program.
  *  @return void
  *  @note Assumes Flash has been initialized.
  */
-static void ProgramPhrase(void)
+static void ProgramPhrase(const TFCCOB* const commandCommonObject)
 {
-  FTFE_FCCOB4 = CommonCommandObject.data[3];
-  FTFE_FCCOB5 = CommonCommandObject.data[2];
-  FTFE_FCCOB6 = CommonCommandObject.data[1];
-  FTFE_FCCOB7 = CommonCommandObject.data[0];
-  FTFE_FCCOB8 = CommonCommandObject.data[7];
-  FTFE_FCCOB9 = CommonCommandObject.data[6];
-  FTFE_FCCOBA = CommonCommandObject.data[5];
-  FTFE_FCCOBB = CommonCommandObject.data[4];
+  FTFE_FCCOB4 = commandCommonObject->data[3];
+  FTFE_FCCOB5 = commandCommonObject->data[2];
+  FTFE_FCCOB6 = commandCommonObject->data[1];
+  FTFE_FCCOB7 = commandCommonObject->data[0];
+  FTFE_FCCOB8 = commandCommonObject->data[7];
+  FTFE_FCCOB9 = commandCommonObject->data[6];
+  FTFE_FCCOBA = commandCommonObject->data[5];
+  FTFE_FCCOBB = commandCommonObject->data[4];
 }
 
-/*! @brief Execute a command.
- *
- *  @param CommonCommandObject A pointer to the object that stores the state of the flash.
+/*! @brief Start executing a command on the FTFE.
  *
- *  @return bool - TRUE if the flash was initialized successfully.
- *  @note Assumes Flash has been initialized.
+ *  @param CommonCommandObject A pointer to the command to execute.
+ *  @return void
+ *  @note Assumes no command is running (CCIF is set).
  */
-static bool LaunchCommand(TFCCOB* CommonCommandObject)
+static void LaunchCommand(const TFCCOB* const CommonCommandObject)
 {
-  // Ensure no previous flash commands are executing
-  while (!(FTFE_FSTAT & FTFE_FSTAT_CCIF_MASK))
-    ;
+  uint32_t start = Stats_Now();
 
-  // Clear the status registers error bits
-  //FTFE_FSTAT = FTFE_FSTAT_ACCERR_MASK | FTFE_FSTAT_FPVIOL_MASK
-  //    | FTFE_FSTAT_RDCOLERR_MASK;
+  // Clear the status registers error bits of the previous command
+  FTFE_FSTAT = FTFE_FSTAT_ACCERR_MASK | FTFE_FSTAT_FPVIOL_MASK;
 
   // Set the command
   FTFE_FCCOB0 = CommonCommandObject->command;
 
-  // The high byte of the flash  base address
-  FTFE_FCCOB1 = 0x08;
+  // The high byte of the flash address
+  FTFE_FCCOB1 = (uint8_t) (CommonCommandObject->address >> 16);
+
+  // The mid byte of the flash address
+  FTFE_FCCOB2 = (uint8_t) (CommonCommandObject->address >> 8);
+
+  // The low byte of the flash address
+  FTFE_FCCOB3 = (uint8_t) CommonCommandObject->address;
+
+  // Set the data phrase if we are programming
+  if (CommonCommandObject->command == PROGRAM_PHRASE_COMMAND)
+    ProgramPhrase(CommonCommandObject);
+
+  // Clear the CCIF flag to execute the command
+  FTFE_FSTAT = FTFE_FSTAT_CCIF_MASK;
 
-  // The mid byte of the flash  base address
-  FTFE_FCCOB2 = 0x00;
+  Stats_Record(&Stats_FlashLaunch, start);
+}
 
-  // The low byte of the flash base address
-  FTFE_FCCOB3 = 0x00;
+/*! @brief Add a command to the queue, starting it straight away if the FTFE is idle.
+ *
+ *  @param commandObject A pointer to the command to execute.
+ *  @param endChain TRUE if this is the last command of its chain.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the chain completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the command was queued.
+ */
+static bool QueueCommand(const TFCCOB* const commandObject,
+    const bool endChain, void (*userFunction)(bool, void*),
+    void* userArguments)
+{
+  // Only the erase and program commands are supported
+  if (commandObject->command != PROGRAM_PHRASE_COMMAND
+      && commandObject->command != ERASE_FLASH_SECTOR_COMMAND)
+    return false;
+
+  // The Flash can not be programmed in very low power run
+  Power_Run();
 
-  // Execute the a command based on what command has been set inside the
-  // common command object
-  switch (CommonCommandObject->command)
+  EnterCritical();
+
+  // Check if the queue is full
+  uint8_t count = QueueEnd - QueueStart;
+  if (count >= FLASH_QUEUE_SIZE)
   {
-  case PROGRAM_PHRASE_COMMAND:
-    ProgramPhrase();
-    break;
-  case ERASE_FLASH_SECTOR_COMMAND:
-    break;
-  default:
+    ExitCritical();
     return false;
   }
 
-  // Set the CCIF flag and execute the command
-  FTFE_FSTAT = FTFE_FSTAT_CCIF_MASK;
+  TFlashRequest* request = &Queue[QueueEnd & (FLASH_QUEUE_SIZE - 1)];
+  request->commandObject = *commandObject;
+  request->endChain = endChain;
+  request->userFunction = userFunction;
+  request->userArguments = userArguments;
+  QueueEnd++;
 
-  // Wait until the command has fully executed
-  while (!(FTFE_FSTAT & FTFE_FSTAT_CCIF_MASK))
-    ;
+  // If the FTFE was idle, start this command and the completion interrupt
+  if (count == 0)
+  {
+    LaunchCommand(&request->commandObject);
+    FTFE_FCNFG |= FTFE_FCNFG_CCIE_MASK;
+  }
 
+  ExitCritical();
   return true;
 }
 
-/*! @brief Store the flash state into the common command object.
+/*! @brief Finish the running command and start the next one in the queue.
  *
  *  @return void
+ *  @note Must be called with interrupts disabled or from the FTFE interrupt, once CCIF is set.
+ */
+static void CommandComplete(void)
+{
+  // Check for access, protection and verify errors
+  ChainStatus &= !(FTFE_FSTAT
+      & (FTFE_FSTAT_ACCERR_MASK | FTFE_FSTAT_FPVIOL_MASK
+          | FTFE_FSTAT_MGSTAT0_MASK));
+
+  TFlashRequest request = Queue[QueueStart & (FLASH_QUEUE_SIZE - 1)];
+  QueueStart++;
+
+  // Keep the FTFE busy, or stop the completion interrupt if there is nothing left
+  if (QueueStart != QueueEnd)
+    LaunchCommand(&Queue[QueueStart & (FLASH_QUEUE_SIZE - 1)].commandObject);
+  else
+    FTFE_FCNFG &= ~FTFE_FCNFG_CCIE_MASK;
+
+  // Report the result of the whole chain to the user, a chain without
+  // a user function still ends here so its errors do not carry over
+  if (request.endChain)
+  {
+    bool status = ChainStatus;
+    ChainStatus = true;
+    if (request.userFunction)
+      request.userFunction(status, request.userArguments);
+  }
+}
+
+/*! @brief A completion callback that stores the result for a blocking call.
+ *
+ *  @param success TRUE if the command chain completed without errors.
+ *  @param arguments A pointer to the bool to store the result in.
+ *  @return void
+ */
+static void SyncComplete(bool success, void* arguments)
+{
+  *(volatile bool*) arguments = success;
+}
+
+/*! @brief Wait for a queued command chain ending in SyncComplete.
+ *
+ *  @param queued TRUE if the chain was queued successfully.
+ *  @param status A pointer to the result set by SyncComplete.
+ *  @return bool - TRUE if the chain completed without errors.
+ */
+static bool WaitSync(const bool queued, volatile bool* const status)
+{
+  if (!queued)
+    return false;
+
+  Flash_Wait();
+  return *status;
+}
+
+/*! @brief Store the flash state into the data buffer.
+ *
+ *  The state is taken from the RAM image so that writes still waiting
+ *  in the queue are not lost.
+ *  @return void
  *  @note Assumes Flash has been initialized.
  */
 static bool FlashBackup(void)
 {
-  // Loop through all bytes and store them in the data array of the common command object
+  memcpy(DataBuffer, DataImage, FLASH_SIZE);
+  return true;
+}
+
+/*! @brief Stores one value of a scatter write into the data buffer.
+ *
+ *  @param update The value and where it goes.
+ *  @return bool - TRUE if the value is inside the data region and aligned to its size.
+ */
+static bool StageUpdate(const TFlashUpdate* const update)
+{
+  // Calculate the index of the target address from the starting address
+  uint32_t index = (uintptr_t) update->address - FLASH_DATA_START;
+
+  // Check the size and that the value is within the flash bounds and aligned
+  if ((update->size != 1 && update->size != 2 && update->size != 4
+      && update->size != 8) || index >= FLASH_SIZE || index % update->size != 0)
+    return false;
+
+  // Split the value into bytes, lowest address first
+  for (int i = 0; i < update->size; i++)
+    DataBuffer[index + i] = (uint8_t) (update->value >> (8 * i));
+  return true;
+}
+
+/*! @brief Rebuilds the allocation map from the RAM image of the data region.
+ *
+ *  A byte is taken to be in use if it is not erased.
+ *  @return void
+ */
+static void BuildAllocationMap(void)
+{
+  for (int i = 0; i < sizeof(AllocationMap) / sizeof(AllocationMap[0]); i++)
+    AllocationMap[i] = 0;
+
   for (int i = 0; i < FLASH_SIZE; i++)
   {
-    CommonCommandObject.data[i] = _FB(FLASH_DATA_START+i);
+    if (DataImage[i] != 0xFF)
+      AllocationMap[i / FLASH_MAP_BITS] |= 1LU << (i % FLASH_MAP_BITS);
+  }
+
+  // Bits past the end of the region are never free
+  for (int i = FLASH_SIZE; i % FLASH_MAP_BITS != 0; i++)
+    AllocationMap[i / FLASH_MAP_BITS] |= 1LU << (i % FLASH_MAP_BITS);
+}
+
+/*! @brief Queue the commands that bring the data sector in line with the data buffer.
+ *
+ *  Phrases that do not change are left alone. When every phrase that changes
+ *  is still erased they are programmed in place, otherwise the sector is
+ *  erased and every phrase of the data buffer that holds data is programmed.
+ *  @param userFunction is a pointer to a function called when the program completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the commands were queued.
+ */
+static bool CommitData(void (*userFunction)(bool, void*), void* userArguments)
+{
+  // The FTFE programs whole phrases with their ECC and can not program a
+  // phrase twice, so only a phrase still erased can be written without an erase
+  bool changed = false, erase = false;
+  for (int phrase = 0; phrase < FLASH_DATA_PHRASES; phrase++)
+  {
+    const uint8_t* const image = &DataImage[phrase * 8];
+    if (memcmp(&DataBuffer[phrase * 8], image, 8) == 0)
+      continue;
+
+    changed = true;
+    for (int i = 0; i < 8; i++)
+      erase |= (image[i] != 0xFF);
+  }
+
+  // Nothing to do if the data is already stored
+  if (!changed)
+  {
+    if (userFunction)
+      userFunction(true, userArguments);
+    return true;
+  }
+
+  TFCCOB commandObjects[FLASH_DATA_PHRASES + 1];
+  uint8_t nbCommands = 0;
+
+  // Erase the sector first if a phrase holding data changes
+  if (erase)
+    SetupCommand(&commandObjects[nbCommands++], ERASE_FLASH_SECTOR_COMMAND);
+
+  // Then program every phrase that holds data, or only the changed ones
+  for (int phrase = 0; phrase < FLASH_DATA_PHRASES; phrase++)
+  {
+    TFCCOB* commandObject = &commandObjects[nbCommands];
+    SetupCommand(commandObject, PROGRAM_PHRASE_COMMAND);
+    commandObject->address = FLASH_DATA_START + phrase * 8;
+
+    bool erased = true;
+    for (int i = 0; i < 8; i++)
+    {
+      commandObject->data[i] = DataBuffer[phrase * 8 + i];
+      erased &= (commandObject->data[i] == 0xFF);
+    }
+
+    bool same = (memcmp(commandObject->data, &DataImage[phrase * 8], 8) == 0);
+    if (!erased && (erase || !same))
+      nbCommands++;
   }
+
+  // Every command must fit, so a full queue never leaves the sector erased
+  if (Flash_QueueFree() < nbCommands)
+    return false;
+
+  // The last command of the chain reports back to the user
+  for (int i = 0; i < nbCommands; i++)
+  {
+    bool last = (i == nbCommands - 1);
+    QueueCommand(&commandObjects[i], last, last ? userFunction : NULL,
+        last ? userArguments : NULL);
+  }
+
+  // The image now matches what the flash will hold once the queue has run
+  memcpy(DataImage, DataBuffer, FLASH_SIZE);
+  return true;
+}
+
+/*! @brief Enables the Flash module.
+ *
+ *  @return bool - TRUE if the Flash was setup successfully.
+ */
+bool Flash_Init(void)
+{
+  // Wait for any command left running by a reset to finish
+  while (!(FTFE_FSTAT & FTFE_FSTAT_CCIF_MASK))
+    ;
+
+  // Clear any error flags left over from a previous command
+  FTFE_FSTAT = FTFE_FSTAT_ACCERR_MASK | FTFE_FSTAT_FPVIOL_MASK;
+
+  // Load the RAM image of the data region and work out which bytes are in use
+  for (int i = 0; i < FLASH_SIZE; i++)
+    DataImage[i] = _FB(FLASH_DATA_START+i);
+  BuildAllocationMap();
+
+  // Clear any pending interrupts from the FTFE command complete interrupt
+  NVICICPR0 |= (1 << 18);
+
+  // Turn on NVIC for the FTFE command complete interrupt
+  NVICISER0 |= (1 << 18);
+
   return true;
 }
 
@@ -143,59 +417,81 @@ static bool FlashBackup(void)
  *         If the variable is a word, then an address divisible by 4.
  *         This allows the resulting variable to be used with the relevant Flash_Write function which assumes a certain memory address.
  *         e.g. a 16-bit variable will be on an even address
- *  @param size The size, in bytes, of the variable that is to be allocated space in the Flash memory. Valid values are 1, 2 and 4.
+ *         If the variable is a phrase, then an address divisible by 8.
+ *  @param size The size, in bytes, of the variable that is to be allocated space in the Flash memory. Valid values are 1, 2, 4 and 8.
  *  @return bool - TRUE if the variable was allocated space in the Flash memory.
  *  @note Assumes Flash has been initialized.
  */
 bool Flash_AllocateVar(volatile void** variable, const uint8_t size)
 {
-  bool addressFound = true;
-  uint8_t addressIndex = -1;
-
-  // Ensure that the index is in the correct position
-  if (size == 1 || size == 2 || size == 4)
+  for (int word = 0; word < sizeof(AllocationMap) / sizeof(AllocationMap[0]);
+      word++)
   {
+    // Fold the free bits of this word down so that bit n is still set only
+    // if the whole size-aligned run starting at byte n is free
+    uint32_t free = ~AllocationMap[word];
+    uint32_t candidates;
+    uint32_t runMask;
 
-    // Ensure that there are enough consecutive free bytes for the variable size
-    for (int i = 0; i < FLASH_SIZE; i += size)
+    switch (size)
     {
-
-      // If the index i is free
-      if (_FB(FLASH_DATA_START+i) == 0xFF)
-      {
-
-        // Check that the next (size-1) bytes are also free
-        for (int j = 1; j < size; j++)
-        {
-
-          //If there are not enough free consecutive free bytes or we have run
-          // out of flash space, break out of the loop
-          if ((i + j) >= (FLASH_SIZE) || _FB(FLASH_DATA_START+(i+j)) != 0xFF)
-          {
-            addressFound = false;
-            break;
-          }
-        }
-
-        // If a suitable address has been found, store the initial index
-        if (addressFound)
-        {
-          addressIndex = i;
-          break;
-        }
-      }
+    case 1:
+      candidates = free;
+      runMask = 0x1;
+      break;
+    case 2:
+      candidates = free & (free >> 1) & 0x55555555LU;
+      runMask = 0x3;
+      break;
+    case 4:
+      free &= free >> 1;
+      candidates = free & (free >> 2) & 0x11111111LU;
+      runMask = 0xF;
+      break;
+    case 8:
+      free &= free >> 1;
+      free &= free >> 2;
+      candidates = free & (free >> 4) & 0x01010101LU;
+      runMask = 0xFF;
+      break;
+    default:
+      return false;
     }
 
-    // Put the address value into the pointer variable
-    if (addressFound)
+    if (candidates)
     {
-      *variable = (void*) (FLASH_DATA_START + addressIndex);
+      // Take the lowest suitable run and mark it in use
+      uint8_t bit = __builtin_ctz(candidates);
+      AllocationMap[word] |= runMask << bit;
+
+      // Put the address value into the pointer variable
+      *variable = (void*) (FLASH_DATA_START + word * FLASH_MAP_BITS + bit);
       return true;
     }
   }
   return false;
 }
 
+/*! @brief Reads bytes of the data region.
+ *
+ *  The bytes come from the RAM image of the region, which already holds every
+ *  queued write, so the read never collides with a command running on the Flash.
+ *  @param offset The offset of the first byte from FLASH_DATA_START.
+ *  @param data A pointer to memory to store the bytes in.
+ *  @param length The number of bytes to read.
+ *  @return bool - TRUE if the bytes lie inside the data region.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_Read(const uint8_t offset, uint8_t * const data,
+    const uint8_t length)
+{
+  if (offset >= FLASH_SIZE || length > FLASH_SIZE - offset)
+    return false;
+
+  memcpy(data, &DataImage[offset], length);
+  return true;
+}
+
 /*! @brief Writes a 64-bit number to Flash.
  *
  *  @param address The address of the data.
@@ -205,46 +501,8 @@ bool Flash_AllocateVar(volatile void** variable, const uint8_t size)
  */
 bool Flash_Write64(volatile uint32_t* const address, const uint64_t data)
 {
-  // Calculate the index of the target address from the starting address
-  uint8_t index = (uint32_t) address - FLASH_DATA_START;
-
-  // Check to see if the index is within the flash bounds
-  if (index < 0 || index >= FLASH_SIZE || index % 8 != 0)
-  {
-    return false;
-  }
-
-  // Set up a new command object to program a phrase
-  SetupCommand(&CommonCommandObject, PROGRAM_PHRASE_COMMAND);
-
-  // Back up the state of the flash so it can be restored after clearing
-  bool status = FlashBackup();
-
-  // Set the data into the common command object at the target index
-  uint64union_t data64Union = { .l = data };
-  uint32union_t data32UnionHi = { .l = data64Union.s.Hi };
-  uint32union_t data32UnionLo = { .l = data64Union.s.Lo };
-  uint16union_t data16UnionHiHi = { .l = data32UnionHi.s.Hi };
-  uint16union_t data16UnionHiLo = { .l = data32UnionHi.s.Lo };
-  uint16union_t data16UnionLoHi = { .l = data32UnionLo.s.Hi };
-  uint16union_t data16UnionLoLo = { .l = data32UnionLo.s.Lo };
-  CommonCommandObject.data[index] = data16UnionLoLo.s.Lo;
-  CommonCommandObject.data[index + 1] = data16UnionLoLo.s.Hi;
-  CommonCommandObject.data[index + 2] = data16UnionLoHi.s.Lo;
-  CommonCommandObject.data[index + 3] = data16UnionLoHi.s.Hi;
-  CommonCommandObject.data[index + 4] = data16UnionHiLo.s.Lo;
-  CommonCommandObject.data[index + 5] = data16UnionHiLo.s.Hi;
-  CommonCommandObject.data[index + 6] = data16UnionHiHi.s.Lo;
-  CommonCommandObject.data[index + 7] = data16UnionHiHi.s.Hi;
-
-  // Erase the flash sector
-  status &= Flash_Erase();
-
-  // Execute the program phase command and put the data in
-  // the common command object back into the flash
-  status &= LaunchCommand(&CommonCommandObject);
-
-  return status;
+  TFlashUpdate update = { .address = address, .size = 8, .value = data };
+  return Flash_WriteScatter(&update, 1);
 }
 
 /*! @brief Writes a 32-bit number to Flash.
@@ -256,38 +514,8 @@ bool Flash_Write64(volatile uint32_t* const address, const uint64_t data)
  */
 bool Flash_Write32(volatile uint32_t* const address, const uint32_t data)
 {
-  // Calculate the index of the target address from the starting address
-  uint8_t index = (uint32_t) address - FLASH_DATA_START;
-
-  // Check to see if the index is within the flash bounds
-  if (index < 0 || index >= FLASH_SIZE || index % 4 != 0)
-  {
-    return false;
-  }
-
-  // Set up a new command object to program a phrase
-  SetupCommand(&CommonCommandObject, PROGRAM_PHRASE_COMMAND);
-
-  // Back up the state of the flash so it can be restored after clearing
-  bool status = FlashBackup();
-
-  // Set the data into the common command object at the target index
-  uint32union_t dataUnion = { .l = data };
-  uint16union_t dataUnionHi = { .l = dataUnion.s.Hi }, dataUnionLo = { .l =
-      dataUnion.s.Lo };
-  CommonCommandObject.data[index] = dataUnionLo.s.Lo;
-  CommonCommandObject.data[index + 1] = dataUnionLo.s.Hi;
-  CommonCommandObject.data[index + 2] = dataUnionHi.s.Lo;
-  CommonCommandObject.data[index + 3] = dataUnionHi.s.Hi;
-
-  // Erase the flash sector
-  status &= Flash_Erase();
-
-  // Execute the program phase command and put the data in
-  // the common command object back into the flash
-  status &= LaunchCommand(&CommonCommandObject);
-
-  return status;
+  TFlashUpdate update = { .address = address, .size = 4, .value = data };
+  return Flash_WriteScatter(&update, 1);
 }
 
 /*! @brief Writes a 16-bit number to Flash.
@@ -299,34 +527,8 @@ bool Flash_Write32(volatile uint32_t* const address, const uint32_t data)
  */
 bool Flash_Write16(volatile uint16_t* const address, const uint16_t data)
 {
-  // Calculate the index of the target address from the starting address
-  uint8_t index = (uint32_t) address - FLASH_DATA_START;
-
-  // Check to see if the index is within the flash bounds
-  if (index < 0 || index >= FLASH_SIZE || index % 2 != 0)
-  {
-    return false;
-  }
-
-  // Set up a new command object to program a phrase
-  SetupCommand(&CommonCommandObject, PROGRAM_PHRASE_COMMAND);
-
-  // Back up the state of the flash so it can be restored after clearing
-  bool status = FlashBackup();
-
-  // Set the data into the common command object at the target index
-  uint16union_t dataUnion = { .l = data };
-  CommonCommandObject.data[index] = dataUnion.s.Lo;
-  CommonCommandObject.data[index + 1] = dataUnion.s.Hi;
-
-  // Erase the flash sector
-  status &= Flash_Erase();
-
-  // Execute the program phase command and put the data in
-  // the common command object back into the flash
-  status &= LaunchCommand(&CommonCommandObject);
-
-  return status;
+  TFlashUpdate update = { .address = address, .size = 2, .value = data };
+  return Flash_WriteScatter(&update, 1);
 }
 
 /*! @brief Writes an 8-bit number to Flash.
@@ -338,31 +540,97 @@ bool Flash_Write16(volatile uint16_t* const address, const uint16_t data)
  */
 bool Flash_Write8(volatile uint8_t* const address, const uint8_t data)
 {
-  // Calculate the index of the target address from the starting address
-  uint8_t index = (uint32_t) address - FLASH_DATA_START;
+  TFlashUpdate update = { .address = address, .size = 1, .value = data };
+  return Flash_WriteScatter(&update, 1);
+}
 
-  // Check to see if the index is within the flash bounds
-  if (index < 0 || index >= FLASH_SIZE)
+/*! @brief Writes an 8-bit number to Flash without waiting for the Flash.
+ *
+ *  @param address The address of the data.
+ *  @param data The 8-bit data to write.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the write completes, or straight away if the data is already stored, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the write was queued, FALSE if the address is out of range or the queue is full.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_Write8Async(volatile uint8_t* const address, const uint8_t data,
+    void (*userFunction)(bool, void*), void* userArguments)
+{
+  TFlashUpdate update = { .address = address, .size = 1, .value = data };
+  return Flash_WriteScatterAsync(&update, 1, userFunction, userArguments);
+}
+
+/*! @brief Writes several values to Flash with one update of the data sector.
+ *
+ *  @param updates The values and where they go.
+ *  @param nbUpdates The number of values.
+ *  @return bool - TRUE if Flash was written successfully, FALSE if a value is out of range or not aligned to its size or if there is a programming error.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_WriteScatter(const TFlashUpdate updates[], const uint8_t nbUpdates)
+{
+  volatile bool status = false;
+  return WaitSync(
+      Flash_WriteScatterAsync(updates, nbUpdates, SyncComplete,
+          (void*) &status), &status);
+}
+
+/*! @brief Writes several values to Flash with one update of the data sector, without waiting for the Flash.
+ *
+ *  Every value is checked before any is written, and the values are merged
+ *  so every phrase they touch is programmed at most once.
+ *  @param updates The values and where they go.
+ *  @param nbUpdates The number of values.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the write completes, or straight away if the data is already stored, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the write was queued, FALSE if a value is out of range or not aligned to its size or the queue is full.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_WriteScatterAsync(const TFlashUpdate updates[],
+    const uint8_t nbUpdates, void (*userFunction)(bool, void*),
+    void* userArguments)
+{
+  // Back up the state of the flash and set every value over it
+  FlashBackup();
+  for (int i = 0; i < nbUpdates; i++)
   {
-    return false;
+    if (!StageUpdate(&updates[i]))
+      return false;
   }
 
-  // Set up a new command object to program a phrase
-  SetupCommand(&CommonCommandObject, PROGRAM_PHRASE_COMMAND);
+  // Queue whatever the changed phrases need
+  return CommitData(userFunction, userArguments);
+}
 
-  // Back up the state of the flash so it can be restored after clearing
-  bool status = FlashBackup();
+/*! @brief Writes a block of bytes to Flash without waiting for the Flash.
+ *
+ *  The whole block is committed with a single update of the data sector.
+ *  @param address The address of the first byte of the block.
+ *  @param data A pointer to the bytes to write.
+ *  @param length The number of bytes to write.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the write completes, or straight away if the data is already stored, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the write was queued, FALSE if the block is out of range or the queue is full.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_WriteBlockAsync(volatile uint8_t* const address,
+    const uint8_t* const data, const uint32_t length,
+    void (*userFunction)(bool, void*), void* userArguments)
+{
+  // Calculate the index of the target address from the starting address
+  uint32_t index = (uintptr_t) address - FLASH_DATA_START;
 
-  // Set the data into the common command object at the target index
-  CommonCommandObject.data[index] = data;
+  // Check to see if the whole block is within the flash bounds
+  if (index >= FLASH_SIZE || length > FLASH_SIZE - index)
+    return false;
 
-  // Erase the flash sector
-  status &= Flash_Erase();
+  // Back up the state of the flash and copy the block over it
+  FlashBackup();
+  for (uint32_t i = 0; i < length; i++)
+    DataBuffer[index + i] = data[i];
 
-  // Execute the program phase command and put the data in
-  // the common command object back into the flash
-  status &= LaunchCommand(&CommonCommandObject);
-  return status;
+  // Queue whatever the changed phrases need
+  return CommitData(userFunction, userArguments);
 }
 
 /*! @brief Erases the entire Flash sector.
@@ -372,13 +640,216 @@ bool Flash_Write8(volatile uint8_t* const address, const uint8_t data)
  */
 bool Flash_Erase(void)
 {
-  // Make a new common command object with command set to erase
-  // and launch it
+  volatile bool status = false;
+  return WaitSync(Flash_EraseAsync(SyncComplete, (void*) &status), &status);
+}
+
+/*! @brief Erases the entire Flash sector without waiting for the Flash.
+ *
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the erase completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the erase was queued.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_EraseAsync(void (*userFunction)(bool, void*), void* userArguments)
+{
+  return Flash_EraseSectorAsync(FLASH_DATA_START, userFunction,
+      userArguments);
+}
+
+/*! @brief Programs one phrase anywhere in the Flash.
+ *
+ *  @param address The address of the phrase, which must be aligned to an 8-byte boundary.
+ *  @param phrase The 64-bit data to program, stored little-endian.
+ *  @return bool - TRUE if the phrase was programmed successfully.
+ *  @note Assumes the phrase has been erased.
+ */
+bool Flash_ProgramPhrase(const uint32_t address, const uint64_t phrase)
+{
+  volatile bool status = false;
+  return WaitSync(
+      Flash_ProgramPhraseAsync(address, phrase, SyncComplete,
+          (void*) &status), &status);
+}
+
+/*! @brief Queue the program of one phrase anywhere in the Flash.
+ *
+ *  @param address The address of the phrase, which must be aligned to an 8-byte boundary.
+ *  @param phrase The 64-bit data to program, stored little-endian.
+ *  @param endChain TRUE if this is the last command of its chain.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the chain completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the program was queued.
+ */
+static bool QueuePhrase(const uint32_t address, const uint64_t phrase,
+    const bool endChain, void (*userFunction)(bool, void*),
+    void* userArguments)
+{
+  if (address % 8 != 0)
+    return false;
+
+  TFCCOB commonCommandObject;
+  SetupCommand(&commonCommandObject, PROGRAM_PHRASE_COMMAND);
+  commonCommandObject.address = address;
+
+  // Split the phrase into bytes, lowest address first
+  for (int i = 0; i < 8; i++)
+    commonCommandObject.data[i] = (uint8_t) (phrase >> (8 * i));
+
+  return QueueCommand(&commonCommandObject, endChain, userFunction,
+      userArguments);
+}
+
+/*! @brief Queue the erase of the Flash sector containing an address.
+ *
+ *  @param address Any address inside the sector to erase.
+ *  @param endChain TRUE if this is the last command of its chain.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the chain completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the erase was queued.
+ */
+static bool QueueErase(const uint32_t address, const bool endChain,
+    void (*userFunction)(bool, void*), void* userArguments)
+{
   TFCCOB commonCommandObject;
   SetupCommand(&commonCommandObject, ERASE_FLASH_SECTOR_COMMAND);
-  return LaunchCommand(&commonCommandObject);
+  commonCommandObject.address = address & ~(FLASH_SECTOR_SIZE - 1);
+
+  if (!QueueCommand(&commonCommandObject, endChain, userFunction,
+      userArguments))
+    return false;
+
+  // Keep the RAM image in step if this is the data sector
+  if (commonCommandObject.address
+      == (FLASH_DATA_START & ~(FLASH_SECTOR_SIZE - 1)))
+  {
+    for (int i = 0; i < FLASH_SIZE; i++)
+      DataImage[i] = 0xFF;
+
+    // Every variable in the data region is lost
+    BuildAllocationMap();
+  }
+  return true;
+}
+
+/*! @brief Programs one phrase anywhere in the Flash without waiting for the Flash.
+ *
+ *  The program ends a chain, the user function gets the result of every command since the last chain ended.
+ *  @param address The address of the phrase, which must be aligned to an 8-byte boundary.
+ *  @param phrase The 64-bit data to program, stored little-endian.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the program completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the program was queued.
+ *  @note Assumes the phrase has been erased.
+ */
+bool Flash_ProgramPhraseAsync(const uint32_t address, const uint64_t phrase,
+    void (*userFunction)(bool, void*), void* userArguments)
+{
+  return QueuePhrase(address, phrase, true, userFunction, userArguments);
+}
+
+/*! @brief Programs one phrase anywhere in the Flash as part of a chain, without waiting for the Flash.
+ *
+ *  Its result is reported with the command that ends the chain.
+ *  @param address The address of the phrase, which must be aligned to an 8-byte boundary.
+ *  @param phrase The 64-bit data to program, stored little-endian.
+ *  @return bool - TRUE if the program was queued.
+ *  @note Assumes the phrase has been erased.
+ */
+bool Flash_ProgramPhraseChainAsync(const uint32_t address,
+    const uint64_t phrase)
+{
+  return QueuePhrase(address, phrase, false, NULL, NULL);
+}
+
+/*! @brief Erases the Flash sector containing an address.
+ *
+ *  @param address Any address inside the sector to erase.
+ *  @return bool - TRUE if the sector was erased successfully.
+ */
+bool Flash_EraseSector(const uint32_t address)
+{
+  volatile bool status = false;
+  return WaitSync(
+      Flash_EraseSectorAsync(address, SyncComplete, (void*) &status),
+      &status);
+}
+
+/*! @brief Erases the Flash sector containing an address without waiting for the Flash.
+ *
+ *  The erase ends a chain, the user function gets the result of every command since the last chain ended.
+ *  @param address Any address inside the sector to erase.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the erase completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the erase was queued.
+ */
+bool Flash_EraseSectorAsync(const uint32_t address,
+    void (*userFunction)(bool, void*), void* userArguments)
+{
+  return QueueErase(address, true, userFunction, userArguments);
+}
+
+/*! @brief Erases the Flash sector containing an address as part of a chain, without waiting for the Flash.
+ *
+ *  Its result is reported with the command that ends the chain.
+ *  @param address Any address inside the sector to erase.
+ *  @return bool - TRUE if the erase was queued.
+ */
+bool Flash_EraseSectorChainAsync(const uint32_t address)
+{
+  return QueueErase(address, false, NULL, NULL);
+}
+
+/*! @brief Checks if any Flash commands are queued or running.
+ *
+ *  @return bool - TRUE if the Flash is busy.
+ */
+bool Flash_Busy(void)
+{
+  return QueueStart != QueueEnd;
+}
+
+/*! @brief Gets the number of commands that can currently be queued.
+ *
+ *  @return uint8_t - The number of free slots in the command queue.
+ */
+uint8_t Flash_QueueFree(void)
+{
+  return FLASH_QUEUE_SIZE - (uint8_t) (QueueEnd - QueueStart);
+}
+
+/*! @brief Waits for every queued Flash command to complete.
+ *
+ *  Works with interrupts disabled by polling the completion flag.
+ *  @return void
+ */
+void Flash_Wait(void)
+{
+  while (Flash_Busy())
+  {
+    // Run the completion step here in case interrupts are disabled
+    EnterCritical();
+    if (Flash_Busy() && (FTFE_FSTAT & FTFE_FSTAT_CCIF_MASK))
+      CommandComplete();
+    ExitCritical();
+  }
 }
 
 /*!
  ** @}
  */
+
+/*! @brief Interrupt service routine for the FTFE command complete interrupt.
+ *
+ *  Completes the running command and starts the next one in the queue.
+ *  @note Assumes Flash has been initialized.
+ */
+void __attribute__ ((interrupt)) FTFE_ISR(void)
+{
+  uint32_t start = Stats_Now();
+
+  if (Flash_Busy() && (FTFE_FSTAT & FTFE_FSTAT_CCIF_MASK))
+    CommandComplete();
+
+  Stats_Record(&Stats_ISRs[STATS_ISR_FLASH], start);
+}
@@ -18,23 +18,42 @@
 #include "types.h"
 
 // Macros for easy flash data access
+// The read macros may be replaced to run on a simulated flash
+#ifndef _FB
 #define _FB(flashAddress)  *(uint8_t  volatile *)(flashAddress) /*!< Macro for reading a byte from the flash at the given address */
 #define _FH(flashAddress)  *(uint16_t volatile *)(flashAddress) /*!< Macro for reading a half-word from the flash at the given address */
 #define _FW(flashAddress)  *(uint32_t volatile *)(flashAddress) /*!< Macro for reading a word from the flash at the given address */
 #define _FP(flashAddress)  *(uint64_t volatile *)(flashAddress) /*!< Macro for reading a phrase from the flash at the given address */
+#endif
+
+//!< Number of phrases (8 bytes each) in the Flash block we are using for data storage
+#ifndef FLASH_DATA_PHRASES
+#define FLASH_DATA_PHRASES 8
+#endif
 
 //!< Address of the start of the Flash block we are using for data storage
 #define FLASH_DATA_START 0x00080000LU /*<! The starting address of our specfied flash block */
 //!< Address of the end of the Flash block we are using for data storage
-#define FLASH_DATA_END   0x00080007LU /*<! The ending address of our specfied flash block*/
+#define FLASH_DATA_END   (FLASH_DATA_START + FLASH_DATA_PHRASES * 8 - 1) /*<! The ending address of our specfied flash block*/
 
 #define FLASH_SIZE (FLASH_DATA_END-FLASH_DATA_START+1)
 
+//!< Number of bytes in one erasable sector of program flash
+#define FLASH_SECTOR_SIZE 0x1000LU
+
+//!< Struct for one value of a scatter write
+typedef struct
+{
+  volatile void* address; /*!< The address of the value, aligned to its size */
+  uint8_t size; /*!< The size of the value in bytes, 1, 2, 4 or 8 */
+  uint64_t value; /*!< The value, stored little-endian */
+} TFlashUpdate;
+
 /*! @brief Enables the Flash module.
  *
  *  @return bool - TRUE if the Flash was setup successfully.
  */
-extern bool Flash_Init(void);
+bool Flash_Init(void);
 
 /*! @brief Allocates space for a non-volatile variable in the Flash memory.
  *
@@ -45,12 +64,26 @@ extern bool Flash_Init(void);
  *         If the variable is a word, then an address divisible by 4.
  *         This allows the resulting variable to be used with the relevant Flash_Write function which assumes a certain memory address.
  *         e.g. a 16-bit variable will be on an even address
- *  @param size The size, in bytes, of the variable that is to be allocated space in the Flash memory. Valid values are 1, 2 and 4.
+ *         If the variable is a phrase, then an address divisible by 8.
+ *  @param size The size, in bytes, of the variable that is to be allocated space in the Flash memory. Valid values are 1, 2, 4 and 8.
  *  @return bool - TRUE if the variable was allocated space in the Flash memory.
  *  @note Assumes Flash has been initialized.
  */
 bool Flash_AllocateVar(volatile void** variable, const uint8_t size);
 
+/*! @brief Reads bytes of the data region.
+ *
+ *  The bytes come from the RAM image of the region, which already holds every
+ *  queued write, so the read never collides with a command running on the Flash.
+ *  @param offset The offset of the first byte from FLASH_DATA_START.
+ *  @param data A pointer to memory to store the bytes in.
+ *  @param length The number of bytes to read.
+ *  @return bool - TRUE if the bytes lie inside the data region.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_Read(const uint8_t offset, uint8_t * const data,
+    const uint8_t length);
+
 /*! @brief Writes a 32-bit number to Flash.
  *
  *  @param address The address of the data.
@@ -78,6 +111,15 @@ bool Flash_Write16(volatile uint16_t* const address, const uint16_t data);
  */
 bool Flash_Write8(volatile uint8_t* const address, const uint8_t data);
 
+/*! @brief Writes several values to Flash with one update of the data sector.
+ *
+ *  @param updates The values and where they go.
+ *  @param nbUpdates The number of values.
+ *  @return bool - TRUE if Flash was written successfully, FALSE if a value is out of range or not aligned to its size or if there is a programming error.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_WriteScatter(const TFlashUpdate updates[], const uint8_t nbUpdates);
+
 /*! @brief Erases the entire Flash sector.
  *
  *  @return bool - TRUE if the Flash "data" sector was erased successfully.
@@ -85,8 +127,144 @@ bool Flash_Write8(volatile uint8_t* const address, const uint8_t data);
  */
 bool Flash_Erase(void);
 
+/*! @brief Programs one phrase anywhere in the Flash.
+ *
+ *  @param address The address of the phrase, which must be aligned to an 8-byte boundary.
+ *  @param phrase The 64-bit data to program, stored little-endian.
+ *  @return bool - TRUE if the phrase was programmed successfully.
+ *  @note Assumes the phrase has been erased.
+ */
+bool Flash_ProgramPhrase(const uint32_t address, const uint64_t phrase);
+
+/*! @brief Erases the Flash sector containing an address.
+ *
+ *  @param address Any address inside the sector to erase.
+ *  @return bool - TRUE if the sector was erased successfully.
+ */
+bool Flash_EraseSector(const uint32_t address);
+
+/*! @brief Writes an 8-bit number to Flash without waiting for the Flash.
+ *
+ *  @param address The address of the data.
+ *  @param data The 8-bit data to write.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the write completes, or straight away if the data is already stored, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the write was queued, FALSE if the address is out of range or the queue is full.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_Write8Async(volatile uint8_t* const address, const uint8_t data,
+    void (*userFunction)(bool, void*), void* userArguments);
+
+/*! @brief Writes a block of bytes to Flash without waiting for the Flash.
+ *
+ *  The whole block is committed with a single erase and program of the data sector.
+ *  @param address The address of the first byte of the block.
+ *  @param data A pointer to the bytes to write.
+ *  @param length The number of bytes to write.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the write completes, or straight away if the data is already stored, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the write was queued, FALSE if the block is out of range or the queue is full.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_WriteBlockAsync(volatile uint8_t* const address,
+    const uint8_t* const data, const uint32_t length,
+    void (*userFunction)(bool, void*), void* userArguments);
+
+/*! @brief Writes several values to Flash with one update of the data sector, without waiting for the Flash.
+ *
+ *  Every value is checked before any is written, and the values are merged
+ *  so every phrase they touch is programmed at most once.
+ *  @param updates The values and where they go.
+ *  @param nbUpdates The number of values.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the write completes, or straight away if the data is already stored, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the write was queued, FALSE if a value is out of range or not aligned to its size or the queue is full.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_WriteScatterAsync(const TFlashUpdate updates[],
+    const uint8_t nbUpdates, void (*userFunction)(bool, void*),
+    void* userArguments);
+
+/*! @brief Erases the entire Flash sector without waiting for the Flash.
+ *
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the erase completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the erase was queued.
+ *  @note Assumes Flash has been initialized.
+ */
+bool Flash_EraseAsync(void (*userFunction)(bool, void*), void* userArguments);
+
+/*! @brief Programs one phrase anywhere in the Flash without waiting for the Flash.
+ *
+ *  The program ends a chain, the user function gets the result of every command since the last chain ended.
+ *  @param address The address of the phrase, which must be aligned to an 8-byte boundary.
+ *  @param phrase The 64-bit data to program, stored little-endian.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the program completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the program was queued.
+ *  @note Assumes the phrase has been erased.
+ */
+bool Flash_ProgramPhraseAsync(const uint32_t address, const uint64_t phrase,
+    void (*userFunction)(bool, void*), void* userArguments);
+
+/*! @brief Programs one phrase anywhere in the Flash as part of a chain, without waiting for the Flash.
+ *
+ *  Its result is reported with the command that ends the chain.
+ *  @param address The address of the phrase, which must be aligned to an 8-byte boundary.
+ *  @param phrase The 64-bit data to program, stored little-endian.
+ *  @return bool - TRUE if the program was queued.
+ *  @note Assumes the phrase has been erased.
+ */
+bool Flash_ProgramPhraseChainAsync(const uint32_t address,
+    const uint64_t phrase);
+
+/*! @brief Erases the Flash sector containing an address without waiting for the Flash.
+ *
+ *  The erase ends a chain, the user function gets the result of every command since the last chain ended.
+ *  @param address Any address inside the sector to erase.
+ *  @param userFunction is a pointer to a function called from the FTFE interrupt when the erase completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the erase was queued.
+ */
+bool Flash_EraseSectorAsync(const uint32_t address,
+    void (*userFunction)(bool, void*), void* userArguments);
+
+/*! @brief Erases the Flash sector containing an address as part of a chain, without waiting for the Flash.
+ *
+ *  Its result is reported with the command that ends the chain.
+ *  @param address Any address inside the sector to erase.
+ *  @return bool - TRUE if the erase was queued.
+ */
+bool Flash_EraseSectorChainAsync(const uint32_t address);
+
+/*! @brief Checks if any Flash commands are queued or running.
+ *
+ *  @return bool - TRUE if the Flash is busy.
+ */
+bool Flash_Busy(void);
+
+/*! @brief Gets the number of commands that can currently be queued.
+ *
+ *  @return uint8_t - The number of free slots in the command queue.
+ */
+uint8_t Flash_QueueFree(void);
+
+/*! @brief Waits for every queued Flash command to complete.
+ *
+ *  Works with interrupts disabled by polling the completion flag.
+ *  @return void
+ */
+void Flash_Wait(void);
+
 #endif
 
 /*!
  ** @}
  */
+
+/*! @brief Interrupt service routine for the FTFE command complete interrupt.
+ *
+ *  Completes the running command and starts the next one in the queue.
+ *  @note Assumes Flash has been initialized.
+ */
+void __attribute__ ((interrupt)) FTFE_ISR(void);
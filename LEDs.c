@@ -14,6 +14,30 @@
 
 #include "LEDs.h"
 #include "MK70F12.h"
+#include "Cpu.h"
+#include "Stats.h"
+
+//@{
+//!< The pin functions of the blue and orange LEDs, as a GPIO or as an FTM2 channel
+#define LEDS_MUX_GPIO 1
+#define LEDS_MUX_FTM 3
+//@}
+
+//!< FIXED_FREQ_CLK is used to set the CLKS to the fixed clock
+#define FIXED_FREQ_CLK 2
+
+//!< The FTM2 prescaler, the fixed clock is divided by 2^LEDS_PRESCALE
+#define LEDS_PRESCALE 3
+
+//!< The pins of the blue and orange LEDs on port A, in the order of their FTM2 channels
+static const uint8_t Pins[LEDS_NB_CHANNELS] = { 10, 11 };
+
+static TLEDPattern Patterns[LEDS_NB_CHANNELS]; /*!< The pattern of each FTM channel */
+static uint8_t LastCount[LEDS_NB_CHANNELS]; /*!< The activity count seen at the last period */
+static uint8_t Hold[LEDS_NB_CHANNELS]; /*!< The periods left that each activity LED stays on for */
+static uint16_t PeriodCounts; /*!< The FTM counts in a period */
+
+uint8_t volatile LEDs_ActivityCount[LEDS_NB_CHANNELS];
 
 /*! @brief Sets up the LEDs before first use.
  *
@@ -43,9 +67,128 @@ bool LEDs_Init(void)
   // remain turned off until the bit is manually cleared
   GPIOA_PDOR |= (LED_ORANGE | LED_YELLOW | LED_GREEN | LED_BLUE);
 
+  // Enable clock gate control bit for FTM2
+  SIM_SCGC3 |= SIM_SCGC3_FTM2_MASK;
+
+  // Disable Write Protection, FTMEN stays clear so the duty of every
+  // channel is loaded at the start of the next period
+  FTM2_MODE = FTM_MODE_WPDIS_MASK;
+  FTM2_SC = 0;
+  FTM2_CNTIN = 0;
+
+  // Both channels are edge-aligned PWM with low-true pulses, the LEDs are
+  // active low so they are on from the start of a period until the match
+  for (int n = 0; n < LEDS_NB_CHANNELS; n++)
+  {
+    Patterns[n] = LED_PATTERN_OFF;
+    Hold[n] = 0;
+    FTM2_CnSC(n) = FTM_CnSC_MSB_MASK | FTM_CnSC_ELSA_MASK;
+    FTM2_CnV(n) = 0;
+  }
+  LEDs_SetClock(CPU_MCGFF_CLK_HZ_CONFIG_0);
+
+  // Writing any value to CNT updates the counter with its initial value, CNTIN
+  FTM2_CNT = 0;
+
+  // Clear any pending interrupts from FTM2 and enable it in the NVIC
+  NVICICPR2 = (1 << 0);
+  NVICISER2 = (1 << 0);
+
+  // Run the FTM from the fixed frequency clock, the overflow interrupt
+  // stays off until an LED has the activity pattern
+  FTM2_SC = FTM_SC_CLKS(FIXED_FREQ_CLK) | FTM_SC_PS(LEDS_PRESCALE);
+  return true;
+}
+
+/*! @brief Gets the FTM2 duty of a pattern.
+ *
+ *  @param pattern The pattern.
+ *  @return uint16_t - The counts the LED is on for at the start of every period.
+ */
+static uint16_t Duty(const TLEDPattern pattern)
+{
+  switch (pattern)
+  {
+  case LED_PATTERN_BLINK:
+    return PeriodCounts / 2;
+  case LED_PATTERN_FLASH:
+    return PeriodCounts / 8;
+  default:
+    return 0;
+  }
+}
+
+/*! @brief Sets the pattern of an LED on an FTM channel.
+ *
+ *  The FTM drives the LED from then on, so blinking costs nothing per period.
+ *  Only the blue and orange LEDs have an FTM channel.
+ *  @param color The color of the LED.
+ *  @param pattern The pattern to drive it with.
+ *  @return bool - TRUE if the LED has an FTM channel.
+ *  @note Assumes that LEDs_Init has been called.
+ */
+bool LEDs_SetPattern(const TLED color, const TLEDPattern pattern)
+{
+  // The yellow and green LEDs are on pins without an FTM channel
+  uint8_t n;
+  if (color == LED_BLUE)
+    n = 0;
+  else if (color == LED_ORANGE)
+    n = 1;
+  else
+    return false;
+
+  EnterCritical();
+  Patterns[n] = pattern;
+  Hold[n] = 0;
+  LastCount[n] = LEDs_ActivityCount[n];
+  FTM2_CnV(n) = Duty(pattern);
+
+  // Steady LEDs are plain GPIO, so LEDs_On and LEDs_Off still work on them
+  bool gpio = (pattern == LED_PATTERN_OFF || pattern == LED_PATTERN_ON);
+  PORTA_PCR(Pins[n]) = (PORTA_PCR(Pins[n]) & ~PORT_PCR_MUX_MASK)
+      | PORT_PCR_MUX(gpio ? LEDS_MUX_GPIO : LEDS_MUX_FTM);
+  if (pattern == LED_PATTERN_ON)
+    LEDs_On(color);
+  else if (pattern == LED_PATTERN_OFF)
+    LEDs_Off(color);
+
+  // The overflow interrupt only runs while an LED shows activity
+  bool watch = false;
+  for (int i = 0; i < LEDS_NB_CHANNELS; i++)
+    watch |= (Patterns[i] == LED_PATTERN_ACTIVITY);
+  if (watch)
+    FTM2_SC |= FTM_SC_TOIE_MASK;
+  else
+    FTM2_SC &= ~FTM_SC_TOIE_MASK;
+  ExitCritical();
   return true;
 }
 
+/*! @brief Sets the clock the FTM counts the LED patterns with.
+ *
+ *  @param moduleClk The fixed frequency clock of the FTM in Hz.
+ *  @return void
+ *  @note Assumes that LEDs_Init has been called.
+ */
+void LEDs_SetClock(const uint32_t moduleClk)
+{
+  EnterCritical();
+  PeriodCounts = (uint16_t) ((moduleClk >> LEDS_PRESCALE) * LEDS_PERIOD_MS
+      / 1000);
+
+  // MOD and the duties are loaded at the end of the period
+  FTM2_MOD = PeriodCounts - 1;
+  for (int n = 0; n < LEDS_NB_CHANNELS; n++)
+  {
+    if (Patterns[n] == LED_PATTERN_ACTIVITY)
+      FTM2_CnV(n) = Hold[n] ? PeriodCounts : 0;
+    else
+      FTM2_CnV(n) = Duty(Patterns[n]);
+  }
+  ExitCritical();
+}
+
 /*! @brief Turns an LED on.
  *
  *  @param color The color of the LED to turn on.
@@ -111,6 +254,41 @@ void LEDs_Callback(void *arguments)
   }
 }
 
+/*! @brief Interrupt service routine for the LED patterns.
+ *
+ *  Once a period, turns every activity LED on or off for the next period.
+ *  @note Assumes that LEDs_Init has been called.
+ */
+void __attribute__ ((interrupt))
+FTM2_ISR(void)
+{
+  uint32_t start = Stats_Now();
+
+  // Clear the overflow flag, it has been read as set
+  FTM2_SC &= ~FTM_SC_TOF_MASK;
+
+  for (int n = 0; n < LEDS_NB_CHANNELS; n++)
+  {
+    if (Patterns[n] != LED_PATTERN_ACTIVITY)
+      continue;
+
+    // Any activity during the period restarts the hold
+    uint8_t count = LEDs_ActivityCount[n];
+    if (count != LastCount[n])
+    {
+      LastCount[n] = count;
+      Hold[n] = LEDS_ACTIVITY_HOLD;
+    }
+    else if (Hold[n])
+      Hold[n]--;
+
+    // A duty past MOD is on for the whole period, it is loaded at the start of the next one
+    FTM2_CnV(n) = Hold[n] ? PeriodCounts : 0;
+  }
+
+  Stats_Record(&Stats_ISRs[STATS_ISR_LEDS], start);
+}
+
 /*!
  ** @}
  */
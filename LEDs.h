@@ -28,6 +28,30 @@ typedef enum
   LED_BLUE = (1 << 10)
 } TLED;
 
+//!< The period of the patterns the FTM drives the LEDs with, in milliseconds
+#define LEDS_PERIOD_MS 250
+
+//!< The number of periods an activity LED stays on for after the last activity
+#define LEDS_ACTIVITY_HOLD 4
+
+//!< The number of LEDs on an FTM channel, the blue and orange LEDs are on FTM2 channels 0 and 1
+#define LEDS_NB_CHANNELS 2
+
+/*! @brief Patterns the FTM drives an LED with, without the processor
+ *
+ */
+typedef enum
+{
+  LED_PATTERN_OFF, /*!< Off, the pin is back under LEDs_On and LEDs_Off */
+  LED_PATTERN_ON, /*!< On, the pin is back under LEDs_On and LEDs_Off */
+  LED_PATTERN_BLINK, /*!< On for the first half of every period */
+  LED_PATTERN_FLASH, /*!< On for the first eighth of every period */
+  LED_PATTERN_ACTIVITY /*!< On for LEDS_ACTIVITY_HOLD periods after the last LEDs_Activity */
+} TLEDPattern;
+
+//! The number of times LEDs_Activity has been called for each FTM channel, only written from the main loop
+extern uint8_t volatile LEDs_ActivityCount[LEDS_NB_CHANNELS];
+
 /*! @brief An enum for the LED callback commands */
 enum LEDs_CALLBACK_COMMANDS
 {
@@ -75,6 +99,39 @@ LEDs_Off(const TLED color);
 void
 LEDs_Toggle(const TLED color);
 
+/*! @brief Sets the pattern of an LED on an FTM channel.
+ *
+ *  The FTM drives the LED from then on, so blinking costs nothing per period.
+ *  Only the blue and orange LEDs have an FTM channel.
+ *  @param color The color of the LED.
+ *  @param pattern The pattern to drive it with.
+ *  @return bool - TRUE if the LED has an FTM channel.
+ *  @note Assumes that LEDs_Init has been called.
+ */
+bool
+LEDs_SetPattern(const TLED color, const TLEDPattern pattern);
+
+/*! @brief Sets the clock the FTM counts the LED patterns with.
+ *
+ *  @param moduleClk The fixed frequency clock of the FTM in Hz.
+ *  @return void
+ *  @note Assumes that LEDs_Init has been called.
+ */
+void
+LEDs_SetClock(const uint32_t moduleClk);
+
+/*! @brief Notes activity for an LED with the LED_PATTERN_ACTIVITY pattern.
+ *
+ *  Only a count is updated, the FTM interrupt looks at it once a period.
+ *  @param color The blue or orange LED.
+ *  @return void
+ *  @note Call only from the main loop.
+ */
+static inline void LEDs_Activity(const TLED color)
+{
+  LEDs_ActivityCount[(color == LED_BLUE) ? 0 : 1]++;
+}
+
 /*! @brief A callback function that handles specific
  *  callback information
  *
@@ -85,6 +142,13 @@ LEDs_Toggle(const TLED color);
 void
 LEDs_Callback(void *arguments);
 
+/*! @brief Interrupt service routine for the LED patterns.
+ *
+ *  Once a period, turns every activity LED on or off for the next period.
+ *  @note Assumes that LEDs_Init has been called.
+ */
+void __attribute__ ((interrupt)) FTM2_ISR(void);
+
 #endif
 
 /*!
@@ -14,112 +14,286 @@
 
 #include "PIT.h"
 #include "MK70F12.h"
+#include "Deferred.h"
+#include "Stats.h"
+#include <stddef.h>
 
-static Callback CallbackFunction; /*!< A variable to hold the callback function and its arguments pointer */
+//@{
+//!< The channels chained into the 64-bit free running counter, the high word counts expiries of the low word
+#define PIT_NOW_LOW 2
+#define PIT_NOW_HIGH 3
+//@}
+
+//!< The first PIT interrupt in the NVIC, the channels follow in order
+#define PIT_IRQ 68
+
+static Callback Callbacks[PIT_NB_CHANNELS]; /*!< The callback function and its arguments pointer of every channel */
+static uint32_t ModuleClk; /*!< The module clock rate in Hz */
+static uint32_t Periods[PIT_NB_CHANNELS]; /*!< The period of every channel in nanoseconds, 0 until it is set */
+static uint32_t CounterClk; /*!< The clock rate the free running counter is reported in, the module clock given to PIT_Init */
+static uint64_t CounterBase; /*!< The reported count when the module clock last changed */
+static uint64_t RawBase; /*!< The hardware count when the module clock last changed */
 
 /*! @brief Sets up the PIT before first use.
  *
- *  Enables the PIT and freezes the timer when debugging.
+ *  Enables the PIT, freezes the timers when debugging and starts channels 2 and 3
+ *  as a chained 64-bit free running counter.
  *  @param moduleClk The module clock rate in Hz.
- *  @param userFunction is a pointer to a user callback function.
- *  @param userArguments is a pointer to the user arguments to use with the user callback function.
  *  @return bool - TRUE if the PIT was successfully initialized.
  *  @note Assumes that moduleClk has a period which can be expressed as an integral number of nanoseconds.
  */
-bool PIT_Init(const uint32_t moduleClk, void (*userFunction)(void*),
-    void* userArguments)
+bool PIT_Init(const uint32_t moduleClk)
 {
-  //@{
-  //!> Assign the arguments of the callback into our specific variable
-  CallbackFunction.callbackFunction = userFunction;
-  CallbackFunction.callbackArguments = userArguments;
-  //@}
+  ModuleClk = moduleClk;
+  CounterClk = moduleClk;
+  CounterBase = 0;
+  RawBase = 0;
 
   // Enable clock gate control bit for PIT
   SIM_SCGC6 |= SIM_SCGC6_PIT_MASK;
 
-  // Disable the PIT Module so the PIT can be setup
-  PIT_MCR |= PIT_MCR_MDIS_MASK;
+  // Enable the PIT Module, it has to be enabled before any other setup is done
+  PIT_MCR &= ~PIT_MCR_MDIS_MASK;
 
   // Enable freeze timer for debug mode (?)
   PIT_MCR |= PIT_MCR_FRZ_MASK;
 
-  // Clear any pending interrupts from PIT seconds interrupt
-  NVICICPR2 |= (1 << 4);
+  for (uint8_t channel = 0; channel < PIT_NB_CHANNELS; channel++)
+  {
+    Callbacks[channel].callbackFunction = NULL;
+    Periods[channel] = 0;
 
-  // Interrupt Set Enable PIT in the NVIC
-  NVICISER2 |= (1 << 4);
+    // Clear any pending interrupts from the channel
+    NVICICPR2 = (1 << ((PIT_IRQ + channel) % 32));
 
-  // Enable PIT Module interrupts mask
-  PIT_TCTRL0 |= PIT_TCTRL_TIE_MASK;
+    // Interrupt Set Enable the channel in the NVIC
+    NVICISER2 = (1 << ((PIT_IRQ + channel) % 32));
+  }
 
-  // Enable PIT Module
-  PIT_MCR &= ~PIT_MCR_MDIS_MASK;
+  // Start the free running counter: the low channel counts the module clock
+  // down from the largest value and the high channel counts down once every
+  // time the low one reloads
+  PIT_TCTRL(PIT_NOW_HIGH) = 0;
+  PIT_TCTRL(PIT_NOW_LOW) = 0;
+  PIT_LDVAL(PIT_NOW_HIGH) = 0xFFFFFFFF;
+  PIT_LDVAL(PIT_NOW_LOW) = 0xFFFFFFFF;
+  PIT_TCTRL(PIT_NOW_HIGH) = PIT_TCTRL_CHN_MASK | PIT_TCTRL_TEN_MASK;
+  PIT_TCTRL(PIT_NOW_LOW) = PIT_TCTRL_TEN_MASK;
 
-  //Todo - Set first, then enable? Or enable, then set...?
+  return true;
+}
 
-  //Set PIT timer and start PIT module
-  PIT_Set(moduleClk, true);
+/*! @brief Sets the callback of a PIT channel.
+ *
+ *  @param channel The channel, 0 to PIT_NB_CHANNELS - 1.
+ *  @param userFunction is a pointer to a user callback function, called from the main loop.
+ *  @param userArguments is a pointer to the user arguments to use with the user callback function.
+ *  @return bool - TRUE if the callback was set.
+ *  @note Assumes the PIT has been initialized.
+ */
+bool PIT_SetCallback(const uint8_t channel, void (*userFunction)(void*),
+    void* userArguments)
+{
+  if (channel >= PIT_NB_CHANNELS)
+    return false;
 
+  //@{
+  //!> Assign the arguments of the callback into our specific variable
+  Callbacks[channel].callbackFunction = userFunction;
+  Callbacks[channel].callbackArguments = userArguments;
+  //@}
   return true;
 }
 
-/*! @brief Sets the value of the desired period of the PIT.
+/*! @brief Sets the value of the desired period of a PIT channel.
  *
+ *  @param channel The channel, 0 to PIT_NB_CHANNELS - 1.
  *  @param period The desired value of the timer period in nanoseconds.
  *  @param restart TRUE if the PIT is disabled, a new value set, and then enabled.
  *                 FALSE if the PIT will use the new value after a trigger event.
- *  @note The function will enable the timer and interrupts for the PIT.
+ *  @return bool - TRUE if the period was set.
+ *  @note The function will enable the timer and interrupts for the channel.
  */
-void PIT_Set(const uint32_t period, const bool restart)
+bool PIT_Set(const uint8_t channel, const uint32_t period, const bool restart)
 {
+  if (channel >= PIT_NB_CHANNELS)
+    return false;
+
+  // Convert the period from nanoseconds into module clock ticks
+  uint32_t ticks = (uint64_t) period * ModuleClk / 1000000000LLU;
+  if (ticks == 0)
+    return false;
+  Periods[channel] = period;
+
   if (restart)
   {
-    PIT_Enable(false);
+    PIT_Enable(channel, false);
 
-    //Set PIT timer with period, passed down from main as CPU_BUS_CLK_HZ/2 for 0.5s and -1 for LDVAL
-    PIT_LDVAL0 = period - 1;
-    PIT_Enable(true);
+    //Set PIT timer with period, -1 for LDVAL
+    PIT_LDVAL(channel) = ticks - 1;
+    PIT_Enable(channel, true);
   }
   else
   {
     // The PIT is not restarting, so just set the new value
     // and it will be used after a trigger event
-    PIT_LDVAL0 = period - 1;
+    PIT_LDVAL(channel) = ticks - 1;
   }
+
+  // Enable the channel interrupt
+  PIT_TCTRL(channel) |= PIT_TCTRL_TIE_MASK;
+  return true;
 }
 
-/*! @brief Enables or disables the PIT.
+/*! @brief Enables or disables a PIT channel.
  *
- *  @param enable - TRUE if the PIT is to be enabled, FALSE if the PIT is to be disabled.
+ *  @param channel The channel, 0 to PIT_NB_CHANNELS - 1.
+ *  @param enable - TRUE if the channel is to be enabled, FALSE if the channel is to be disabled.
  */
-void PIT_Enable(const bool enable)
+void PIT_Enable(const uint8_t channel, const bool enable)
 {
+  if (channel >= PIT_NB_CHANNELS)
+    return;
+
   if (enable)
   {
     //Enables the PIT Timer to start counting from LDVAL value
-    PIT_TCTRL0 |= PIT_TCTRL_TEN_MASK;
+    PIT_TCTRL(channel) |= PIT_TCTRL_TEN_MASK;
   }
   else
   {
     //Disables the PIT Timer to stop counting
-    PIT_TCTRL0 &= ~PIT_TCTRL_TEN_MASK;
+    PIT_TCTRL(channel) &= ~PIT_TCTRL_TEN_MASK;
+  }
+}
+
+/*! @brief Reads the hardware count of the chained channels.
+ *
+ *  @return uint64_t - The number of module clock ticks the channels have counted.
+ */
+static uint64_t RawNow(void)
+{
+  uint32_t high, low;
+
+  // Read the high word again after the low word, so a reload of the low
+  // channel in between is never missed
+  do
+  {
+    high = PIT_CVAL(PIT_NOW_HIGH);
+    low = PIT_CVAL(PIT_NOW_LOW);
+  } while (high != PIT_CVAL(PIT_NOW_HIGH));
+
+  // Both channels count down from the largest value
+  return ~(((uint64_t) high << 32) | low);
+}
+
+/*! @brief Converts a hardware count to the count reported by PIT_Now.
+ *
+ *  @param raw A RawNow reading.
+ *  @return uint64_t - The count in ticks of the clock given to PIT_Init.
+ */
+static uint64_t Scale(const uint64_t raw)
+{
+  uint64_t ticks = raw - RawBase;
+  if (ModuleClk == CounterClk)
+    return CounterBase + ticks;
+
+  // Split off the whole seconds so the multiplication can not overflow
+  return CounterBase + (ticks / ModuleClk) * CounterClk
+      + (ticks % ModuleClk) * CounterClk / ModuleClk;
+}
+
+/*! @brief Reads the 64-bit free running counter.
+ *
+ *  The counter counts up at the module clock rate given to PIT_Init, also after
+ *  PIT_SetClock, and never wraps in practice. It takes no interrupts, so it can
+ *  be read from anywhere.
+ *  @return uint64_t - The number of module clock ticks since PIT_Init.
+ *  @note Assumes the PIT has been initialized.
+ */
+uint64_t PIT_Now(void)
+{
+  return Scale(RawNow());
+}
+
+/*! @brief Converts a number of ticks of the free running counter to nanoseconds.
+ *
+ *  @param ticks The number of ticks, usually the difference of two PIT_Now readings.
+ *  @return uint64_t - The number of nanoseconds.
+ *  @note Assumes the PIT has been initialized.
+ */
+uint64_t PIT_TicksToNs(const uint64_t ticks)
+{
+  // Split off the whole seconds so the multiplication can not overflow
+  return (ticks / CounterClk) * 1000000000LLU
+      + (ticks % CounterClk) * 1000000000LLU / CounterClk;
+}
+
+/*! @brief Changes the module clock rate the PIT is running from.
+ *
+ *  The periods of the running channels are kept, and the free running counter
+ *  carries on in ticks of the clock given to PIT_Init.
+ *  @param moduleClk The new module clock rate in Hz.
+ *  @return void
+ *  @note Call with interrupts disabled, straight after the clock has changed.
+ */
+void PIT_SetClock(const uint32_t moduleClk)
+{
+  // Start counting from the count reached at the old rate
+  uint64_t raw = RawNow();
+  CounterBase = Scale(raw);
+  RawBase = raw;
+  ModuleClk = moduleClk;
+
+  for (uint8_t channel = 0; channel < PIT_NB_CHANNELS; channel++)
+  {
+    if (Periods[channel] != 0 && (PIT_TCTRL(channel) & PIT_TCTRL_TEN_MASK))
+      PIT_Set(channel, Periods[channel], true);
   }
 }
 
-/*! @brief Interrupt service routine for the PIT.
+/*! @brief Acknowledges the interrupt of a channel and leaves its callback to the main loop.
+ *
+ *  @param channel The channel that has timed out.
+ *  @return void
+ */
+static void ChannelISR(const uint8_t channel)
+{
+  uint32_t start = Stats_Now();
+
+  //Reset the timer interrupt flag by writing a 1 to clear it
+  PIT_TFLG(channel) = PIT_TFLG_TIF_MASK;
+
+  // Leave the callback to the main loop
+  if (Callbacks[channel].callbackFunction)
+    Deferred_Post(Callbacks[channel].callbackFunction,
+        Callbacks[channel].callbackArguments);
+
+  Stats_Record(&Stats_ISRs[STATS_ISR_PIT], start);
+}
+
+/*! @brief Interrupt service routine for PIT channel 0.
  *
  *  The periodic interrupt timer has timed out.
- *  The user callback function will be called.
+ *  The user callback function will be called from the main loop.
  *  @note Assumes the PIT has been initialized.
  */
 void __attribute__ ((interrupt))
 PIT_ISR(void)
 {
-  //Reset the timer interrupt flag by writing a 1 to clear it
-  PIT_TFLG0 |= PIT_TFLG_TIF_MASK;
+  ChannelISR(0);
+}
 
-  CallbackFunction.callbackFunction(CallbackFunction.callbackArguments);
+/*! @brief Interrupt service routine for PIT channel 1.
+ *
+ *  The periodic interrupt timer has timed out.
+ *  The user callback function will be called from the main loop.
+ *  @note Assumes the PIT has been initialized.
+ */
+void __attribute__ ((interrupt))
+PIT1_ISR(void)
+{
+  ChannelISR(1);
 }
 
 /*!
@@ -18,42 +18,93 @@
 // new types
 #include "types.h"
 
+//!< Number of PIT channels that can be used as periodic timers, channels 2 and 3 are the free running counter
+#define PIT_NB_CHANNELS 2
+
 /*! @brief Sets up the PIT before first use.
  *
- *  Enables the PIT and freezes the timer when debugging.
+ *  Enables the PIT, freezes the timers when debugging and starts channels 2 and 3
+ *  as a chained 64-bit free running counter.
  *  @param moduleClk The module clock rate in Hz.
- *  @param userFunction is a pointer to a user callback function.
- *  @param userArguments is a pointer to the user arguments to use with the user callback function.
  *  @return bool - TRUE if the PIT was successfully initialized.
  *  @note Assumes that moduleClk has a period which can be expressed as an integral number of nanoseconds.
  */
-bool PIT_Init(const uint32_t moduleClk, void (*userFunction)(void*),
+bool PIT_Init(const uint32_t moduleClk);
+
+/*! @brief Sets the callback of a PIT channel.
+ *
+ *  @param channel The channel, 0 to PIT_NB_CHANNELS - 1.
+ *  @param userFunction is a pointer to a user callback function, called from the main loop.
+ *  @param userArguments is a pointer to the user arguments to use with the user callback function.
+ *  @return bool - TRUE if the callback was set.
+ *  @note Assumes the PIT has been initialized.
+ */
+bool PIT_SetCallback(const uint8_t channel, void (*userFunction)(void*),
     void* userArguments);
 
-/*! @brief Sets the value of the desired period of the PIT.
+/*! @brief Sets the value of the desired period of a PIT channel.
  *
+ *  @param channel The channel, 0 to PIT_NB_CHANNELS - 1.
  *  @param period The desired value of the timer period in nanoseconds.
  *  @param restart TRUE if the PIT is disabled, a new value set, and then enabled.
  *                 FALSE if the PIT will use the new value after a trigger event.
- *  @note The function will enable the timer and interrupts for the PIT.
+ *  @return bool - TRUE if the period was set.
+ *  @note The function will enable the timer and interrupts for the channel.
+ */
+bool PIT_Set(const uint8_t channel, const uint32_t period, const bool restart);
+
+/*! @brief Enables or disables a PIT channel.
+ *
+ *  @param channel The channel, 0 to PIT_NB_CHANNELS - 1.
+ *  @param enable - TRUE if the channel is to be enabled, FALSE if the channel is to be disabled.
  */
-void PIT_Set(const uint32_t period, const bool restart);
+void PIT_Enable(const uint8_t channel, const bool enable);
 
-/*! @brief Enables or disables the PIT.
+/*! @brief Reads the 64-bit free running counter.
  *
- *  @param enable - TRUE if the PIT is to be enabled, FALSE if the PIT is to be disabled.
+ *  The counter counts up at the module clock rate given to PIT_Init, also after
+ *  PIT_SetClock, and never wraps in practice. It takes no interrupts, so it can
+ *  be read from anywhere.
+ *  @return uint64_t - The number of module clock ticks since PIT_Init.
+ *  @note Assumes the PIT has been initialized.
  */
-void PIT_Enable(const bool enable);
+uint64_t PIT_Now(void);
+
+/*! @brief Converts a number of ticks of the free running counter to nanoseconds.
+ *
+ *  @param ticks The number of ticks, usually the difference of two PIT_Now readings.
+ *  @return uint64_t - The number of nanoseconds.
+ *  @note Assumes the PIT has been initialized.
+ */
+uint64_t PIT_TicksToNs(const uint64_t ticks);
+
+/*! @brief Changes the module clock rate the PIT is running from.
+ *
+ *  The periods of the running channels are kept, and the free running counter
+ *  carries on in ticks of the clock given to PIT_Init.
+ *  @param moduleClk The new module clock rate in Hz.
+ *  @return void
+ *  @note Call with interrupts disabled, straight after the clock has changed.
+ */
+void PIT_SetClock(const uint32_t moduleClk);
 
 #endif
 /*!
  ** @}
  */
 
-/*! @brief Interrupt service routine for the PIT.
+/*! @brief Interrupt service routine for PIT channel 0.
  *
  *  The periodic interrupt timer has timed out.
- *  The user callback function will be called.
+ *  The user callback function will be called from the main loop.
  *  @note Assumes the PIT has been initialized.
  */
 void __attribute__ ((interrupt)) PIT_ISR(void);
+
+/*! @brief Interrupt service routine for PIT channel 1.
+ *
+ *  The periodic interrupt timer has timed out.
+ *  The user callback function will be called from the main loop.
+ *  @note Assumes the PIT has been initialized.
+ */
+void __attribute__ ((interrupt)) PIT1_ISR(void);
@@ -0,0 +1,416 @@
+/*! @file Param.c
+ *
+ *  @brief Routines for a wear-levelled parameter store in the Flash.
+ *
+ *  This contains the functions for reading and writing persistent (key, value) parameters.
+ *  Every write appends one record to a log spread over several Flash sectors, so a
+ *  sector is only erased once it fills up and the live records are moved to the next one.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Param_module Param module documentation
+ **  @{
+ */
+/*
+ * Sector layout:
+ The first phrase of a sector is its header, written last once a compaction has
+ filled the rest of the sector without errors: the low word is PARAM_MAGIC and
+ the high word is a sequence number that increases by one every compaction.
+ The sector with a valid header and the highest sequence number is the active
+ one. Every other phrase is a record: the low half-word is the key, the next
+ half-word is a check value and the high word is the value. Records are appended
+ in order, so the last record for a key wins. An erased phrase marks the end of the log.
+ */
+
+#include "Param.h"
+#include <stddef.h>
+
+//!< Low word of a valid sector header
+#define PARAM_MAGIC 0x4D524150LU
+
+//!< Number of phrases in one sector, the first of which is the header
+#define PARAM_PHRASES_PER_SECTOR (FLASH_SECTOR_SIZE / 8)
+
+//!< The value of an erased phrase
+#define PARAM_ERASED 0xFFFFFFFFFFFFFFFFLLU
+
+//!< Address of a phrase within one of the store's sectors
+#define PARAM_ADDRESS(sector, phrase) (PARAM_START + (sector) * FLASH_SECTOR_SIZE + (phrase) * 8)
+
+//@{
+//!< RAM copy of the live value of every key in the store
+static uint16_t Keys[PARAM_MAX_KEYS];
+static uint32_t Values[PARAM_MAX_KEYS];
+static uint8_t NbKeys;
+//@}
+
+static uint8_t ActiveSector; /*!< The sector records are currently appended to */
+static uint32_t ActiveSequence; /*!< The sequence number of the active sector */
+static uint16_t NextPhrase; /*!< The index of the next erased phrase in the active sector */
+
+//@{
+//!< The compaction in progress, set up by Compact and finished from the Flash interrupt
+static bool volatile Compacting;
+static uint8_t CompactSector;
+static uint8_t CompactRecords;
+static void (*CompactUserFunction)(bool, void*);
+static void* CompactUserArguments;
+//@}
+
+static bool volatile Unsaved; /*!< TRUE after a failed write or compaction, until a compaction has stored every value again */
+
+//!< The number of record writes that can wait for the Flash at once
+#define PARAM_WRITES 4
+
+//!< Struct for a record write waiting for the Flash
+typedef struct
+{
+  void (*userFunction)(bool, void*); /*!< The function called when the write completes, or NULL */
+  void* userArguments; /*!< The arguments of the user function */
+  bool volatile busy; /*!< TRUE while the write is waiting for the Flash */
+} TParamWrite;
+
+static TParamWrite Writes[PARAM_WRITES]; /*!< The record writes waiting for the Flash */
+
+/*! @brief Calculates the check value of a record.
+ *
+ *  @param key The key of the record.
+ *  @param value The value of the record.
+ *  @return uint16_t - The check value, which is never that of an erased phrase.
+ */
+static uint16_t RecordCheck(const uint16_t key, const uint32_t value)
+{
+  uint32union_t valueUnion = { .l = value };
+  return (uint16_t) ~(key ^ valueUnion.s.Lo ^ valueUnion.s.Hi ^ 0x5AA5);
+}
+
+/*! @brief Builds the phrase for a record.
+ *
+ *  @param key The key of the record.
+ *  @param value The value of the record.
+ *  @return uint64_t - The record phrase.
+ */
+static uint64_t RecordPhrase(const uint16_t key, const uint32_t value)
+{
+  uint64union_t phrase;
+  phrase.s.Lo = ((uint32_t) RecordCheck(key, value) << 16) | key;
+  phrase.s.Hi = value;
+  return phrase.l;
+}
+
+/*! @brief Finds the RAM slot of a key.
+ *
+ *  @param key The key to look for.
+ *  @return int - The index of the key, or -1 if the key is not in the store.
+ */
+static int FindKey(const uint16_t key)
+{
+  for (int i = 0; i < NbKeys; i++)
+  {
+    if (Keys[i] == key)
+      return i;
+  }
+  return -1;
+}
+
+/*! @brief Sets the RAM copy of a key, adding the key if it is new.
+ *
+ *  @param key The key of the parameter.
+ *  @param value The value of the parameter.
+ *  @return bool - TRUE if there was room for the key.
+ */
+static bool CacheValue(const uint16_t key, const uint32_t value)
+{
+  int index = FindKey(key);
+  if (index < 0)
+  {
+    if (NbKeys >= PARAM_MAX_KEYS)
+      return false;
+    index = NbKeys++;
+    Keys[index] = key;
+  }
+  Values[index] = value;
+  return true;
+}
+
+/*! @brief Flash completion callback for a record appended to the active sector.
+ *
+ *  A record that did not program has its value only in RAM, so the next write
+ *  compacts to store it again.
+ *  @param success TRUE if the record was programmed without errors.
+ *  @param arguments The TParamWrite of the record.
+ *  @return void
+ */
+static void RecordWritten(bool success, void* arguments)
+{
+  TParamWrite* const write = (TParamWrite*) arguments;
+
+  if (!success)
+    Unsaved = true;
+  write->busy = false;
+  if (write->userFunction)
+    write->userFunction(success, write->userArguments);
+}
+
+/*! @brief Ends a compaction and reports its result to the user.
+ *
+ *  @param success TRUE if the new sector is now the active one.
+ *  @return void
+ */
+static void CompactFinish(const bool success)
+{
+  // A failed compaction leaves values in RAM that only the next one can store
+  Unsaved = !success;
+  Compacting = false;
+  if (CompactUserFunction)
+    CompactUserFunction(success, CompactUserArguments);
+}
+
+/*! @brief Flash completion callback for the header of the sector being compacted into.
+ *
+ *  Makes the new sector the active one once its header is in the Flash.
+ *  @param success TRUE if the header was programmed without errors.
+ *  @param arguments Unused.
+ *  @return void
+ */
+static void CompactCommitted(bool success, void* arguments)
+{
+  if (success)
+  {
+    ActiveSector = CompactSector;
+    ActiveSequence++;
+    NextPhrase = CompactRecords + 1;
+  }
+  CompactFinish(success);
+}
+
+/*! @brief Flash completion callback for the erase and records of the sector being compacted into.
+ *
+ *  Runs in the FTFE interrupt, which keeps the processor in run mode, so the
+ *  header can be queued from here.
+ *  @param success TRUE if the erase and every record completed without errors.
+ *  @param arguments Unused.
+ *  @return void
+ */
+static void CompactRecorded(bool success, void* arguments)
+{
+  // A sector that did not fill in cleanly never gets a header, the old one stays active
+  uint64union_t header = { .s = { PARAM_MAGIC, ActiveSequence + 1 } };
+  if (!success
+      || !Flash_ProgramPhraseAsync(PARAM_ADDRESS(CompactSector, 0), header.l,
+          CompactCommitted, NULL))
+    CompactFinish(false);
+}
+
+/*! @brief Queues moving every live record into the next sector and makes it the active one.
+ *
+ *  The header of the new sector is only programmed once the erase and every
+ *  record have succeeded, and the active sector only changes once the header is
+ *  in, so a failure or a power loss part way through leaves the old sector as
+ *  the newest valid one. A failed compaction is tried again by the next write.
+ *  @param userFunction is a pointer to a function called when the compaction completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the compaction was queued.
+ */
+static bool Compact(void (*userFunction)(bool, void*), void* userArguments)
+{
+  // The erase and every record must fit in the queue, and the header after them
+  if (Compacting || Flash_QueueFree() < NbKeys + 2)
+    return false;
+
+  Compacting = true;
+  CompactSector = (ActiveSector + 1) % PARAM_SECTOR_COUNT;
+  CompactRecords = NbKeys;
+  CompactUserFunction = userFunction;
+  CompactUserArguments = userArguments;
+
+  // The next sector holds an older generation of the log, discard it
+  if (NbKeys == 0)
+    return Flash_EraseSectorAsync(PARAM_ADDRESS(CompactSector, 0),
+        CompactRecorded, NULL);
+  Flash_EraseSectorChainAsync(PARAM_ADDRESS(CompactSector, 0));
+
+  // Write the live records straight after the header, the last one ends the chain
+  for (int i = 0; i < NbKeys - 1; i++)
+    Flash_ProgramPhraseChainAsync(PARAM_ADDRESS(CompactSector, i + 1),
+        RecordPhrase(Keys[i], Values[i]));
+  return Flash_ProgramPhraseAsync(PARAM_ADDRESS(CompactSector, NbKeys),
+      RecordPhrase(Keys[NbKeys - 1], Values[NbKeys - 1]), CompactRecorded,
+      NULL);
+}
+
+/*! @brief A completion callback that stores the result for a blocking call.
+ *
+ *  @param success TRUE if the write completed without errors.
+ *  @param arguments A pointer to the bool to store the result in.
+ *  @return void
+ */
+static void SyncComplete(bool success, void* arguments)
+{
+  *(volatile bool*) arguments = success;
+}
+
+/*! @brief Mounts the parameter store.
+ *
+ *  Finds the newest sector and loads its records into RAM. A blank store is formatted
+ *  by its first write, the call does not wait for the Flash.
+ *  @return bool - TRUE if the store was mounted successfully.
+ */
+bool Param_Init(void)
+{
+  bool found = false;
+  NbKeys = 0;
+
+  // Find the sector with a valid header and the highest sequence number
+  for (uint8_t sector = 0; sector < PARAM_SECTOR_COUNT; sector++)
+  {
+    uint64union_t header = { .l = _FP(PARAM_ADDRESS(sector, 0)) };
+    if (header.s.Lo == PARAM_MAGIC && header.s.Hi != 0xFFFFFFFFLU
+        && (!found || header.s.Hi > ActiveSequence))
+    {
+      ActiveSector = sector;
+      ActiveSequence = header.s.Hi;
+      found = true;
+    }
+  }
+
+  // A blank store starts with a full log in the last sector, so the first
+  // write compacts into sector 0 and formats it
+  Compacting = false;
+  Unsaved = false;
+  if (!found)
+  {
+    ActiveSector = PARAM_SECTOR_COUNT - 1;
+    ActiveSequence = 0;
+    NextPhrase = PARAM_PHRASES_PER_SECTOR;
+    return true;
+  }
+
+  // Replay the log of the active sector, which is at most one sector long
+  for (NextPhrase = 1; NextPhrase < PARAM_PHRASES_PER_SECTOR; NextPhrase++)
+  {
+    uint64union_t record = { .l = _FP(PARAM_ADDRESS(ActiveSector, NextPhrase)) };
+    if (record.l == PARAM_ERASED)
+      break;
+
+    // Skip records that were cut short by a power failure
+    uint32union_t keyCheck = { .l = record.s.Lo };
+    if (keyCheck.s.Hi == RecordCheck(keyCheck.s.Lo, record.s.Hi))
+      CacheValue(keyCheck.s.Lo, record.s.Hi);
+  }
+
+  return true;
+}
+
+/*! @brief Reads a parameter.
+ *
+ *  @param key The key of the parameter.
+ *  @param value A pointer to memory to store the value of the parameter.
+ *  @return bool - TRUE if the parameter exists.
+ *  @note Assumes that Param_Init has been called.
+ */
+bool Param_Read(const uint16_t key, uint32_t * const value)
+{
+  int index = FindKey(key);
+  if (index < 0)
+    return false;
+
+  *value = Values[index];
+  return true;
+}
+
+/*! @brief Writes a parameter.
+ *
+ *  @param key The key of the parameter.
+ *  @param value The new value of the parameter.
+ *  @return bool - TRUE if the parameter was written successfully.
+ *  @note Assumes that Param_Init has been called.
+ */
+bool Param_Write(const uint16_t key, const uint32_t value)
+{
+  volatile bool status = false;
+
+  // Let a compaction that is still running finish first
+  if (Compacting)
+    Flash_Wait();
+
+  if (!Param_WriteAsync(key, value, SyncComplete, (void*) &status))
+    return false;
+
+  Flash_Wait();
+  return status;
+}
+
+/*! @brief Writes a parameter without waiting for the Flash.
+ *
+ *  The new value can be read back straight away.
+ *  @param key The key of the parameter.
+ *  @param value The new value of the parameter.
+ *  @param userFunction is a pointer to a function called when the write completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the write was queued, FALSE while a compaction is still running.
+ *  @note Assumes that Param_Init has been called.
+ */
+bool Param_WriteAsync(const uint16_t key, const uint32_t value,
+    void (*userFunction)(bool, void*), void* userArguments)
+{
+  // The erased key marks the end of the log, so it can not be stored, and
+  // nothing is written while the records are being moved to a new sector
+  if (key == 0xFFFF || Compacting)
+    return false;
+
+  // Nothing to do if the value is already stored
+  uint32_t current;
+  if (!Unsaved && Param_Read(key, &current) && current == value)
+  {
+    if (userFunction)
+      userFunction(true, userArguments);
+    return true;
+  }
+
+  int index = FindKey(key);
+  if (index < 0 && NbKeys >= PARAM_MAX_KEYS)
+    return false;
+
+  // When the active sector is full, or the RAM copy has values the Flash lost,
+  // the compaction writes the new value too
+  if (NextPhrase >= PARAM_PHRASES_PER_SECTOR || Unsaved)
+  {
+    // Make sure there will be room in the queue for the new key as well
+    if (Flash_QueueFree() < NbKeys + (index < 0) + 2)
+      return false;
+
+    CacheValue(key, value);
+    return Compact(userFunction, userArguments);
+  }
+
+  // Otherwise just program the record into the next erased phrase
+  TParamWrite* write = NULL;
+  for (int i = 0; i < PARAM_WRITES && write == NULL; i++)
+  {
+    if (!Writes[i].busy)
+      write = &Writes[i];
+  }
+  if (write == NULL)
+    return false;
+
+  write->userFunction = userFunction;
+  write->userArguments = userArguments;
+  write->busy = true;
+  if (!Flash_ProgramPhraseAsync(PARAM_ADDRESS(ActiveSector, NextPhrase),
+      RecordPhrase(key, value), RecordWritten, write))
+  {
+    write->busy = false;
+    return false;
+  }
+
+  CacheValue(key, value);
+  NextPhrase++;
+  return true;
+}
+
+/*!
+ ** @}
+ */
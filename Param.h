@@ -0,0 +1,84 @@
+/*! @file Param.h
+ *
+ *  @brief Routines for a wear-levelled parameter store in the Flash.
+ *
+ *  This contains the functions for reading and writing persistent (key, value) parameters.
+ *  Every write appends one record to a log spread over several Flash sectors, so a
+ *  sector is only erased once it fills up and the live records are moved to the next one.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Param_module Param module documentation
+ **  @{
+ */
+
+#ifndef PARAM_H
+#define PARAM_H
+
+// new types
+#include "types.h"
+#include "Flash.h"
+
+//!< Address of the first sector used by the parameter store
+#define PARAM_START (FLASH_DATA_START + FLASH_SECTOR_SIZE)
+
+//!< Number of sectors the parameter store rotates through (at least 2)
+#define PARAM_SECTOR_COUNT 4
+
+//!< Maximum number of different keys the store can hold
+#define PARAM_MAX_KEYS 16
+
+//!< Enum for the keys of the parameters kept in the store
+typedef enum
+{
+  PARAM_TOWER_NUMBER = 0x0001, /*!< The tower number, as stored before PARAM_TOWER_CONFIG */
+  PARAM_TOWER_MODE = 0x0002, /*!< The tower mode, as stored before PARAM_TOWER_CONFIG */
+  PARAM_TOWER_CONFIG = 0x0003 /*!< The tower number in the low half-word and the tower mode in the high half-word */
+} TParamKey;
+
+/*! @brief Mounts the parameter store.
+ *
+ *  Finds the newest sector and loads its records into RAM. A blank store is formatted
+ *  by its first write, the call does not wait for the Flash.
+ *  @return bool - TRUE if the store was mounted successfully.
+ */
+bool Param_Init(void);
+
+/*! @brief Reads a parameter.
+ *
+ *  @param key The key of the parameter.
+ *  @param value A pointer to memory to store the value of the parameter.
+ *  @return bool - TRUE if the parameter exists.
+ *  @note Assumes that Param_Init has been called.
+ */
+bool Param_Read(const uint16_t key, uint32_t * const value);
+
+/*! @brief Writes a parameter.
+ *
+ *  @param key The key of the parameter.
+ *  @param value The new value of the parameter.
+ *  @return bool - TRUE if the parameter was written successfully.
+ *  @note Assumes that Param_Init has been called.
+ */
+bool Param_Write(const uint16_t key, const uint32_t value);
+
+/*! @brief Writes a parameter without waiting for the Flash.
+ *
+ *  The new value can be read back straight away.
+ *  @param key The key of the parameter.
+ *  @param value The new value of the parameter.
+ *  @param userFunction is a pointer to a function called when the write completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the write was queued, FALSE while a compaction is still running.
+ *  @note Assumes that Param_Init has been called.
+ */
+bool Param_WriteAsync(const uint16_t key, const uint32_t value,
+    void (*userFunction)(bool, void*), void* userArguments);
+
+#endif
+
+/*!
+ ** @}
+ */
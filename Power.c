@@ -0,0 +1,384 @@
+/*! @file Power.c
+ *
+ *  @brief Routines for moving the processor between its run, wait and stop modes.
+ *
+ *  This contains the functions for running at full speed or in very low power run,
+ *  for sleeping between events and for timing how long the processor takes to wake.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Power_module Power module documentation
+ **  @{
+ */
+/*
+ * POWER command:
+ Parameter 1 is a TPowerRunMode, parameter 2 a TPowerSleepMode and parameter 3
+ is 0. The run mode changes once the acknowledgment has been sent.
+
+ In very low power run the MCG runs from the fast IRC in BLPI mode, the core and
+ bus at 2 MHz and the flash at 1 MHz, and the UART divisors, PIT periods and
+ timer wheel are set up again for those clocks. The baud rate is then only
+ within about 2% of the nominal rate. The Flash can not be programmed there, so
+ Flash commands switch back to run until the main loop next waits for an event.
+
+ Stop halts the PIT, the FTM and the UARTs, so the timers stand still while the
+ processor is stopped and the character that wakes it up is lost. The processor
+ still wakes at the start of every RTC second.
+
+ The wake latency of each sleep mode is measured whenever the start of an RTC
+ second wakes the processor: the RTC prescaler has counted the 32 kHz ticks since
+ the start of the second. It is read by DIAGNOSTICS group 5.
+ */
+
+#include "Power.h"
+#include "Command.h"
+#include "UART.h"
+#include "PIT.h"
+#include "Timer.h"
+#include "LEDs.h"
+#include "Flash.h"
+#include "MK70F12.h"
+#include "Cpu.h"
+
+//!< The RTC seconds interrupt in the NVIC, whose pending bit shows a second has started
+#define POWER_RTC_SECONDS_IRQ 67
+
+//!< The bits of the RTC prescaler that count the ticks within a second
+#define POWER_TPR_SECOND_MASK 0x7FFF
+
+//!< The longest Power_Run waits for the links to finish sending, in microseconds
+#define POWER_IDLE_TIMEOUT 100000
+
+//@{
+//!< The MCG clock source selections and status values
+#define MCG_CLKS_PLL 0
+#define MCG_CLKS_INTERNAL 1
+#define MCG_CLKS_EXTERNAL 2
+#define MCG_CLKST_PLL 3
+//@}
+
+//@{
+//!< The SMC run and stop mode selections and status values
+#define SMC_RUNM_RUN 0
+#define SMC_RUNM_VLPR 2
+#define SMC_STOPM_STOP 0
+#define SMC_STOPM_VLPS 2
+#define SMC_PMSTAT_RUN 0x01
+#define SMC_PMSTAT_VLPR 0x04
+//@}
+
+TPowerLatency Power_Latency[POWER_NB_STATES];
+
+static TPowerRunMode RunMode; /*!< The mode the processor is running in */
+static TPowerRunMode SelectedRunMode; /*!< The mode the processor runs in between Flash commands */
+static TPowerSleepMode SleepMode; /*!< The mode the processor sleeps in between events */
+
+//@{
+//!< The clock setup of run mode, as left by Processor Expert
+static uint8_t RunC1, RunC2, RunC6;
+static uint32_t RunCLKDIV1;
+//@}
+
+/*! @brief Waits for the MCG to report the clock it is running from.
+ *
+ *  @param clockStatus The CLKST value.
+ *  @return void
+ */
+static void WaitClockStatus(const uint8_t clockStatus)
+{
+  while (((MCG_S & MCG_S_CLKST_MASK) >> MCG_S_CLKST_SHIFT) != clockStatus)
+    ;
+}
+
+/*! @brief Moves from run in PEE mode to very low power run in BLPI mode.
+ *
+ *  @return void
+ */
+static void EnterVLPR(void)
+{
+  // PEE to PBE, run from the crystal while the PLL is turned off
+  MCG_C1 = (MCG_C1 & ~MCG_C1_CLKS_MASK) | MCG_C1_CLKS(MCG_CLKS_EXTERNAL);
+  WaitClockStatus(MCG_CLKS_EXTERNAL);
+
+  // PBE to FBE
+  MCG_C6 &= ~MCG_C6_PLLS_MASK;
+  while (MCG_S & MCG_S_PLLST_MASK)
+    ;
+
+  // FBE to FBI, from the fast IRC
+  MCG_C2 |= MCG_C2_IRCS_MASK;
+  MCG_C1 = (MCG_C1 & ~MCG_C1_CLKS_MASK) | MCG_C1_CLKS(MCG_CLKS_INTERNAL)
+      | MCG_C1_IREFS_MASK;
+  while (!(MCG_S & MCG_S_IREFST_MASK) || !(MCG_S & MCG_S_IRCST_MASK))
+    ;
+  WaitClockStatus(MCG_CLKS_INTERNAL);
+
+  // FBI to BLPI, the FLL is turned off too
+  MCG_C2 |= MCG_C2_LP_MASK;
+
+  // Bring the clocks down to the very low power run limits
+  SIM_CLKDIV1 = SIM_CLKDIV1_OUTDIV1(1) | SIM_CLKDIV1_OUTDIV2(1)
+      | SIM_CLKDIV1_OUTDIV3(1) | SIM_CLKDIV1_OUTDIV4(3);
+
+  SMC_PMCTRL = (SMC_PMCTRL & ~SMC_PMCTRL_RUNM_MASK) | SMC_PMCTRL_RUNM(SMC_RUNM_VLPR);
+  while (SMC_PMSTAT != SMC_PMSTAT_VLPR)
+    ;
+}
+
+/*! @brief Moves from very low power run in BLPI mode back to run in PEE mode.
+ *
+ *  @return void
+ */
+static void ExitVLPR(void)
+{
+  // The regulator has to be in full regulation before the clocks go up
+  SMC_PMCTRL = (SMC_PMCTRL & ~SMC_PMCTRL_RUNM_MASK) | SMC_PMCTRL_RUNM(SMC_RUNM_RUN);
+  while (SMC_PMSTAT != SMC_PMSTAT_RUN || !(PMC_REGSC & PMC_REGSC_REGONS_MASK))
+    ;
+
+  // The run dividers keep every clock in its limits from the fast IRC too
+  SIM_CLKDIV1 = RunCLKDIV1;
+
+  // BLPI to FBI
+  MCG_C2 &= ~MCG_C2_LP_MASK;
+
+  // FBI to FBE, with the crystal set up as it was
+  MCG_C2 = RunC2;
+  if (RunC2 & MCG_C2_EREFS0_MASK)
+  {
+    while (!(MCG_S & MCG_S_OSCINIT0_MASK))
+      ;
+  }
+  MCG_C1 = (RunC1 & ~MCG_C1_CLKS_MASK) | MCG_C1_CLKS(MCG_CLKS_EXTERNAL);
+  while (MCG_S & MCG_S_IREFST_MASK)
+    ;
+  WaitClockStatus(MCG_CLKS_EXTERNAL);
+
+  // FBE to PBE, once the PLL has locked
+  MCG_C6 = RunC6;
+  while (!(MCG_S & MCG_S_PLLST_MASK) || !(MCG_S & MCG_S_LOCK0_MASK))
+    ;
+
+  // PBE to PEE
+  MCG_C1 = RunC1;
+  WaitClockStatus(MCG_CLKST_PLL);
+}
+
+/*! @brief Changes the run mode and sets up the modules that depend on the clocks again.
+ *
+ *  @param run The run mode.
+ *  @return void
+ *  @note Call with interrupts disabled and nothing being sent.
+ */
+static void SetRunMode(const TPowerRunMode run)
+{
+  if (run == RunMode)
+    return;
+
+  if (run == POWER_VLPR)
+    EnterVLPR();
+  else
+    ExitVLPR();
+  RunMode = run;
+
+  // The FTMs run from the fixed frequency clock, which follows the MCG reference
+  UART_SetClock(Power_SystemClock(), Power_BusClock());
+  PIT_SetClock(Power_BusClock());
+  uint32_t fixedClk =
+      (run == POWER_VLPR) ? POWER_SLOW_IRC_HZ : CPU_MCGFF_CLK_HZ_CONFIG_0;
+  Timer_SetClock(fixedClk);
+  LEDs_SetClock(fixedClk);
+}
+
+/*! @brief Checks whether interrupts are enabled.
+ *
+ *  @return bool - TRUE if PRIMASK is clear.
+ */
+static bool InterruptsEnabled(void)
+{
+  uint32_t primask;
+  __asm volatile ("mrs %0, primask" : "=r" (primask));
+  return !(primask & 1);
+}
+
+/*! @brief Handles the POWER command.
+ *
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandlePower(const TPacket* const packet)
+{
+  return Power_SetMode(packet->parameter1, packet->parameter2) ?
+      COMMAND_SUCCESS : COMMAND_FAILED;
+}
+
+/*! @brief Takes note of the clocks set up by Processor Expert and registers the POWER command.
+ *
+ *  The processor starts in POWER_RUN and sleeps in POWER_SLEEP_WAIT.
+ *  @return bool - TRUE if the power module was successfully initialized.
+ *  @note Assumes that Command_Init, UART_Init, PIT_Init, Timer_Init and LEDs_Init have been called.
+ */
+bool Power_Init(void)
+{
+  RunC1 = MCG_C1;
+  RunC2 = MCG_C2;
+  RunC6 = MCG_C6;
+  RunCLKDIV1 = SIM_CLKDIV1;
+
+  RunMode = POWER_RUN;
+  SelectedRunMode = POWER_RUN;
+  SleepMode = POWER_SLEEP_WAIT;
+
+  for (int i = 0; i < POWER_NB_STATES; i++)
+  {
+    Power_Latency[i].count = 0;
+    Power_Latency[i].wakeLast = 0;
+    Power_Latency[i].wakeMax = 0;
+    Power_Latency[i].resumeMax = 0;
+  }
+
+  // The protection register can only be written once after reset, the very
+  // low power modes stay refused if it has been already
+  SMC_PMPROT = SMC_PMPROT_AVLP_MASK;
+
+  static const TCommandRange power[3] = { { POWER_RUN, POWER_VLPR }, {
+      POWER_SLEEP_WAIT, POWER_SLEEP_STOP }, COMMAND_EXACT(0) };
+  return Command_Register(POWER, HandlePower, power);
+}
+
+/*! @brief Selects the run mode and the mode to sleep in between events.
+ *
+ *  The run mode changes the next time the main loop waits for an event with
+ *  nothing left to send, so the reply to the command goes out at the old clocks.
+ *  The UART, PIT and timer wheel are then set up again for the new clocks.
+ *  @param run The run mode.
+ *  @param sleep The sleep mode.
+ *  @return bool - TRUE if the modes were selected, POWER_VLPR needs the mode protection to allow it.
+ *  @note Assumes that Power_Init has been called.
+ */
+bool Power_SetMode(const TPowerRunMode run, const TPowerSleepMode sleep)
+{
+  if (run == POWER_VLPR && !(SMC_PMPROT & SMC_PMPROT_AVLP_MASK))
+    return false;
+
+  SelectedRunMode = run;
+  SleepMode = sleep;
+  return true;
+}
+
+/*! @brief Leaves very low power run straight away, for work that needs the full clocks.
+ *
+ *  The selected run mode comes back the next time the main loop waits for an event.
+ *  @return void
+ *  @note Assumes that Power_Init has been called, call only from the main loop.
+ */
+void Power_Run(void)
+{
+  if (RunMode == POWER_RUN)
+    return;
+
+  // Let the links finish sending first, a character on the wire across the
+  // clock change would be garbled
+  if (InterruptsEnabled())
+  {
+    uint64_t start = PIT_Now();
+    while (!UART_Idle()
+        && PIT_TicksToNs(PIT_Now() - start) < POWER_IDLE_TIMEOUT * 1000ULL)
+      ;
+  }
+
+  EnterCritical();
+  SetRunMode(POWER_RUN);
+  ExitCritical();
+}
+
+/*! @brief Sleeps until an interrupt is pending.
+ *
+ *  A run mode change that is waiting is made first. STOP is only entered when
+ *  nothing is being sent and the Flash is idle, otherwise the processor waits.
+ *  @return void
+ *  @note Assumes that Power_Init has been called, call with interrupts disabled.
+ */
+void Power_Sleep(void)
+{
+  bool idle = UART_Idle() && !Flash_Busy();
+
+  // Go back to the selected run mode between two events
+  if (RunMode != SelectedRunMode && idle)
+    SetRunMode(SelectedRunMode);
+
+  bool stop = (SleepMode == POWER_SLEEP_STOP) && idle;
+  TPowerState state = (RunMode == POWER_VLPR) ?
+      (stop ? POWER_STATE_VLPS : POWER_STATE_VLPW) :
+      (stop ? POWER_STATE_STOP : POWER_STATE_WAIT);
+
+  if (stop)
+  {
+    // Stop from very low power run has to be very low power stop
+    UART_WakeOnReceive(true);
+    SMC_PMCTRL = (SMC_PMCTRL & ~SMC_PMCTRL_STOPM_MASK)
+        | SMC_PMCTRL_STOPM(
+            (RunMode == POWER_VLPR) ? SMC_STOPM_VLPS : SMC_STOPM_STOP);
+
+    // Read back so the mode is set before WFI
+    (void) SMC_PMCTRL;
+    SCB_SCR |= SCB_SCR_SLEEPDEEP_MASK;
+  }
+
+  // Only a second that starts while asleep can time the wake
+  const uint32_t second = 1 << (POWER_RTC_SECONDS_IRQ % 32);
+  bool secondPending = (NVICISPR2 & second) != 0;
+
+  __asm volatile ("wfi");
+  uint16_t wake = RTC_TPR & POWER_TPR_SECOND_MASK;
+
+  if (stop)
+  {
+    SCB_SCR &= ~SCB_SCR_SLEEPDEEP_MASK;
+
+    // The PLL is off while stopped, the MCG runs from it again once it has locked
+    if (RunMode == POWER_RUN)
+    {
+      while (!(MCG_S & MCG_S_LOCK0_MASK))
+        ;
+      WaitClockStatus(MCG_CLKST_PLL);
+    }
+    UART_WakeOnReceive(false);
+  }
+  uint16_t resume = RTC_TPR & POWER_TPR_SECOND_MASK;
+
+  if (!secondPending && (NVICISPR2 & second))
+  {
+    TPowerLatency* const latency = &Power_Latency[state];
+    latency->count++;
+    latency->wakeLast = wake;
+    if (wake > latency->wakeMax)
+      latency->wakeMax = wake;
+    if (resume > latency->resumeMax)
+      latency->resumeMax = resume;
+  }
+}
+
+/*! @brief Gets the system clock rate of the current run mode.
+ *
+ *  @return uint32_t - The clock rate of the core and of UART0 and UART1 in Hz.
+ */
+uint32_t Power_SystemClock(void)
+{
+  return (RunMode == POWER_VLPR) ? POWER_VLPR_SYSTEM_CLK_HZ : CPU_CORE_CLK_HZ;
+}
+
+/*! @brief Gets the bus clock rate of the current run mode.
+ *
+ *  @return uint32_t - The clock rate of the PIT and of the other UARTs in Hz.
+ */
+uint32_t Power_BusClock(void)
+{
+  return (RunMode == POWER_VLPR) ? POWER_VLPR_BUS_CLK_HZ : CPU_BUS_CLK_HZ;
+}
+
+/*!
+ ** @}
+ */
@@ -0,0 +1,126 @@
+/*! @file Power.h
+ *
+ *  @brief Routines for moving the processor between its run, wait and stop modes.
+ *
+ *  This contains the functions for running at full speed or in very low power run,
+ *  for sleeping between events and for timing how long the processor takes to wake.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Power_module Power module documentation
+ **  @{
+ */
+
+#ifndef POWER_H
+#define POWER_H
+
+// new types
+#include "types.h"
+
+//@{
+//!< The internal reference clocks the MCG runs from in very low power run
+#define POWER_FAST_IRC_HZ 4000000
+#define POWER_SLOW_IRC_HZ 32768
+//@}
+
+//@{
+//!< The clocks in very low power run, the core and bus run from the fast IRC divided by 2 and the flash by 4
+#define POWER_VLPR_SYSTEM_CLK_HZ (POWER_FAST_IRC_HZ / 2)
+#define POWER_VLPR_BUS_CLK_HZ (POWER_FAST_IRC_HZ / 2)
+//@}
+
+//!< The rate of the RTC prescaler the wake latencies are counted in
+#define POWER_LATENCY_TICK_HZ 32768
+
+//!< Enum for the modes the processor runs in
+typedef enum
+{
+  POWER_RUN, /*!< Full speed from the PLL */
+  POWER_VLPR /*!< Very low power run from the fast IRC, the Flash can not be programmed */
+} TPowerRunMode;
+
+//!< Enum for the modes the processor sleeps in between events
+typedef enum
+{
+  POWER_SLEEP_WAIT, /*!< The core clock stops, every module keeps running */
+  POWER_SLEEP_STOP /*!< Every clock but the 32 kHz ones stops, the PIT, FTM and UARTs are halted */
+} TPowerSleepMode;
+
+//!< Enum for the sleep modes the wake latency is kept for, the sleep mode as entered from each run mode
+typedef enum
+{
+  POWER_STATE_WAIT, /*!< Wait from run */
+  POWER_STATE_STOP, /*!< Normal stop from run */
+  POWER_STATE_VLPW, /*!< Very low power wait, wait from very low power run */
+  POWER_STATE_VLPS, /*!< Very low power stop, stop from very low power run */
+  POWER_NB_STATES
+} TPowerState;
+
+//!< Struct for the wake latencies of one sleep mode, measured when the start of an RTC second wakes the processor
+typedef struct
+{
+  uint32_t count; /*!< The number of wakes measured */
+  uint16_t wakeLast; /*!< The RTC prescaler ticks from the start of the second to the first instruction after the last wake */
+  uint16_t wakeMax; /*!< The most RTC prescaler ticks from the start of the second to the first instruction after a wake */
+  uint16_t resumeMax; /*!< The most RTC prescaler ticks from the start of the second until the clocks were back after a wake */
+} TPowerLatency;
+
+//! The wake latencies of every sleep mode, only written from the main loop
+extern TPowerLatency Power_Latency[POWER_NB_STATES];
+
+/*! @brief Takes note of the clocks set up by Processor Expert and registers the POWER command.
+ *
+ *  The processor starts in POWER_RUN and sleeps in POWER_SLEEP_WAIT.
+ *  @return bool - TRUE if the power module was successfully initialized.
+ *  @note Assumes that Command_Init, UART_Init, PIT_Init, Timer_Init and LEDs_Init have been called.
+ */
+bool Power_Init(void);
+
+/*! @brief Selects the run mode and the mode to sleep in between events.
+ *
+ *  The run mode changes the next time the main loop waits for an event with
+ *  nothing left to send, so the reply to the command goes out at the old clocks.
+ *  The UART, PIT and timer wheel are then set up again for the new clocks.
+ *  @param run The run mode.
+ *  @param sleep The sleep mode.
+ *  @return bool - TRUE if the modes were selected, POWER_VLPR needs the mode protection to allow it.
+ *  @note Assumes that Power_Init has been called.
+ */
+bool Power_SetMode(const TPowerRunMode run, const TPowerSleepMode sleep);
+
+/*! @brief Leaves very low power run straight away, for work that needs the full clocks.
+ *
+ *  The selected run mode comes back the next time the main loop waits for an event.
+ *  @return void
+ *  @note Assumes that Power_Init has been called, call only from the main loop.
+ */
+void Power_Run(void);
+
+/*! @brief Sleeps until an interrupt is pending.
+ *
+ *  A run mode change that is waiting is made first. STOP is only entered when
+ *  nothing is being sent and the Flash is idle, otherwise the processor waits.
+ *  @return void
+ *  @note Assumes that Power_Init has been called, call with interrupts disabled.
+ */
+void Power_Sleep(void);
+
+/*! @brief Gets the system clock rate of the current run mode.
+ *
+ *  @return uint32_t - The clock rate of the core and of UART0 and UART1 in Hz.
+ */
+uint32_t Power_SystemClock(void);
+
+/*! @brief Gets the bus clock rate of the current run mode.
+ *
+ *  @return uint32_t - The clock rate of the PIT and of the other UARTs in Hz.
+ */
+uint32_t Power_BusClock(void);
+
+#endif
+
+/*!
+ ** @}
+ */
@@ -14,44 +14,139 @@
 #include "RTC.h"
 #include "MK70F12.h"
 #include "Cpu.h"
+#include "Deferred.h"
+#include "Stats.h"
+#include "Timer.h"
+#include <stddef.h>
 
 static Callback CallbackFunction; /*<! A global variable to hold the callback function and its arguments pointer */
 
-/*! @brief Initializes the RTC before first use.
+//@{
+//!< Positions of the hours, minutes and seconds in the cached time
+#define RTC_HOURS_SHIFT 16
+#define RTC_MINUTES_SHIFT 8
+#define RTC_FIELD_MASK 0xFF
+//@}
+
+//!< The number of seconds in a day, after which the time wraps around to midnight
+#define RTC_SECONDS_PER_DAY 86400
+
+//!< The time the 32 kHz oscillator takes to settle after it is enabled, in milliseconds
+#define RTC_OSCILLATOR_STARTUP 1000
+
+//!< The prescaler counts since TSR last incremented, bit 14 rolling over increments it
+#define RTC_TPR_TICKS_MASK (RTC_TICKS_PER_SECOND - 1)
+
+static uint32_t volatile CachedTime; /*!< The hours, minutes and seconds packed in one word, so one load copies them */
+static uint32_t CachedSeconds; /*!< The value of TSR that CachedTime was worked out from */
+static bool volatile Running; /*!< TRUE once the oscillator has settled and the counter is enabled */
+
+/*! @brief Reads a register of the RTC, which is clocked separately from the core.
  *
- *  Sets up the control register for the RTC and locks it.
- *  Enables the RTC and sets an interrupt every second.
- *  @param userFunction is a pointer to a user callback function.
- *  @param userArguments is a pointer to the user arguments to use with the user callback function.
- *  @return bool - TRUE if the RTC was successfully initialized.
+ *  @param reg The register.
+ *  @return uint32_t - The value of the register, read the same twice in a row.
  */
-bool RTC_Init(void (*userFunction)(void*), void* userArguments)
+static uint32_t ReadStable(volatile uint32_t * const reg)
 {
-  // Assign the arguments of the callback into our specific variable
-  CallbackFunction.callbackFunction = userFunction;
-  CallbackFunction.callbackArguments = userArguments;
+  uint32_t value;
+  do
+  {
+    value = *reg;
+  } while (value != *reg);
+  return value;
+}
 
-  // Enable clock gate control bit for RTC
-  SIM_SCGC6 |= SIM_SCGC6_RTC_MASK;
+/*! @brief Packs the hours, minutes and seconds into the cached time.
+ *
+ *  @param totalSeconds The value of TSR the time belongs to.
+ *  @param hours The hours (0-23).
+ *  @param minutes The minutes (0-59).
+ *  @param seconds The seconds (0-59).
+ *  @return void
+ */
+static void StoreTime(const uint32_t totalSeconds, const uint8_t hours,
+    const uint8_t minutes, const uint8_t seconds)
+{
+  CachedSeconds = totalSeconds;
+  CachedTime = ((uint32_t) hours << RTC_HOURS_SHIFT)
+      | ((uint32_t) minutes << RTC_MINUTES_SHIFT) | seconds;
+}
 
-  // Set a 18pf (16pf + 2pf capacitor) as according to the sheet, not
-  // sure what this actually does
-  RTC_CR |= (RTC_CR_SC16P_MASK | RTC_CR_SC2P_MASK);
+/*! @brief Works the cached time out from scratch from a value of the seconds register.
+ *
+ *  @param totalSeconds The value of TSR.
+ *  @return void
+ *  @note Must be called with interrupts disabled or from the RTC interrupt.
+ */
+static void CacheTime(const uint32_t totalSeconds)
+{
+  // Work backwards to convert seconds into hours, minutes and seconds
+  uint32_t secondsOfDay = totalSeconds % RTC_SECONDS_PER_DAY;
+  StoreTime(totalSeconds, secondsOfDay / 3600, (secondsOfDay % 3600) / 60,
+      secondsOfDay % 60);
+}
 
-  // Enable the 32KHz oscillator
-  RTC_CR |= RTC_CR_OSCE_MASK;
+/*! @brief Moves the cached time on to a new value of the seconds register.
+ *
+ *  @param totalSeconds The value of TSR.
+ *  @return void
+ *  @note Must be called with interrupts disabled or from the RTC interrupt.
+ */
+static void UpdateTime(const uint32_t totalSeconds)
+{
+  if (totalSeconds == CachedSeconds)
+    return;
 
-  // Manually delay RTC setup as we wait for the oscillator
-  // to power up
-  for (int i = 0; i < CPU_XTAL32k_CLK_HZ; i++)
-    ;
+  // A missed second or a new setting needs the divisions
+  if (totalSeconds != CachedSeconds + 1)
+  {
+    CacheTime(totalSeconds);
+    return;
+  }
 
-  // Set TPR so TSR value can be set
-  RTC_TPR = RTC_TPR_TPR(0xFFFF);
-  //RTC_TSR = RTC_TSR_TSR(0);
+  // The usual case is one second later, which only needs the fields carried along
+  uint32_t time = CachedTime;
+  uint8_t seconds = time & RTC_FIELD_MASK;
+  uint8_t minutes = (time >> RTC_MINUTES_SHIFT) & RTC_FIELD_MASK;
+  uint8_t hours = time >> RTC_HOURS_SHIFT;
+
+  if (++seconds == 60)
+  {
+    seconds = 0;
+    if (++minutes == 60)
+    {
+      minutes = 0;
+      if (++hours == 24)
+        hours = 0;
+    }
+  }
+  StoreTime(totalSeconds, hours, minutes, seconds);
+}
+
+/*! @brief Starts the counter once the 32 kHz oscillator has settled.
+ *
+ *  Run from the main loop by the timer wheel, or straight from RTC_Init when
+ *  the oscillator was kept running over the reset.
+ *  @param arguments Unused.
+ *  @return void
+ */
+static void Start(void* arguments)
+{
+  // Keep RTC_Set out while the counter and the cached time are brought up
+  EnterCritical();
+
+  // Set TPR so TSR value can be set, unless the counter was kept running
+  if (!(RTC_SR & RTC_SR_TCE_MASK))
+    RTC_TPR = RTC_TPR_TPR(0xFFFF);
 
   // Enable the Timer Counter
   RTC_SR |= RTC_SR_TCE_MASK;
+  Running = true;
+
+  // Start the cached time from the seconds kept over the reset
+  CacheTime(ReadStable(&RTC_TSR));
+
+  ExitCritical();
 
   // Clear any pending interrupts from RTC interrupt
   NVICICPR2 |= (1 << 3);
@@ -59,17 +154,57 @@ bool RTC_Init(void (*userFunction)(void*), void* userArguments)
   // Interrupt Set Enable RTC in the NVIC
   NVICISER2 |= (1 << 3);
 
+  // Enable RTC interrupts per second (Time Seconds Interrupt Enable)
+  RTC_IER |= RTC_IER_TSIE_MASK;
+
+  Stats_BootStage(STATS_BOOT_RTC);
+}
+
+/*! @brief Initializes the RTC before first use.
+ *
+ *  Sets up the control register for the RTC and enables the oscillator.
+ *  The counter and the interrupt every second are started by a timer once the
+ *  oscillator has settled, so the call does not wait for it.
+ *  @param userFunction is a pointer to a user callback function.
+ *  @param userArguments is a pointer to the user arguments to use with the user callback function.
+ *  @return bool - TRUE if the RTC was successfully initialized.
+ *  @note Assumes that Timer_Init has been called.
+ */
+bool RTC_Init(void (*userFunction)(void*), void* userArguments)
+{
+  // Assign the arguments of the callback into our specific variable
+  CallbackFunction.callbackFunction = userFunction;
+  CallbackFunction.callbackArguments = userArguments;
+  Running = false;
+
+  // Enable clock gate control bit for RTC
+  SIM_SCGC6 |= SIM_SCGC6_RTC_MASK;
+
   // Disable the Alaram, Overflow and Invalid interrupts which are
   // set on default
   RTC_IER &= ~RTC_IER_TOIE_MASK;
   RTC_IER &= ~RTC_IER_TAIE_MASK;
   RTC_IER &= ~RTC_IER_TIIE_MASK;
+  RTC_IER &= ~RTC_IER_TSIE_MASK;
 
-  // Enable RTC interrupts per second (Time Seconds Interrupt Enable)
-  RTC_IER |= RTC_IER_TSIE_MASK;
+  // The RTC is powered from VBAT, so after a reset the oscillator
+  // may still be running and there is nothing to wait for
+  if (RTC_CR & RTC_CR_OSCE_MASK)
+  {
+    Start(NULL);
+    return true;
+  }
 
-  return true;
+  // Set a 18pf (16pf + 2pf capacitor) as according to the sheet, not
+  // sure what this actually does
+  RTC_CR |= (RTC_CR_SC16P_MASK | RTC_CR_SC2P_MASK);
+
+  // Enable the 32KHz oscillator
+  RTC_CR |= RTC_CR_OSCE_MASK;
 
+  // Finish the setup from the main loop once the oscillator has
+  // powered up, rather than spinning here
+  return Timer_Start(RTC_OSCILLATOR_STARTUP, Start, NULL) != TIMER_INVALID;
 }
 
 /*! @brief Sets the value of the real time clock.
@@ -83,6 +218,9 @@ void RTC_Set(const uint8_t hours, const uint8_t minutes, const uint8_t seconds)
 {
   uint32_t totalSeconds = (hours * 3600) + (minutes * 60) + seconds;
 
+  // Keep the seconds interrupt out until the cached time matches the counter
+  EnterCritical();
+
   RTC_SR &= ~RTC_SR_TOF_MASK;
   RTC_SR &= ~RTC_SR_TIF_MASK;
 
@@ -94,12 +232,20 @@ void RTC_Set(const uint8_t hours, const uint8_t minutes, const uint8_t seconds)
   // Set the new TSR value
   RTC_TSR = RTC_TSR_TSR(totalSeconds - 1);
 
-  // Re-enable the time counter so TSR can continue incrementing
-  RTC_SR |= RTC_SR_TCE_MASK;
+  // Re-enable the time counter so TSR can continue incrementing, or
+  // leave it for the oscillator to settle first
+  if (Running)
+    RTC_SR |= RTC_SR_TCE_MASK;
+
+  // TSR reaches the new time on the next prescaler tick
+  CacheTime(totalSeconds);
 
+  ExitCritical();
 }
 /*! @brief Gets the value of the real time clock.
  *
+ *  The time is copied from the one the seconds interrupt keeps in RAM, so the
+ *  counter is not touched and the call is safe from any context.
  *  @param hours The address of a variable to store the real time clock hours.
  *  @param minutes The address of a variable to store the real time clock minutes.
  *  @param seconds The address of a variable to store the real time clock seconds.
@@ -108,22 +254,34 @@ void RTC_Set(const uint8_t hours, const uint8_t minutes, const uint8_t seconds)
 void RTC_Get(uint8_t* const hours, uint8_t* const minutes,
     uint8_t* const seconds)
 {
-  // Read the RTC_TSR and store it into a local variable
-  uint32_t totalSeconds = RTC_TSR;
+  // A single load, so the fields always come from the same second
+  uint32_t time = CachedTime;
 
-  RTC_SR &= ~RTC_SR_TOF_MASK;
-  RTC_SR &= ~RTC_SR_TIF_MASK;
+  *hours = time >> RTC_HOURS_SHIFT;
+  *minutes = (time >> RTC_MINUTES_SHIFT) & RTC_FIELD_MASK;
+  *seconds = time & RTC_FIELD_MASK;
+}
 
-  // Don't need to disable, as we are reading not writing?
-  RTC_SR &= ~RTC_SR_TCE_MASK;
+/*! @brief Gets the value of the real time clock to the tick of its oscillator.
+ *
+ *  The seconds and prescaler are read without stopping the counter, for
+ *  timestamps with a resolution of about 30 us.
+ *  @return uint64_t - The time in RTC_TICKS_PER_SECOND ticks since the RTC was set to 0.
+ *  @note Assumes that the RTC module has been initialized.
+ */
+uint64_t RTC_GetPrecise(void)
+{
+  uint32_t seconds, prescaler;
 
-  // Work backwards to convert seconds into hours, minutes and seconds
-  *hours = totalSeconds / 3600;
-  *minutes = (totalSeconds - (*hours * 3600)) / 60;
-  *seconds = totalSeconds % 60;
+  // Read the seconds either side of the prescaler, so that both come from the same second
+  do
+  {
+    seconds = ReadStable(&RTC_TSR);
+    prescaler = ReadStable(&RTC_TPR);
+  } while (seconds != ReadStable(&RTC_TSR));
 
-  // Enable time counter, safety first!
-  RTC_SR |= RTC_SR_TCE_MASK;
+  return ((uint64_t) seconds << RTC_TICKS_SHIFT)
+      | (prescaler & RTC_TPR_TICKS_MASK);
 }
 
 /*!
@@ -133,11 +291,20 @@ void RTC_Get(uint8_t* const hours, uint8_t* const minutes,
 /*! @brief Interrupt service routine for the RTC.
  *
  *  The RTC has incremented one second.
- *  The user callback function will be called.
+ *  The user callback function will be called from the main loop.
  *  @note Assumes the RTC has been initialized.
  */
 void __attribute__ ((interrupt))
 RTC_ISR(void)
 {
-  CallbackFunction.callbackFunction(CallbackFunction.callbackArguments);
+  uint32_t start = Stats_Now();
+
+  // Move the cached time on to the second that has just started
+  UpdateTime(ReadStable(&RTC_TSR));
+
+  // Leave the callback to the main loop
+  Deferred_Post(CallbackFunction.callbackFunction,
+      CallbackFunction.callbackArguments);
+
+  Stats_Record(&Stats_ISRs[STATS_ISR_RTC], start);
 }
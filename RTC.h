@@ -20,6 +20,12 @@
 /*! The number of cycles it takes for 1s to elapse (CPU dependant) */
 #define DELAY_SECOND 24414
 
+//@{
+//!< The RTC_GetPrecise time counts ticks of the 32.768 kHz oscillator, the seconds are above RTC_TICKS_SHIFT
+#define RTC_TICKS_SHIFT 15
+#define RTC_TICKS_PER_SECOND (1LU << RTC_TICKS_SHIFT)
+//@}
+
 //!< An enum for RTC specific the callback commands
 enum RTC_CALLBACK_COMMANDS
 {
@@ -34,11 +40,13 @@ typedef struct
 
 /*! @brief Initializes the RTC before first use.
  *
- *  Sets up the control register for the RTC and locks it.
- *  Enables the RTC and sets an interrupt every second.
+ *  Sets up the control register for the RTC and enables the oscillator.
+ *  The counter and the interrupt every second are started by a timer once the
+ *  oscillator has settled, so the call does not wait for it.
  *  @param userFunction is a pointer to a user callback function.
  *  @param userArguments is a pointer to the user arguments to use with the user callback function.
  *  @return bool - TRUE if the RTC was successfully initialized.
+ *  @note Assumes that Timer_Init has been called.
  */
 bool RTC_Init(void (*userFunction)(void*), void* userArguments);
 
@@ -53,6 +61,8 @@ void RTC_Set(const uint8_t hours, const uint8_t minutes, const uint8_t seconds);
 
 /*! @brief Gets the value of the real time clock.
  *
+ *  The time is copied from the one the seconds interrupt keeps in RAM, so the
+ *  counter is not touched and the call is safe from any context.
  *  @param hours The address of a variable to store the real time clock hours.
  *  @param minutes The address of a variable to store the real time clock minutes.
  *  @param seconds The address of a variable to store the real time clock seconds.
@@ -61,6 +71,15 @@ void RTC_Set(const uint8_t hours, const uint8_t minutes, const uint8_t seconds);
 void RTC_Get(uint8_t* const hours, uint8_t* const minutes,
     uint8_t* const seconds);
 
+/*! @brief Gets the value of the real time clock to the tick of its oscillator.
+ *
+ *  The seconds and prescaler are read without stopping the counter, for
+ *  timestamps with a resolution of about 30 us.
+ *  @return uint64_t - The time in RTC_TICKS_PER_SECOND ticks since the RTC was set to 0.
+ *  @note Assumes that the RTC module has been initialized.
+ */
+uint64_t RTC_GetPrecise(void);
+
 /*!
  ** @}
  */
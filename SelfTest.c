@@ -0,0 +1,451 @@
+/*! @file SelfTest.c
+ *
+ *  @brief Routines for measuring the throughput and latency of a packet link.
+ *
+ *  This contains the functions for a self-test that sends packets around a loop
+ *  at increasing rates and reports how many came back clean and how fast.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup SelfTest_module SelfTest module documentation
+ **  @{
+ */
+/*
+ * SELF_TEST command:
+ Parameter 1 is a TSelfTestLoop, parameter 2 the number of rates to step
+ through, 1 to SELFTEST_NB_RATES, and parameter 3 is 0. The test runs on the
+ port the command arrived on, once the acknowledgment has been sent.
+
+ Every step sends SELF_TEST_PROBE packets at the next rate of Rates for
+ SELFTEST_STEP_TIME milliseconds, with the sequence number in parameters 1 and 2,
+ least significant byte first, and the step in parameter 3. It then waits
+ SELFTEST_DRAIN_TIME milliseconds for the last probes to come back. The test
+ stops after the first step that is not clean: a probe was lost, had to be held
+ back because the transmit FIFO was full, or the decoder saw a bad packet.
+ Every packet that arrives on the port while the test runs belongs to it, so
+ an echo of a reply is never taken for a command.
+
+ The results are sent as SELF_TEST packets once the loop is open again. For
+ every step run, a header with the step, 0 and the number of values in
+ parameter 3, followed by one SELF_TEST packet per value carrying the value in
+ its three parameters, least significant byte first: the rate in packets/sec,
+ probes sent, probes received, probes held back, decoder resyncs, bytes
+ discarded by the decoder, and median and 99th percentile round trip in
+ microseconds over every probe of the step, each the top of its histogram
+ bucket. Then a header with 0xFF, the number of steps run and the number
+ of values, followed by the largest clean rate received in packets/sec, the
+ resyncs per million probes sent, and the RxFIFO, priority TxFIFO and packet
+ queue high-water marks over the test.
+ */
+
+#include "SelfTest.h"
+#include "Command.h"
+#include "UART.h"
+#include "PIT.h"
+#include "Timer.h"
+#include "Cpu.h"
+#include <stddef.h>
+
+//@{
+//!< How long every step sends probes for and then waits for the last of them, in milliseconds
+#define SELFTEST_STEP_TIME 500
+#define SELFTEST_DRAIN_TIME 100
+//@}
+
+//!< Number of probes whose send time is kept, must be a power of two larger than the probes a step can have in flight
+#define SELFTEST_INFLIGHT 256
+
+//@{
+//!< The round trip histogram has SELFTEST_SUB_BUCKETS buckets per power of two of microseconds, within 1/8 of the value
+#define SELFTEST_SUB_BITS 3
+#define SELFTEST_SUB_BUCKETS (1 << SELFTEST_SUB_BITS)
+#define SELFTEST_BUCKETS ((16 - SELFTEST_SUB_BITS + 1) * SELFTEST_SUB_BUCKETS)
+//@}
+
+//!< The number of values reported for every step
+#define SELFTEST_STEP_VALUES 8
+
+//!< The number of values in the summary
+#define SELFTEST_SUMMARY_VALUES 5
+
+//!< The header of the summary, in place of a step
+#define SELFTEST_SUMMARY 0xFF
+
+//!< The largest value a result packet can carry
+#define SELFTEST_VALUE_MAX 0xFFFFFFLU
+
+//!< Enum for the phases of the self-test
+typedef enum
+{
+  SELFTEST_IDLE, /*!< No test is running */
+  SELFTEST_STARTING, /*!< Waiting for the acknowledgment of the command to go out */
+  SELFTEST_SENDING, /*!< Sending the probes of a step */
+  SELFTEST_DRAINING, /*!< Waiting for the last probes of a step to come back */
+  SELFTEST_CLOSING /*!< Waiting for the results to go out, and for any echo of them */
+} TSelfTestState;
+
+//!< Struct for the results of one step
+typedef struct
+{
+  uint32_t sent; /*!< The number of probes sent */
+  uint32_t received; /*!< The number of probes that came back */
+  uint32_t throttled; /*!< The number of probes held back because the transmit FIFO was full */
+  uint32_t resyncs; /*!< The number of times the decoder lost sync */
+  uint32_t discarded; /*!< The number of bytes the decoder discarded */
+  uint16_t p50; /*!< The median round trip in microseconds */
+  uint16_t p99; /*!< The 99th percentile round trip in microseconds */
+} TSelfTestStep;
+
+//!< The probe rates of the steps, in packets/sec
+static const uint16_t Rates[SELFTEST_NB_RATES] = { 250, 500, 1000, 1500,
+    2000, 2500, 3000, 4000 };
+
+static TSelfTestState State; /*!< The phase of the test */
+static TPacketPort* Port; /*!< The port being tested */
+static TSelfTestLoop Loop; /*!< Where the probes come back from */
+static TTimerID Ticker; /*!< The timer that runs the test every millisecond */
+static uint8_t NbSteps; /*!< The number of steps to run */
+static uint8_t Step; /*!< The step being run */
+static uint8_t StepsRun; /*!< The number of steps that have finished */
+static uint16_t Ticks; /*!< The milliseconds spent in the phase */
+static uint16_t Credit; /*!< The thousandths of a probe owed at the rate of the step */
+static uint16_t Sequence; /*!< The number of probes sent in the step */
+static uint32_t ResyncsStart; /*!< The decoder resyncs when the step started */
+static uint32_t DiscardedStart; /*!< The bytes discarded by the decoder when the step started */
+static uint32_t MaxClean; /*!< The largest rate received in a clean step, in packets/sec */
+static uint32_t SendTimes[SELFTEST_INFLIGHT]; /*!< The low word of PIT_Now when each probe was queued */
+static uint16_t Histogram[SELFTEST_BUCKETS]; /*!< The number of round trips of the step in each bucket */
+static TSelfTestStep Steps[SELFTEST_NB_RATES]; /*!< The results of every step */
+
+/*! @brief Sends one value of the results.
+ *
+ *  @param value The value, which is saturated to fit in three bytes.
+ *  @return bool - TRUE if the packet was sent.
+ */
+static bool PutValue(const uint32_t value)
+{
+  uint32union_t saturated = { .l = (value > SELFTEST_VALUE_MAX) ?
+      SELFTEST_VALUE_MAX : value };
+  return Packet_Put(Port, SELF_TEST, saturated.s.Lo & 0xFF,
+      saturated.s.Lo >> 8, saturated.s.Hi & 0xFF);
+}
+
+/*! @brief Sends a header and its values.
+ *
+ *  @param parameter1 The step, or SELFTEST_SUMMARY.
+ *  @param parameter2 The second parameter of the header.
+ *  @param values The values to send.
+ *  @param count The number of values.
+ *  @return void
+ */
+static void PutResult(const uint8_t parameter1, const uint8_t parameter2,
+    const uint32_t values[], const uint8_t count)
+{
+  if (!Packet_Put(Port, SELF_TEST, parameter1, parameter2, count))
+    return;
+
+  for (int i = 0; i < count; i++)
+  {
+    if (!PutValue(values[i]))
+      return;
+  }
+}
+
+/*! @brief Gets the histogram bucket of a round trip.
+ *
+ *  @param us The round trip in microseconds.
+ *  @return uint8_t - The bucket, the values below SELFTEST_SUB_BUCKETS get one each.
+ */
+static uint8_t Bucket(const uint16_t us)
+{
+  if (us < SELFTEST_SUB_BUCKETS)
+    return us;
+
+  // The top bit picks the power of two, the next bits the bucket inside it
+  uint8_t shift = (31 - __builtin_clz(us)) - SELFTEST_SUB_BITS;
+  return (shift + 1) * SELFTEST_SUB_BUCKETS
+      + ((us >> shift) & (SELFTEST_SUB_BUCKETS - 1));
+}
+
+/*! @brief Gets the largest round trip that falls in a histogram bucket.
+ *
+ *  @param bucket The bucket.
+ *  @return uint16_t - The round trip in microseconds.
+ */
+static uint16_t BucketTop(const uint8_t bucket)
+{
+  if (bucket < SELFTEST_SUB_BUCKETS)
+    return bucket;
+
+  uint8_t shift = bucket / SELFTEST_SUB_BUCKETS - 1;
+  uint32_t low = (uint32_t) (SELFTEST_SUB_BUCKETS
+      + (bucket & (SELFTEST_SUB_BUCKETS - 1))) << shift;
+  return low + (1LU << shift) - 1;
+}
+
+/*! @brief Gets a percentile of the round trips of the step.
+ *
+ *  @param percent The percentile.
+ *  @return uint16_t - The top of the bucket the percentile falls in, in microseconds, or 0 if nothing came back.
+ */
+static uint16_t Percentile(const uint8_t percent)
+{
+  const uint32_t received = Steps[Step].received;
+  if (received == 0)
+    return 0;
+
+  // Find the first bucket holding the round trip of that rank
+  uint32_t rank = (received - 1) * percent / 100, seen = 0;
+  for (int i = 0; i < SELFTEST_BUCKETS; i++)
+  {
+    seen += Histogram[i];
+    if (seen > rank)
+      return BucketTop(i);
+  }
+  return 0xFFFF;
+}
+
+/*! @brief Starts sending the probes of the next step.
+ *
+ *  @return void
+ */
+static void StartStep(void)
+{
+  TSelfTestStep* const step = &Steps[Step];
+  step->sent = 0;
+  step->received = 0;
+  step->throttled = 0;
+
+  Sequence = 0;
+  Credit = 0;
+  Ticks = 0;
+  for (int i = 0; i < SELFTEST_BUCKETS; i++)
+    Histogram[i] = 0;
+  ResyncsStart = Port->resyncs;
+  DiscardedStart = Port->bytesDiscarded;
+  State = SELFTEST_SENDING;
+}
+
+/*! @brief Sends the probes owed at the rate of the step for one millisecond.
+ *
+ *  @return void
+ */
+static void SendProbes(void)
+{
+  TSelfTestStep* const step = &Steps[Step];
+
+  Credit += Rates[Step];
+  while (Credit >= 1000)
+  {
+    Credit -= 1000;
+
+    // A probe that does not fit is not waited for, the link is saturated
+    if (UARTPriorityFIFO_Free(&Port->uart.TxPriorityFIFO)
+        < Packet_WireSize(Port, PACKET_CLASSIC_PAYLOAD))
+    {
+      step->throttled++;
+      continue;
+    }
+
+    uint16union_t sequence = { .l = Sequence };
+    SendTimes[Sequence & (SELFTEST_INFLIGHT - 1)] = (uint32_t) PIT_Now();
+    if (!Packet_Put(Port, SELF_TEST_PROBE, sequence.s.Lo, sequence.s.Hi, Step))
+    {
+      step->throttled++;
+      continue;
+    }
+    Sequence++;
+    step->sent++;
+  }
+}
+
+/*! @brief Works out the results of the step that has just drained.
+ *
+ *  @return bool - TRUE if the step was clean.
+ */
+static bool FinishStep(void)
+{
+  TSelfTestStep* const step = &Steps[Step];
+  step->resyncs = Port->resyncs - ResyncsStart;
+  step->discarded = Port->bytesDiscarded - DiscardedStart;
+
+  step->p50 = Percentile(50);
+  step->p99 = Percentile(99);
+  StepsRun = Step + 1;
+
+  // Every probe has to come back intact, without any being held back
+  bool clean = step->sent != 0 && step->received == step->sent
+      && step->throttled == 0 && step->resyncs == 0 && step->discarded == 0;
+  if (clean)
+  {
+    uint32_t rate = step->received * 1000 / SELFTEST_STEP_TIME;
+    if (rate > MaxClean)
+      MaxClean = rate;
+  }
+  return clean;
+}
+
+/*! @brief Opens the loop and sends the results.
+ *
+ *  @return void
+ */
+static void Finish(void)
+{
+  if (Loop == SELFTEST_LOOP_INTERNAL)
+    UART_SetLoopback(&Port->uart, false);
+
+  uint32_t sent = 0, resyncs = 0;
+  for (int i = 0; i < StepsRun; i++)
+  {
+    const TSelfTestStep* const step = &Steps[i];
+    uint32_t values[SELFTEST_STEP_VALUES] = { Rates[i], step->sent,
+        step->received, step->throttled, step->resyncs, step->discarded,
+        step->p50, step->p99 };
+    PutResult(i, 0, values, SELFTEST_STEP_VALUES);
+
+    sent += step->sent;
+    resyncs += step->resyncs;
+  }
+
+  uint32_t summary[SELFTEST_SUMMARY_VALUES] = { MaxClean,
+      sent ? (uint32_t) ((uint64_t) resyncs * 1000000 / sent) : 0,
+      Port->uart.RxFIFO.HighWater, Port->uart.TxPriorityFIFO.HighWater,
+      Port->queue.HighWater };
+  PutResult(SELFTEST_SUMMARY, StepsRun, summary, SELFTEST_SUMMARY_VALUES);
+
+  Ticks = 0;
+  State = SELFTEST_CLOSING;
+}
+
+/*! @brief Timer callback that runs the test every millisecond.
+ *
+ *  @param arguments Unused.
+ *  @return void
+ */
+static void Tick(void* arguments)
+{
+  switch (State)
+  {
+  case SELFTEST_STARTING:
+    // Close the loop once the acknowledgment has gone out
+    if (!UART_Idle())
+      return;
+    if (Loop == SELFTEST_LOOP_INTERNAL)
+      UART_SetLoopback(&Port->uart, true);
+
+    // The self-test owns the high-water marks while it runs
+    EnterCritical();
+    Port->uart.RxFIFO.HighWater = 0;
+    Port->uart.TxPriorityFIFO.HighWater = 0;
+    Port->queue.HighWater = 0;
+    ExitCritical();
+
+    Step = 0;
+    StartStep();
+    return;
+
+  case SELFTEST_SENDING:
+    SendProbes();
+    if (++Ticks >= SELFTEST_STEP_TIME)
+    {
+      Ticks = 0;
+      State = SELFTEST_DRAINING;
+    }
+    return;
+
+  case SELFTEST_DRAINING:
+    if (++Ticks < SELFTEST_DRAIN_TIME)
+      return;
+    if (FinishStep() && ++Step < NbSteps)
+      StartStep();
+    else
+      Finish();
+    return;
+
+  case SELFTEST_CLOSING:
+    // Anything echoed back after the results is still the test's
+    if (!UART_Idle())
+      Ticks = 0;
+    else if (++Ticks >= SELFTEST_DRAIN_TIME)
+    {
+      Timer_Cancel(Ticker);
+      State = SELFTEST_IDLE;
+    }
+    return;
+
+  default:
+    return;
+  }
+}
+
+/*! @brief Handles the SELF_TEST command.
+ *
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandleSelfTest(const TPacket* const packet)
+{
+  if (State != SELFTEST_IDLE)
+    return COMMAND_FAILED;
+
+  Ticker = Timer_StartPeriodic(1, Tick, NULL);
+  if (Ticker == TIMER_INVALID)
+    return COMMAND_FAILED;
+
+  Port = packet->port;
+  Loop = packet->parameter1;
+  NbSteps = packet->parameter2;
+  StepsRun = 0;
+  MaxClean = 0;
+  State = SELFTEST_STARTING;
+  return COMMAND_SUCCESS;
+}
+
+/*! @brief Sets up the self-test, stopped, and registers the SELF_TEST command.
+ *
+ *  @return bool - TRUE if the self-test module was successfully initialized.
+ *  @note Assumes that Command_Init and Timer_Init have been called.
+ */
+bool SelfTest_Init(void)
+{
+  State = SELFTEST_IDLE;
+  Port = NULL;
+
+  static const TCommandRange selfTest[3] = { { SELFTEST_LOOP_INTERNAL,
+      SELFTEST_LOOP_EXTERNAL }, { 1, SELFTEST_NB_RATES }, COMMAND_EXACT(0) };
+  return Command_Register(SELF_TEST, HandleSelfTest, selfTest);
+}
+
+/*! @brief Takes a received packet if it is one the running self-test sent.
+ *
+ *  @param packet The received packet, with the ACK bit cleared.
+ *  @return bool - TRUE if the packet belonged to the self-test and needs no more handling.
+ *  @note Call only from the main loop, for every packet before it is dispatched.
+ */
+bool SelfTest_Receive(const TPacket* const packet)
+{
+  if (State == SELFTEST_IDLE || packet->port != Port)
+    return false;
+
+  // Probes of an earlier step that come back late are not counted
+  uint16union_t sequence = { .s = { packet->parameter1, packet->parameter2 } };
+  if ((State == SELFTEST_SENDING || State == SELFTEST_DRAINING)
+      && packet->command == SELF_TEST_PROBE && packet->parameter3 == Step
+      && sequence.l < Sequence)
+  {
+    Steps[Step].received++;
+
+    // The round trip runs from queueing the probe to the receive interrupt framing it
+    uint32_t ticks = (uint32_t) packet->timestamp
+        - SendTimes[sequence.l & (SELFTEST_INFLIGHT - 1)];
+    uint64_t us = PIT_TicksToNs(ticks) / 1000;
+    Histogram[Bucket((us > 0xFFFF) ? 0xFFFF : us)]++;
+  }
+  return true;
+}
+
+/*!
+ ** @}
+ */
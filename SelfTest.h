@@ -0,0 +1,52 @@
+/*! @file SelfTest.h
+ *
+ *  @brief Routines for measuring the throughput and latency of a packet link.
+ *
+ *  This contains the functions for a self-test that sends packets around a loop
+ *  at increasing rates and reports how many came back clean and how fast.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup SelfTest_module SelfTest module documentation
+ **  @{
+ */
+
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+// new types
+#include "types.h"
+#include "packet.h"
+
+//!< Enum for where the packets sent by the self-test come back from
+typedef enum
+{
+  SELFTEST_LOOP_INTERNAL, /*!< The UART loop mode, the transmitter feeds the receiver inside the module */
+  SELFTEST_LOOP_EXTERNAL /*!< Whatever is on the other end of the cable echoes every byte */
+} TSelfTestLoop;
+
+//!< The number of rates the self-test steps through
+#define SELFTEST_NB_RATES 8
+
+/*! @brief Sets up the self-test, stopped, and registers the SELF_TEST command.
+ *
+ *  @return bool - TRUE if the self-test module was successfully initialized.
+ *  @note Assumes that Command_Init and Timer_Init have been called.
+ */
+bool SelfTest_Init(void);
+
+/*! @brief Takes a received packet if it is one the running self-test sent.
+ *
+ *  @param packet The received packet, with the ACK bit cleared.
+ *  @return bool - TRUE if the packet belonged to the self-test and needs no more handling.
+ *  @note Call only from the main loop, for every packet before it is dispatched.
+ */
+bool SelfTest_Receive(const TPacket* const packet);
+
+#endif
+
+/*!
+ ** @}
+ */
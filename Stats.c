@@ -0,0 +1,240 @@
+/*! @file Stats.c
+ *
+ *  @brief Routines for instrumenting the hot paths of the firmware.
+ *
+ *  This contains the functions for timing code with the Cortex-M4 DWT cycle counter
+ *  and for reading the statistics back through the DIAGNOSTICS command.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Stats_module Stats module documentation
+ **  @{
+ */
+/*
+ * DIAGNOSTICS command:
+ Parameter 1 selects a group and parameter 2 an entry of the group, parameter 3
+ is 0. The reply is a DIAGNOSTICS packet echoing the group and entry with the
+ number of values as parameter 3, followed by one DIAGNOSTICS packet per value
+ carrying the value in its three parameters, least significant byte first.
+ Values saturate at 0xFFFFFF.
+
+ Group 0, entry 0, for the port the command arrived on: RxFIFO high-water
+ mark, RxFIFO dropped bytes, TxFIFO high-water mark, TxFIFO dropped bytes, bytes
+ discarded by the decoder, decoder resyncs, dropped deferred callbacks, last and
+ largest event loop latency, priority TxFIFO high-water mark and dropped bytes.
+ Group 1, entry is a command byte: runs, min, average and max handler cycles.
+ Group 2, entry is a TStatsISR: runs, min, average and max ISR cycles.
+ Group 3, entry 0: runs, min, average and max cycles to launch a flash command.
+ Group 4, entry 0: the microseconds after Stats_Init at which each TStatsBootStage
+ completed, 0 for a stage that is still in progress.
+ Group 5, entry is a TPowerState: wakes measured, last and largest microseconds
+ from the start of an RTC second to the first instruction after the wake, and
+ largest microseconds until the clocks were back.
+ */
+
+#include "Stats.h"
+#include "Command.h"
+#include "packet.h"
+#include "UART.h"
+#include "Deferred.h"
+#include "Event.h"
+#include "Power.h"
+#include "Cpu.h"
+
+//@{
+//!< The debug exception and monitor control register, which gates the DWT
+#define DEMCR (*(volatile uint32_t*) 0xE000EDFCLU)
+#define DEMCR_TRCENA_MASK (1LU << 24)
+//@}
+
+//!< The bit of DWT_CTRL that starts the cycle counter
+#define DWT_CTRL_CYCCNTENA_MASK (1LU << 0)
+
+//!< The largest value a diagnostics packet can carry
+#define STATS_VALUE_MAX 0xFFFFFFLU
+
+//!< Enum for the groups of the DIAGNOSTICS command
+typedef enum
+{
+  STATS_GROUP_LINK, /*!< The FIFO, decoder and event loop counters */
+  STATS_GROUP_COMMAND, /*!< The cycles of one command handler */
+  STATS_GROUP_ISR, /*!< The cycles of one interrupt service routine */
+  STATS_GROUP_FLASH, /*!< The cycles of launching a flash command */
+  STATS_GROUP_BOOT, /*!< The time each stage of the boot took */
+  STATS_GROUP_POWER /*!< The wake latency of one sleep mode */
+} TStatsGroup;
+
+TStatsCycles Stats_Commands[STATS_NB_COMMANDS], Stats_ISRs[STATS_NB_ISRS],
+    Stats_FlashLaunch;
+uint32_t volatile Stats_Boot[STATS_NB_BOOT_STAGES];
+
+/*! @brief Clears the cycle counts of some code.
+ *
+ *  @param stats A pointer to the cycle counts.
+ *  @return void
+ */
+static void Clear(TStatsCycles * const stats)
+{
+  stats->count = 0;
+  stats->min = 0xFFFFFFFF;
+  stats->max = 0;
+  stats->total = 0;
+}
+
+/*! @brief Sends one value of a diagnostics reply.
+ *
+ *  @param port The port to send the value out of.
+ *  @param value The value, which is saturated to fit in three bytes.
+ *  @return bool - TRUE if the packet was sent.
+ */
+static bool PutValue(TPacketPort * const port, const uint32_t value)
+{
+  uint32union_t saturated = { .l = (value > STATS_VALUE_MAX) ?
+      STATS_VALUE_MAX : value };
+  return Packet_Put(port, DIAGNOSTICS, saturated.s.Lo & 0xFF, saturated.s.Lo >> 8,
+      saturated.s.Hi & 0xFF);
+}
+
+/*! @brief Sends the header and values of a diagnostics reply.
+ *
+ *  @param packet The received packet.
+ *  @param values The values to send.
+ *  @param count The number of values.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus PutReply(const TPacket* const packet,
+    const uint32_t values[], const uint8_t count)
+{
+  if (!Packet_Put(packet->port, DIAGNOSTICS, packet->parameter1, packet->parameter2, count))
+    return COMMAND_FAILED;
+
+  for (int i = 0; i < count; i++)
+  {
+    if (!PutValue(packet->port, values[i]))
+      return COMMAND_FAILED;
+  }
+  return COMMAND_SUCCESS;
+}
+
+/*! @brief Sends the cycle counts of some code.
+ *
+ *  @param packet The received packet.
+ *  @param stats A pointer to the cycle counts, which may be written by an interrupt.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus PutCycles(const TPacket* const packet,
+    const TStatsCycles* const stats)
+{
+  // Take a consistent copy, the counts may be written from an interrupt
+  EnterCritical();
+  TStatsCycles copy = *stats;
+  ExitCritical();
+
+  uint32_t values[4] = { copy.count, copy.count ? copy.min : 0,
+      copy.count ? (uint32_t) (copy.total / copy.count) : 0, copy.max };
+  return PutReply(packet, values, 4);
+}
+
+/*! @brief Converts a wake latency to microseconds.
+ *
+ *  @param ticks The number of RTC prescaler ticks.
+ *  @return uint32_t - The number of microseconds.
+ */
+static uint32_t TicksToUs(const uint16_t ticks)
+{
+  return (uint32_t) ticks * 1000000 / POWER_LATENCY_TICK_HZ;
+}
+
+/*! @brief Handles the DIAGNOSTICS command.
+ *
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandleDiagnostics(const TPacket* const packet)
+{
+  switch (packet->parameter1)
+  {
+  case STATS_GROUP_LINK:
+  {
+    if (packet->parameter2 != 0)
+      return COMMAND_FAILED;
+
+    // The link counters are those of the port that asked for them
+    const TPacketPort* const port = packet->port;
+    const TUARTRxFIFO* const rx = &port->uart.RxFIFO;
+    const TUARTTxFIFO* const tx = &port->uart.TxFIFO;
+    const TUARTPriorityFIFO* const priority = &port->uart.TxPriorityFIFO;
+    uint32_t values[] = { rx->HighWater, rx->Dropped, tx->HighWater,
+        tx->Dropped, port->bytesDiscarded, port->resyncs, Deferred_Dropped,
+        Event_LatencyLast, Event_LatencyMax, priority->HighWater,
+        priority->Dropped };
+    return PutReply(packet, values, sizeof(values) / sizeof(values[0]));
+  }
+  case STATS_GROUP_COMMAND:
+    if (packet->parameter2 >= STATS_NB_COMMANDS)
+      return COMMAND_FAILED;
+    return PutCycles(packet, &Stats_Commands[packet->parameter2]);
+  case STATS_GROUP_ISR:
+    if (packet->parameter2 >= STATS_NB_ISRS)
+      return COMMAND_FAILED;
+    return PutCycles(packet, &Stats_ISRs[packet->parameter2]);
+  case STATS_GROUP_FLASH:
+    if (packet->parameter2 != 0)
+      return COMMAND_FAILED;
+    return PutCycles(packet, &Stats_FlashLaunch);
+  case STATS_GROUP_BOOT:
+  {
+    if (packet->parameter2 != 0)
+      return COMMAND_FAILED;
+
+    // Cycles do not fit in a diagnostics packet for long, microseconds do
+    uint32_t values[STATS_NB_BOOT_STAGES];
+    for (int i = 0; i < STATS_NB_BOOT_STAGES; i++)
+      values[i] = Stats_Boot[i] / (CPU_CORE_CLK_HZ / 1000000);
+    return PutReply(packet, values, STATS_NB_BOOT_STAGES);
+  }
+  case STATS_GROUP_POWER:
+  {
+    if (packet->parameter2 >= POWER_NB_STATES)
+      return COMMAND_FAILED;
+
+    const TPowerLatency* const latency = &Power_Latency[packet->parameter2];
+    uint32_t values[] = { latency->count, TicksToUs(latency->wakeLast),
+        TicksToUs(latency->wakeMax), TicksToUs(latency->resumeMax) };
+    return PutReply(packet, values, sizeof(values) / sizeof(values[0]));
+  }
+  default:
+    return COMMAND_FAILED;
+  }
+}
+
+/*! @brief Starts the cycle counter, clears the statistics and registers the DIAGNOSTICS command.
+ *
+ *  @return bool - TRUE if the stats module was successfully initialized.
+ *  @note Assumes that Command_Init has been called.
+ */
+bool Stats_Init(void)
+{
+  // Enable the trace block and start the cycle counter
+  DEMCR |= DEMCR_TRCENA_MASK;
+  DWT_CYCCNT = 0;
+  DWT_CTRL |= DWT_CTRL_CYCCNTENA_MASK;
+
+  for (int i = 0; i < STATS_NB_COMMANDS; i++)
+    Clear(&Stats_Commands[i]);
+  for (int i = 0; i < STATS_NB_ISRS; i++)
+    Clear(&Stats_ISRs[i]);
+  Clear(&Stats_FlashLaunch);
+  for (int i = 0; i < STATS_NB_BOOT_STAGES; i++)
+    Stats_Boot[i] = 0;
+
+  static const TCommandRange diagnostics[3] = { { STATS_GROUP_LINK,
+      STATS_GROUP_POWER }, COMMAND_ANY, COMMAND_EXACT(0) };
+  return Command_Register(DIAGNOSTICS, HandleDiagnostics, diagnostics);
+}
+
+/*!
+ ** @}
+ */
@@ -0,0 +1,115 @@
+/*! @file Stats.h
+ *
+ *  @brief Routines for instrumenting the hot paths of the firmware.
+ *
+ *  This contains the functions for timing code with the Cortex-M4 DWT cycle counter
+ *  and for reading the statistics back through the DIAGNOSTICS command.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Stats_module Stats module documentation
+ **  @{
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+// new types
+#include "types.h"
+#include "MK70F12.h"
+
+//!< Number of commands cycles are kept for, one for every command byte without the ACK bit
+#define STATS_NB_COMMANDS 128
+
+//!< Enum for the interrupts whose execution cycles are kept
+typedef enum
+{
+  STATS_ISR_UART, /*!< The UART status and UART DMA channel interrupts */
+  STATS_ISR_FTM, /*!< FTM0_ISR */
+  STATS_ISR_PIT, /*!< The PIT channel interrupts */
+  STATS_ISR_RTC, /*!< RTC_ISR */
+  STATS_ISR_FLASH, /*!< FTFE_ISR */
+  STATS_ISR_LEDS, /*!< FTM2_ISR */
+  STATS_NB_ISRS
+} TStatsISR;
+
+//!< Enum for the stages of the boot, in the order they usually complete
+typedef enum
+{
+  STATS_BOOT_LINK, /*!< The serial link is up and the startup packets are queued */
+  STATS_BOOT_MODULES, /*!< Every module has been initialized and interrupts are about to be enabled */
+  STATS_BOOT_PARAMS, /*!< The parameters written on boot have been programmed into the Flash */
+  STATS_BOOT_RTC, /*!< The 32 kHz oscillator has settled and the RTC is counting */
+  STATS_NB_BOOT_STAGES
+} TStatsBootStage;
+
+//!< Struct for the cycle counts taken by one piece of code
+typedef struct
+{
+  uint32_t count; /*!< The number of times the code has run */
+  uint32_t min; /*!< The fewest cycles taken */
+  uint32_t max; /*!< The most cycles taken */
+  uint64_t total; /*!< The total number of cycles taken, for the average */
+} TStatsCycles;
+
+//! Cycle counts of the instrumented code, each only written from one context
+extern TStatsCycles Stats_Commands[STATS_NB_COMMANDS], /*!< The command handlers */
+Stats_ISRs[STATS_NB_ISRS], /*!< The interrupt service routines */
+Stats_FlashLaunch; /*!< Launching a flash command */
+
+//! The cycle count when each boot stage completed, 0 while it is still in progress
+extern uint32_t volatile Stats_Boot[STATS_NB_BOOT_STAGES];
+
+/*! @brief Starts the cycle counter, clears the statistics and registers the DIAGNOSTICS command.
+ *
+ *  @return bool - TRUE if the stats module was successfully initialized.
+ *  @note Assumes that Command_Init has been called.
+ */
+bool Stats_Init(void);
+
+/*! @brief Reads the cycle counter.
+ *
+ *  @return uint32_t - The number of core clock cycles, which wraps every 2^32 cycles.
+ *  @note Assumes that Stats_Init has been called.
+ */
+static inline uint32_t Stats_Now(void)
+{
+  return DWT_CYCCNT;
+}
+
+/*! @brief Adds one run of some code to its cycle counts.
+ *
+ *  @param stats A pointer to the cycle counts of the code.
+ *  @param start The Stats_Now reading taken when the code started.
+ *  @return void
+ */
+static inline void Stats_Record(TStatsCycles * const stats, const uint32_t start)
+{
+  uint32_t cycles = DWT_CYCCNT - start;
+
+  stats->count++;
+  stats->total += cycles;
+  if (cycles < stats->min)
+    stats->min = cycles;
+  if (cycles > stats->max)
+    stats->max = cycles;
+}
+
+/*! @brief Notes that a stage of the boot has completed.
+ *
+ *  @param stage The stage of the boot.
+ *  @return void
+ *  @note Safe to call from any interrupt.
+ */
+static inline void Stats_BootStage(const TStatsBootStage stage)
+{
+  Stats_Boot[stage] = DWT_CYCCNT;
+}
+
+#endif
+
+/*!
+ ** @}
+ */
@@ -0,0 +1,255 @@
+/*! @file Telemetry.c
+ *
+ *  @brief Routines for streaming samples of the tower state to the PC.
+ *
+ *  This contains the functions for a telemetry stream that is sampled at a PIT
+ *  driven rate and slows down when the PC does not keep up.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Telemetry_module Telemetry module documentation
+ **  @{
+ */
+/*
+ * TELEMETRY command:
+ Parameter 1 is a mask of TELEMETRY_SOURCE bits, 0 stops the stream. Parameters
+ 2 and 3 are the sample period in milliseconds, least significant byte first.
+ The stream goes out of the port the command arrived on.
+
+ Samples are sent as TELEMETRY packets. The first byte is the mask of sources,
+ followed by one or more samples: a sequence number that counts sample periods,
+ then the bytes of each selected source. In framed mode as many samples as fit
+ share a frame, in classic mode a sample is spread over as many packets as it
+ takes, with the last one padded with 0.
+
+ A batch is only sent when the TxFIFO has room for it and TELEMETRY_TX_RESERVE
+ more bytes for command replies. Otherwise it is held back and only every
+ other sample period is sampled, halving the rate again each time the FIFO is
+ still full. Gaps in the sequence numbers show the periods that were skipped.
+ */
+
+#include "Telemetry.h"
+#include "Command.h"
+#include "packet.h"
+#include "PIT.h"
+#include "RTC.h"
+#include "Param.h"
+#include <stddef.h>
+
+//!< The TxFIFO space left free for command replies
+#define TELEMETRY_TX_RESERVE 64
+
+//!< The most samples sent in one frame
+#define TELEMETRY_BATCH_MAX 3
+
+//!< The largest divider of the sample rate when the PC does not keep up
+#define TELEMETRY_DIVIDER_MAX 64
+
+//!< The number of bytes in the sample of every source
+#define TELEMETRY_SAMPLE_MAX (1 + 3 + 8 + 4)
+
+#if 1 + TELEMETRY_BATCH_MAX * TELEMETRY_SAMPLE_MAX > PACKET_PAYLOAD_MAX
+#error "TELEMETRY_BATCH_MAX samples must fit in one frame"
+#endif
+
+static TPacketPort* Port; /*!< The port the stream goes out of, NULL while it is stopped */
+static uint8_t Sources; /*!< The sources selected for the stream */
+static uint8_t SampleSize; /*!< The number of bytes in one sample */
+static uint8_t Sequence; /*!< The number of sample periods so far */
+static uint8_t Divider; /*!< A sample is taken every this many sample periods */
+static uint8_t Periods; /*!< The number of sample periods since the last sample */
+
+//@{
+//!< The batch of samples waiting to be sent, starting with the mask of sources
+static uint8_t Batch[PACKET_PAYLOAD_MAX];
+static uint8_t BatchLength;
+static uint8_t BatchCount;
+//@}
+
+/*! @brief Appends a 16-bit value to the batch, saturating it first.
+ *
+ *  @param value The value.
+ *  @return void
+ */
+static void PutValue16(const uint32_t value)
+{
+  uint16union_t saturated = { .l = (value > 0xFFFF) ? 0xFFFF : value };
+  Batch[BatchLength++] = saturated.s.Lo;
+  Batch[BatchLength++] = saturated.s.Hi;
+}
+
+/*! @brief Takes a sample of the selected sources and appends it to the batch.
+ *
+ *  @return void
+ */
+static void Sample(void)
+{
+  Batch[BatchLength++] = Sequence;
+
+  if (Sources & TELEMETRY_SOURCE_TIME)
+  {
+    RTC_Get(&Batch[BatchLength], &Batch[BatchLength + 1],
+        &Batch[BatchLength + 2]);
+    BatchLength += 3;
+  }
+
+  if (Sources & TELEMETRY_SOURCE_LINK)
+  {
+    PutValue16(UARTTxFIFO_Free(&Port->uart.TxFIFO));
+    PutValue16(Port->uart.RxFIFO.Dropped);
+    PutValue16(Port->uart.TxFIFO.Dropped);
+    PutValue16(Port->bytesDiscarded);
+  }
+
+  if (Sources & TELEMETRY_SOURCE_PARAMS)
+  {
+    uint32union_t config = { .l = 0xFFFFFFFF };
+    Param_Read(PARAM_TOWER_CONFIG, &config.l);
+    PutValue16(config.s.Lo);
+    PutValue16(config.s.Hi);
+  }
+
+  BatchCount++;
+}
+
+/*! @brief Gets the number of samples sent together on the port.
+ *
+ *  @return uint8_t - One in classic mode, as many as fit in a frame in framed mode.
+ */
+static uint8_t BatchSize(void)
+{
+  if (Port->mode == PACKET_MODE_CLASSIC)
+    return 1;
+
+  uint8_t size = (PACKET_PAYLOAD_MAX - 1) / SampleSize;
+  return (size > TELEMETRY_BATCH_MAX) ? TELEMETRY_BATCH_MAX : size;
+}
+
+/*! @brief Empties the batch, leaving only the mask of sources.
+ *
+ *  @return void
+ */
+static void ClearBatch(void)
+{
+  Batch[0] = Sources;
+  BatchLength = 1;
+  BatchCount = 0;
+}
+
+/*! @brief Sends the batch if the TxFIFO has room for it, and adapts the sample rate.
+ *
+ *  @return void
+ */
+static void Flush(void)
+{
+  uint8_t chunk = Packet_PayloadSize(Port);
+  uint8_t packets = (BatchLength + chunk - 1) / chunk;
+  uint16_t needed = (packets - 1) * Packet_WireSize(Port, chunk)
+      + Packet_WireSize(Port, BatchLength - (packets - 1) * chunk);
+  uint16_t free = UARTTxFIFO_Free(&Port->uart.TxFIFO);
+
+  // Hold the batch back and sample less often until the PC catches up
+  if (free < needed + TELEMETRY_TX_RESERVE)
+  {
+    if (Divider < TELEMETRY_DIVIDER_MAX)
+      Divider <<= 1;
+    return;
+  }
+
+  // There is room for every packet, so none of them can fail
+  for (uint8_t offset = 0; offset < BatchLength; offset += chunk)
+  {
+    uint8_t length = BatchLength - offset;
+    if (length > chunk)
+      length = chunk;
+    Packet_PutBulk(Port, TELEMETRY, &Batch[offset], length);
+  }
+  ClearBatch();
+
+  // Speed back up while the TxFIFO stays mostly empty
+  if (free - needed >= UART_TX_FIFO_SIZE / 2 && Divider > 1)
+    Divider >>= 1;
+}
+
+/*! @brief PIT callback for every sample period, deferred to the main loop by the PIT interrupt.
+ *
+ *  @param arguments Unused.
+ *  @return void
+ */
+static void Period(void* arguments)
+{
+  if (!Port)
+    return;
+
+  Sequence++;
+  if (++Periods < Divider)
+    return;
+  Periods = 0;
+
+  // A full batch that could not be sent yet skips the sample
+  uint8_t batchSize = BatchSize();
+  if (BatchCount < batchSize)
+    Sample();
+  if (BatchCount >= batchSize)
+    Flush();
+}
+
+/*! @brief Handles the TELEMETRY command.
+ *
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandleTelemetry(const TPacket* const packet)
+{
+  // A mask of 0 stops the stream
+  if (packet->parameter1 == 0)
+  {
+    PIT_Enable(TELEMETRY_PIT_CHANNEL, false);
+    Port = NULL;
+    return COMMAND_SUCCESS;
+  }
+
+  uint16union_t period = { .s = { packet->parameter2, packet->parameter3 } };
+  if (period.l < TELEMETRY_PERIOD_MIN || period.l > TELEMETRY_PERIOD_MAX)
+    return COMMAND_FAILED;
+
+  // Work out the size of a sample once, it does not change while streaming
+  Sources = packet->parameter1;
+  SampleSize = 1;
+  if (Sources & TELEMETRY_SOURCE_TIME)
+    SampleSize += 3;
+  if (Sources & TELEMETRY_SOURCE_LINK)
+    SampleSize += 8;
+  if (Sources & TELEMETRY_SOURCE_PARAMS)
+    SampleSize += 4;
+
+  Port = packet->port;
+  Sequence = 0;
+  Divider = 1;
+  Periods = 0;
+  ClearBatch();
+
+  return PIT_Set(TELEMETRY_PIT_CHANNEL, period.l * 1000000LU, true) ?
+      COMMAND_SUCCESS : COMMAND_FAILED;
+}
+
+/*! @brief Sets up the stream, stopped, and registers the TELEMETRY command.
+ *
+ *  @return bool - TRUE if the telemetry module was successfully initialized.
+ *  @note Assumes that Command_Init and PIT_Init have been called.
+ */
+bool Telemetry_Init(void)
+{
+  Port = NULL;
+
+  static const TCommandRange telemetry[3] = { { 0, TELEMETRY_SOURCE_ALL },
+      COMMAND_ANY, COMMAND_ANY };
+  return PIT_SetCallback(TELEMETRY_PIT_CHANNEL, Period, NULL)
+      && Command_Register(TELEMETRY, HandleTelemetry, telemetry);
+}
+
+/*!
+ ** @}
+ */
@@ -0,0 +1,50 @@
+/*! @file Telemetry.h
+ *
+ *  @brief Routines for streaming samples of the tower state to the PC.
+ *
+ *  This contains the functions for a telemetry stream that is sampled at a PIT
+ *  driven rate and slows down when the PC does not keep up.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Telemetry_module Telemetry module documentation
+ **  @{
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+// new types
+#include "types.h"
+
+//!< The PIT channel that sets the sample rate of the stream
+#define TELEMETRY_PIT_CHANNEL 1
+
+//@{
+//!< The sources that can be selected for the stream, each adds its bytes to every sample in this order
+#define TELEMETRY_SOURCE_TIME 0x01 /*!< The RTC hours, minutes and seconds, 3 bytes */
+#define TELEMETRY_SOURCE_LINK 0x02 /*!< The TxFIFO free space, RxFIFO and TxFIFO dropped bytes and bytes discarded by the decoder, 2 bytes each */
+#define TELEMETRY_SOURCE_PARAMS 0x04 /*!< The tower configuration stored in the flash, 4 bytes */
+#define TELEMETRY_SOURCE_ALL 0x07
+//@}
+
+//@{
+//!< The shortest and longest sample period, in milliseconds
+#define TELEMETRY_PERIOD_MIN 10
+#define TELEMETRY_PERIOD_MAX 4000
+//@}
+
+/*! @brief Sets up the stream, stopped, and registers the TELEMETRY command.
+ *
+ *  @return bool - TRUE if the telemetry module was successfully initialized.
+ *  @note Assumes that Command_Init and PIT_Init have been called.
+ */
+bool Telemetry_Init(void);
+
+#endif
+
+/*!
+ ** @}
+ */
@@ -0,0 +1,451 @@
+/*! @file Timer.c
+ *
+ *  @brief Routines for software timers multiplexed onto one FTM channel.
+ *
+ *  This contains the functions for starting and cancelling one-shot and periodic timers.
+ *  The timers are kept in a hierarchical timer wheel and only the next expiry is
+ *  programmed into the FTM channel.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Timer_module Timer module documentation
+ **  @{
+ */
+/*
+ * The wheel has TIMER_LEVELS levels of TIMER_SLOTS slots. Level 0 holds the
+ * timers due in the next TIMER_SLOTS ticks, one slot per tick, and every level
+ * above covers TIMER_SLOTS times the span of the one below. When level 0 wraps,
+ * the next slot of level 1 is spread back over level 0, and so on up. Now is
+ * the next tick to run and CurrentTick is the last tick that has started,
+ * which is tracked against the free running FTM counter.
+ *
+ * The FTM channel interrupt only defers TimerService to the main loop, which
+ * runs every tick that has passed and then programs the channel for the next
+ * tick with something to do. Every timer call is made from the main loop, so
+ * the wheel needs no locking.
+ */
+
+#include "Timer.h"
+#include "FTM.h"
+#include "Deferred.h"
+#include <stddef.h>
+
+#if TIMER_MAX > 255
+#error "TIMER_MAX must be no larger than 255"
+#endif
+
+//@{
+//!< Shape of the timer wheel
+#define TIMER_SLOT_BITS 5
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 4
+//@}
+
+//!< The longest delay the wheel can hold, longer delays are cut to this
+#define TIMER_MAX_DELAY ((1LU << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+//!< Struct for one timer of the pool
+typedef struct TTimerNode
+{
+  struct TTimerNode* next; /*!< The next timer in the same slot, or in the free list */
+  struct TTimerNode* prev; /*!< The previous timer in the same slot */
+  uint32_t expires; /*!< The tick the timer expires on */
+  uint32_t period; /*!< The period of a periodic timer, 0 for a one-shot timer */
+  Callback callback; /*!< The user function and its arguments pointer */
+  uint8_t level; /*!< The level of the slot the timer is in */
+  uint8_t slot; /*!< The slot the timer is in */
+  uint8_t generation; /*!< Bumped every time the timer is freed, so stale handles are refused */
+  bool active; /*!< TRUE while the timer is in the wheel */
+} TTimerNode;
+
+static TTimerNode Pool[TIMER_MAX]; /*!< The timers */
+static TTimerNode* FreeList; /*!< The timers that are not in use */
+static uint16_t NbActive; /*!< The number of timers in the wheel */
+
+static TTimerNode* Wheel[TIMER_LEVELS][TIMER_SLOTS]; /*!< The first timer of every slot */
+static uint32_t Occupied[TIMER_LEVELS]; /*!< A bit for every slot that holds a timer */
+
+static uint32_t Now; /*!< The next tick to run */
+static uint32_t CurrentTick; /*!< The last tick that has started */
+static uint16_t LastCount; /*!< The whole FTM count at the start of CurrentTick */
+static uint16_t TickFraction; /*!< How far past LastCount CurrentTick starts, in 1/TIMER_TICK_HZ of a count */
+static uint32_t ModuleClk; /*!< The clock rate of the FTM in Hz, the FTM counts in one tick times TIMER_TICK_HZ */
+
+static void TimerService(void* arguments);
+
+//!< The FTM channel the next expiry is programmed into
+static TFTMChannel Channel = { .channelNb = TIMER_FTM_CHANNEL, .timerFunction =
+    TIMER_FUNCTION_OUTPUT_COMPARE, .ioType.outputAction =
+    TIMER_OUTPUT_DISCONNECT, .userFunction = TimerService };
+
+/*! @brief Moves CurrentTick forward to the tick the FTM counter is in.
+ *
+ *  @return void
+ */
+static void UpdateCurrentTick(void)
+{
+  // Ticks are a whole number of counts only if the clock is a multiple of
+  // TIMER_TICK_HZ, so keep the fraction of a count each tick starts at
+  uint32_t elapsed = (uint16_t) (FTM_Count() - LastCount) * TIMER_TICK_HZ;
+  if (elapsed < TickFraction)
+    return;
+
+  uint32_t ticks = (elapsed - TickFraction) / ModuleClk;
+  uint32_t advance = ticks * ModuleClk + TickFraction;
+  CurrentTick += ticks;
+  LastCount += advance / TIMER_TICK_HZ;
+  TickFraction = advance % TIMER_TICK_HZ;
+}
+
+/*! @brief Adds a timer to the slot its expiry falls in.
+ *
+ *  @param node The timer, with its expiry set.
+ *  @return void
+ */
+static void Insert(TTimerNode* const node)
+{
+  uint32_t delta = node->expires - Now;
+
+  // A timer that is already due runs on the next tick
+  if ((int32_t) delta < 0)
+  {
+    node->expires = Now;
+    delta = 0;
+  }
+  else if (delta > TIMER_MAX_DELAY)
+  {
+    node->expires = Now + TIMER_MAX_DELAY;
+    delta = TIMER_MAX_DELAY;
+  }
+
+  // Find the lowest level that spans the delay
+  uint8_t level = 0;
+  while (delta >= (1LU << (TIMER_SLOT_BITS * (level + 1))))
+    level++;
+
+  uint8_t slot = (node->expires >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK;
+  node->level = level;
+  node->slot = slot;
+  node->prev = NULL;
+  node->next = Wheel[level][slot];
+  if (node->next)
+    node->next->prev = node;
+  Wheel[level][slot] = node;
+  Occupied[level] |= 1LU << slot;
+}
+
+/*! @brief Removes a timer from its slot.
+ *
+ *  @param node The timer.
+ *  @return void
+ */
+static void Unlink(TTimerNode* const node)
+{
+  if (node->prev)
+    node->prev->next = node->next;
+  else
+    Wheel[node->level][node->slot] = node->next;
+
+  if (node->next)
+    node->next->prev = node->prev;
+
+  if (Wheel[node->level][node->slot] == NULL)
+    Occupied[node->level] &= ~(1LU << node->slot);
+}
+
+/*! @brief Returns a timer to the free list.
+ *
+ *  @param node The timer, already removed from the wheel.
+ *  @return void
+ */
+static void Free(TTimerNode* const node)
+{
+  node->active = false;
+  node->generation++;
+  node->next = FreeList;
+  FreeList = node;
+  NbActive--;
+}
+
+/*! @brief Spreads the timers of one slot over the levels below it.
+ *
+ *  @param level The level of the slot.
+ *  @param slot The slot.
+ *  @return void
+ */
+static void Cascade(const uint8_t level, const uint8_t slot)
+{
+  TTimerNode* node = Wheel[level][slot];
+  Wheel[level][slot] = NULL;
+  Occupied[level] &= ~(1LU << slot);
+
+  while (node)
+  {
+    TTimerNode* next = node->next;
+    Insert(node);
+    node = next;
+  }
+}
+
+/*! @brief Runs one tick of the wheel.
+ *
+ *  @return void
+ */
+static void RunTick(void)
+{
+  uint8_t slot = Now & TIMER_SLOT_MASK;
+
+  // When level 0 wraps, bring the next slot of each level above down
+  if (slot == 0)
+  {
+    for (uint8_t level = 1; level < TIMER_LEVELS; level++)
+    {
+      uint8_t index = (Now >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK;
+      Cascade(level, index);
+      if (index != 0)
+        break;
+    }
+  }
+
+  // Expire every timer in the slot, the user functions may start and
+  // cancel timers but never add to this slot
+  while (Wheel[0][slot])
+  {
+    TTimerNode* node = Wheel[0][slot];
+    Unlink(node);
+    Callback callback = node->callback;
+
+    if (node->period)
+    {
+      node->expires += node->period;
+      Insert(node);
+    }
+    else
+      Free(node);
+
+    if (callback.callbackFunction)
+      callback.callbackFunction(callback.callbackArguments);
+  }
+}
+
+/*! @brief Programs the FTM channel for the next tick with something to do.
+ *
+ *  @return void
+ */
+static void Reprogram(void)
+{
+  if (NbActive == 0)
+  {
+    FTM_StopTimer(&Channel);
+    return;
+  }
+
+  // Rotate level 0 so the next slot to run is bit 0, the first timer is then
+  // the lowest set bit
+  uint8_t slot = Now & TIMER_SLOT_MASK;
+  uint32_t pending = Occupied[0];
+  pending = (pending >> slot) | (slot ? pending << (TIMER_SLOTS - slot) : 0);
+  uint32_t ticks = pending ? __builtin_ctz(pending) : TIMER_SLOTS;
+
+  // Timers on the levels above need the wheel to be woken when level 0 wraps
+  for (uint8_t level = 1; level < TIMER_LEVELS; level++)
+  {
+    if (Occupied[level])
+    {
+      uint32_t wrap = (TIMER_SLOTS - slot) & TIMER_SLOT_MASK;
+      if (wrap < ticks)
+        ticks = wrap;
+      break;
+    }
+  }
+
+  // Work out how far past the start of the current tick the expiry is,
+  // rounded up to the first whole count inside the tick
+  int32_t ahead = (int32_t) (Now + ticks - CurrentTick);
+  uint32_t target = (ahead * ModuleClk + TickFraction + TIMER_TICK_HZ - 1)
+      / TIMER_TICK_HZ;
+  uint16_t elapsed = FTM_Count() - LastCount;
+
+  // If that point has already passed, run the wheel again straight away
+  if (ahead <= 0 || elapsed >= target)
+  {
+    Deferred_Post(TimerService, NULL);
+    return;
+  }
+
+  Channel.delayCount = target - elapsed;
+  FTM_StartTimer(&Channel);
+}
+
+/*! @brief Runs every tick that has passed, deferred from the FTM channel interrupt.
+ *
+ *  @param arguments Unused.
+ *  @return void
+ */
+static void TimerService(void* arguments)
+{
+  UpdateCurrentTick();
+  while (NbActive && (int32_t) (CurrentTick - Now) >= 0)
+  {
+    RunTick();
+    Now++;
+  }
+
+  // An empty wheel has nothing left to catch up on
+  if (NbActive == 0)
+    Now = CurrentTick + 1;
+
+  Reprogram();
+}
+
+/*! @brief Takes a timer from the free list and adds it to the wheel.
+ *
+ *  @param delay The number of ticks until the timer expires.
+ *  @param period The period of a periodic timer, 0 for a one-shot timer.
+ *  @param userFunction The function called when the timer expires.
+ *  @param userArguments The argument to pass to the user function.
+ *  @return TTimerID - The handle of the timer, or TIMER_INVALID if every timer is in use.
+ */
+static TTimerID Start(const uint32_t delay, const uint32_t period,
+    void (*userFunction)(void*), void* userArguments)
+{
+  TTimerNode* node = FreeList;
+  if (node == NULL)
+    return TIMER_INVALID;
+  FreeList = node->next;
+
+  // The counter has not been followed while the wheel was empty, so pick it
+  // up again from here
+  if (NbActive == 0)
+  {
+    LastCount = FTM_Count();
+    TickFraction = 0;
+    CurrentTick = Now - 1;
+  }
+  UpdateCurrentTick();
+
+  node->expires = CurrentTick + (delay ? delay : 1);
+  node->period = period;
+  node->callback.callbackFunction = userFunction;
+  node->callback.callbackArguments = userArguments;
+  node->active = true;
+  NbActive++;
+  Insert(node);
+  Reprogram();
+
+  return (TTimerID) (node->generation << 8) | (node - Pool);
+}
+
+/*! @brief Sets up the timer wheel before first use.
+ *
+ *  @param moduleClk The clock rate of the FTM in Hz.
+ *  @return bool - TRUE if the timer module was successfully initialized.
+ *  @note Assumes the FTM has been initialized.
+ */
+bool Timer_Init(const uint32_t moduleClk)
+{
+  // The channel is never programmed more than a full level 0 ahead, which
+  // has to fit in the 16-bit counter
+  uint32_t tickCounts = moduleClk / TIMER_TICK_HZ;
+  if (tickCounts == 0 || tickCounts * (TIMER_SLOTS + 1) > 0xFFFF)
+    return false;
+  ModuleClk = moduleClk;
+  TickFraction = 0;
+
+  FreeList = NULL;
+  for (int i = TIMER_MAX - 1; i >= 0; i--)
+  {
+    Pool[i].active = false;
+    Pool[i].next = FreeList;
+    FreeList = &Pool[i];
+  }
+  NbActive = 0;
+
+  for (int level = 0; level < TIMER_LEVELS; level++)
+  {
+    Occupied[level] = 0;
+    for (int slot = 0; slot < TIMER_SLOTS; slot++)
+      Wheel[level][slot] = NULL;
+  }
+
+  Now = 1;
+  CurrentTick = 0;
+  return FTM_Set(&Channel);
+}
+
+/*! @brief Changes the clock rate the FTM is running from.
+ *
+ *  @param moduleClk The new clock rate of the FTM in Hz.
+ *  @return bool - TRUE if a tick can still be counted with the new clock.
+ *  @note Call with interrupts disabled, straight after the clock has changed.
+ */
+bool Timer_SetClock(const uint32_t moduleClk)
+{
+  uint32_t tickCounts = moduleClk / TIMER_TICK_HZ;
+  if (tickCounts == 0 || tickCounts * (TIMER_SLOTS + 1) > 0xFFFF)
+    return false;
+
+  // Finish the ticks counted at the old rate, then program the next expiry at the new one
+  UpdateCurrentTick();
+  ModuleClk = moduleClk;
+  Reprogram();
+  return true;
+}
+
+/*! @brief Starts a one-shot timer.
+ *
+ *  @param delay The number of ticks until the timer expires, at least 1.
+ *  @param userFunction The function called from the main loop when the timer expires.
+ *  @param userArguments The argument to pass to the user function.
+ *  @return TTimerID - The handle of the timer, or TIMER_INVALID if every timer is in use.
+ *  @note Assumes that Timer_Init has been called, call only from the main loop.
+ */
+TTimerID Timer_Start(const uint32_t delay, void (*userFunction)(void*),
+    void* userArguments)
+{
+  return Start(delay, 0, userFunction, userArguments);
+}
+
+/*! @brief Starts a periodic timer.
+ *
+ *  @param period The number of ticks between expiries, at least 1.
+ *  @param userFunction The function called from the main loop every time the timer expires.
+ *  @param userArguments The argument to pass to the user function.
+ *  @return TTimerID - The handle of the timer, or TIMER_INVALID if every timer is in use.
+ *  @note Assumes that Timer_Init has been called, call only from the main loop.
+ */
+TTimerID Timer_StartPeriodic(const uint32_t period,
+    void (*userFunction)(void*), void* userArguments)
+{
+  uint32_t ticks = period ? period : 1;
+  return Start(ticks, ticks, userFunction, userArguments);
+}
+
+/*! @brief Cancels a timer.
+ *
+ *  @param timer The handle of the timer.
+ *  @return bool - TRUE if the timer was running and has been cancelled.
+ *  @note Assumes that Timer_Init has been called, call only from the main loop.
+ */
+bool Timer_Cancel(const TTimerID timer)
+{
+  uint8_t index = timer & 0xFF;
+  if (timer == TIMER_INVALID || index >= TIMER_MAX)
+    return false;
+
+  TTimerNode* const node = &Pool[index];
+  if (!node->active || node->generation != (timer >> 8))
+    return false;
+
+  Unlink(node);
+  Free(node);
+  Reprogram();
+  return true;
+}
+
+/*!
+ ** @}
+ */
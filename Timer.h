@@ -0,0 +1,90 @@
+/*! @file Timer.h
+ *
+ *  @brief Routines for software timers multiplexed onto one FTM channel.
+ *
+ *  This contains the functions for starting and cancelling one-shot and periodic timers.
+ *  The timers are kept in a hierarchical timer wheel and only the next expiry is
+ *  programmed into the FTM channel.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Timer_module Timer module documentation
+ **  @{
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+// new types
+#include "types.h"
+
+//!< The FTM channel the timer wheel runs on
+#define TIMER_FTM_CHANNEL 7
+
+//!< The rate the timer wheel ticks at, so delays are in milliseconds
+#define TIMER_TICK_HZ 1000
+
+//!< Maximum number of timers that can be running at once (at most 255)
+#ifndef TIMER_MAX
+#define TIMER_MAX 128
+#endif
+
+//!< Type of the handle of a running timer
+typedef uint16_t TTimerID;
+
+//!< A handle that never refers to a timer
+#define TIMER_INVALID 0xFFFF
+
+/*! @brief Sets up the timer wheel before first use.
+ *
+ *  @param moduleClk The clock rate of the FTM in Hz.
+ *  @return bool - TRUE if the timer module was successfully initialized.
+ *  @note Assumes the FTM has been initialized.
+ */
+bool Timer_Init(const uint32_t moduleClk);
+
+/*! @brief Changes the clock rate the FTM is running from.
+ *
+ *  @param moduleClk The new clock rate of the FTM in Hz.
+ *  @return bool - TRUE if a tick can still be counted with the new clock.
+ *  @note Call with interrupts disabled, straight after the clock has changed.
+ */
+bool Timer_SetClock(const uint32_t moduleClk);
+
+/*! @brief Starts a one-shot timer.
+ *
+ *  @param delay The number of ticks until the timer expires, at least 1.
+ *  @param userFunction The function called from the main loop when the timer expires.
+ *  @param userArguments The argument to pass to the user function.
+ *  @return TTimerID - The handle of the timer, or TIMER_INVALID if every timer is in use.
+ *  @note Assumes that Timer_Init has been called, call only from the main loop.
+ */
+TTimerID Timer_Start(const uint32_t delay, void (*userFunction)(void*),
+    void* userArguments);
+
+/*! @brief Starts a periodic timer.
+ *
+ *  @param period The number of ticks between expiries, at least 1.
+ *  @param userFunction The function called from the main loop every time the timer expires.
+ *  @param userArguments The argument to pass to the user function.
+ *  @return TTimerID - The handle of the timer, or TIMER_INVALID if every timer is in use.
+ *  @note Assumes that Timer_Init has been called, call only from the main loop.
+ */
+TTimerID Timer_StartPeriodic(const uint32_t period,
+    void (*userFunction)(void*), void* userArguments);
+
+/*! @brief Cancels a timer.
+ *
+ *  @param timer The handle of the timer.
+ *  @return bool - TRUE if the timer was running and has been cancelled.
+ *  @note Assumes that Timer_Init has been called, call only from the main loop.
+ */
+bool Timer_Cancel(const TTimerID timer);
+
+#endif
+
+/*!
+ ** @}
+ */
@@ -13,142 +13,846 @@
  */
 #include "UART.h"
 #include "FIFO.h"
+#include "Event.h"
+#include "Stats.h"
+#include "PIT.h"
 #include "MK70F12.h"
 #include "Cpu.h"
+#include <stddef.h>
 
+//!< Struct for the clock gate, pins and interrupt of one UART module
+typedef struct
+{
+  UART_MemMapPtr uart; /*!< The registers of the module */
+  uint32_t clockMask; /*!< The clock gate bit of the module in SIM_SCGC4 */
+  uint32_t portMask; /*!< The clock gate bit of the port of the pins in SIM_SCGC5 */
+  volatile uint32_t* txPCR; /*!< The pin control register of the transmit pin */
+  volatile uint32_t* rxPCR; /*!< The pin control register of the receive pin */
+  volatile uint32_t* ctsPCR; /*!< The pin control register of the clear to send pin, NULL if it is not wired up */
+  volatile uint32_t* rtsPCR; /*!< The pin control register of the request to send pin, NULL if it is not wired up */
+  uint8_t irq; /*!< The status interrupt of the module */
+} TUARTHardware;
+
+//!< The hardware of every UART module, all of the pins use ALT3
+static const TUARTHardware Hardware[UART_NB_INSTANCES] =
+{
+  { UART0_BASE_PTR, SIM_SCGC4_UART0_MASK, SIM_SCGC5_PORTB_MASK, &PORTB_PCR17, &PORTB_PCR16, NULL, NULL, 45 },
+  { UART1_BASE_PTR, SIM_SCGC4_UART1_MASK, SIM_SCGC5_PORTE_MASK, &PORTE_PCR0, &PORTE_PCR1, NULL, NULL, 47 },
+  { UART2_BASE_PTR, SIM_SCGC4_UART2_MASK, SIM_SCGC5_PORTE_MASK, &PORTE_PCR16, &PORTE_PCR17, &PORTE_PCR18, &PORTE_PCR19, 49 }
+};
+
+//!< The link set up on each UART module, used by its interrupt service routine
+static TUART* Links[UART_NB_INSTANCES];
+
+/*! @brief Hands newly received data on to its consumer.
+ *
+ *  @param uart The serial link.
+ *  @return void
+ *  @note Only called from the receive interrupts.
+ */
+static void Received(const TUART * const uart)
+{
+  if (uart->rxCallback.callbackFunction)
+    uart->rxCallback.callbackFunction(uart->rxCallback.callbackArguments);
+  else
+    Event_Post(uart->rxEvent);
+}
+
+/*! @brief Gets the position in the TxFIFO where the oldest block that has not been sent ends.
+ *
+ *  @param uart The serial link.
+ *  @param mark A pointer to memory to store the TxFIFO count of bytes removed at the end of the block.
+ *  @return bool - TRUE if a block end is known.
+ */
+static inline bool NextMark(TUART * const uart, TUARTTxFIFOIndex * const mark)
+{
+  const TUARTTxFIFOIndex* const next = UARTTxMarks_Peek(&uart->txMarks);
+  if (next == NULL)
+    return false;
+
+  *mark = *next;
+  return true;
+}
+
+/*! @brief Checks whether the transmitter has just finished a block of the TxFIFO.
+ *
+ *  @param uart The serial link.
+ *  @return bool - TRUE if the TxFIFO is between two blocks.
+ *  @note Only called by the transmitter.
+ */
+static bool BlockEnded(TUART * const uart)
+{
+  TUARTTxFIFOIndex start = uart->TxFIFO.Start;
+  TUARTTxFIFOIndex mark;
+  bool ended = false;
+
+  // Drop every mark the transmitter has reached, a mark that is still ahead is
+  // less than half of the index range away
+  while (NextMark(uart, &mark)
+      && (TUARTTxFIFOIndex) (start - mark) <= (TUARTTxFIFOIndex) ~0u >> 1)
+  {
+    UARTTxMarks_Release(&uart->txMarks);
+    ended = true;
+  }
+
+  // A block whose mark did not fit ends when the TxFIFO runs dry
+  return ended || UARTTxFIFO_Count(&uart->TxFIFO) == 0;
+}
+
+/*! @brief Gets the next byte to send, from the priority transmit FIFO between blocks of the TxFIFO.
+ *
+ *  @param uart The serial link.
+ *  @param data A pointer to memory to store the byte.
+ *  @return bool - TRUE if there was a byte to send.
+ *  @note Only called by the transmitter.
+ */
+static bool NextTxByte(TUART * const uart, uint8_t * const data)
+{
+  if (!uart->txInBlock && UARTPriorityFIFO_Get(&uart->TxPriorityFIFO, data))
+    return true;
+
+  if (!UARTTxFIFO_Get(&uart->TxFIFO, data))
+    return false;
+
+  uart->txInBlock = !BlockEnded(uart);
+  return true;
+}
+
+/*! @brief Remembers where the block just written to the TxFIFO ends.
+ *
+ *  @param uart The serial link.
+ *  @return void
+ *  @note Only called by the producer of the TxFIFO.
+ */
+static void MarkBlock(TUART * const uart)
+{
+  // Without room for the mark the block goes out as one with the next
+  TUARTTxFIFOIndex* const mark = UARTTxMarks_Reserve(&uart->txMarks);
+  if (mark == NULL)
+    return;
+
+  // Store the mark before publishing it to the transmitter
+  *mark = uart->TxFIFO.End;
+  UARTTxMarks_Commit(&uart->txMarks);
+}
+
+#if UART_USE_DMA
 //@{
-//!< Global static variables for the Tx and Rx FIFOs
-static TFIFO RxFIFO; //!< FIFO for input data
-static TFIFO TxFIFO; //!< FIFO for output data
+//!< eDMA channel and request source assignments, the sources of UARTn are 2n + 2 and 2n + 3
+#define DMA_CHANNEL_RX 0
+#define DMA_CHANNEL_TX 1
+#define DMAMUX_SOURCE_UART_RX(instance) (2 + 2 * (instance))
+#define DMAMUX_SOURCE_UART_TX(instance) (3 + 2 * (instance))
 //@}
 
-/*! @brief Sets up the UART interface before first use.
+//!< Number of bytes in the circular DMA receive buffer
+#define DMA_RX_BUFFER_SIZE 64
+
+static TUART* DMALink; //!< The link served by the DMA channels
+static bool DMATxPriority; //!< TRUE if the span being sent by the transmit DMA channel is from the priority transmit FIFO
+static uint8_t DMARxBuffer[DMA_RX_BUFFER_SIZE]; //!< Circular buffer written by the receive DMA channel
+static uint16_t DMARxIndex; //!< The index of the next byte in DMARxBuffer to move into the RxFIFO
+static uint16_t volatile DMATxLength; //!< The number of TxFIFO bytes currently being sent by the transmit DMA channel
+
+/*! @brief Sets up the receive and transmit eDMA channels for a UART.
  *
- *  @param baudRate The desired baud rate in bits/sec.
- *  @param moduleClk The module clock rate in Hz
- *  @return bool - TRUE if the UART was successfully initialized.
+ *  @param uart The serial link to serve.
+ *  @param instance The UART module of the link.
+ *  @return void
  */
-bool UART_Init(const uint32_t baudRate, const uint32_t moduleClk)
+static void DMAInit(TUART * const uart, const TUARTInstance instance)
 {
-  // Initialize the RxFIFO for input packets
-  FIFO_Init(&RxFIFO);
+  // Enable clock gate control bits for the DMA multiplexer and the eDMA engine
+  SIM_SCGC6 |= SIM_SCGC6_DMAMUX0_MASK;
+  SIM_SCGC7 |= SIM_SCGC7_DMA_MASK;
 
-  // Initialize the TxFIFO for output packets
-  FIFO_Init(&TxFIFO);
+  DMALink = uart;
+  DMARxIndex = 0;
+  DMATxLength = 0;
 
-  // Enable clock gate control bit for UART2
-  SIM_SCGC4 |= SIM_SCGC4_UART2_MASK;
+  // Receive channel: move one byte from the data register into the circular buffer per request
+  DMA_TCD0_SADDR = (uint32_t) &UART_D_REG(uart->registers);
+  DMA_TCD0_SOFF = 0;
+  DMA_TCD0_SLAST = 0;
+  DMA_TCD0_ATTR = DMA_ATTR_SSIZE(0) | DMA_ATTR_DSIZE(0);
+  DMA_TCD0_NBYTES_MLNO = 1;
+  DMA_TCD0_DADDR = (uint32_t) DMARxBuffer;
+  DMA_TCD0_DOFF = 1;
 
-  // Enable clock gate control bit for PORTE
-  SIM_SCGC5 |= SIM_SCGC5_PORTE_MASK;
+  // Rewind the destination to the start of the buffer at the end of every
+  // major loop so the channel runs forever as a ring
+  DMA_TCD0_DLASTSGA = -DMA_RX_BUFFER_SIZE;
+  DMA_TCD0_CITER_ELINKNO = DMA_CITER_ELINKNO_CITER(DMA_RX_BUFFER_SIZE);
+  DMA_TCD0_BITER_ELINKNO = DMA_BITER_ELINKNO_BITER(DMA_RX_BUFFER_SIZE);
 
-  // Clear TE bit to disable UART transmitter
-  UART2_C2 &= ~UART_C2_TE_MASK;
+  // Interrupt when the buffer is half full and full
+  DMA_TCD0_CSR = DMA_CSR_INTHALF_MASK | DMA_CSR_INTMAJOR_MASK;
 
-  // Clear RE to disable UART receiver
-  UART2_C2 &= ~UART_C2_RE_MASK;
+  // Transmit channel: move one byte from the TxFIFO into the data register per request,
+  // the source address and count are set for every span that is sent
+  DMA_TCD1_SOFF = 1;
+  DMA_TCD1_SLAST = 0;
+  DMA_TCD1_ATTR = DMA_ATTR_SSIZE(0) | DMA_ATTR_DSIZE(0);
+  DMA_TCD1_NBYTES_MLNO = 1;
+  DMA_TCD1_DADDR = (uint32_t) &UART_D_REG(uart->registers);
+  DMA_TCD1_DOFF = 0;
+  DMA_TCD1_DLASTSGA = 0;
 
-  // Clear M bit so the tower is working with 8 data bits
-  UART2_C1 &= ~UART_C1_M_MASK;
+  // Interrupt and stop taking requests at the end of the span
+  DMA_TCD1_CSR = DMA_CSR_INTMAJOR_MASK | DMA_CSR_DREQ_MASK;
 
-  // Clear PE bit to disable (no) parity
-  UART2_C1 &= ~UART_C1_PE_MASK;
+  // Route the UART receive and transmit requests to their channels
+  DMAMUX0_CHCFG0 = DMAMUX_CHCFG_ENBL_MASK
+      | DMAMUX_CHCFG_SOURCE(DMAMUX_SOURCE_UART_RX(instance));
+  DMAMUX0_CHCFG1 = DMAMUX_CHCFG_ENBL_MASK
+      | DMAMUX_CHCFG_SOURCE(DMAMUX_SOURCE_UART_TX(instance));
+
+  // Clear any pending interrupts from DMA channels 0 and 1
+  NVICICPR0 |= (1 << DMA_CHANNEL_RX) | (1 << DMA_CHANNEL_TX);
+
+  // Turn on NVIC for DMA channels 0 and 1
+  NVICISER0 |= (1 << DMA_CHANNEL_RX) | (1 << DMA_CHANNEL_TX);
+
+  // Start accepting receive requests
+  DMA_SERQ = DMA_SERQ_SERQ(DMA_CHANNEL_RX);
+}
+
+/*! @brief Moves every byte the receive DMA channel has written since the last call into the RxFIFO.
+ *
+ *  @return void
+ *  @note Only called from the UART and receive DMA interrupts, which share a priority.
+ */
+static void DMARxDrain(void)
+{
+  TUARTRxFIFO* const rxFIFO = &DMALink->RxFIFO;
+
+  // CITER counts down from the buffer size, so the distance travelled is the write index
+  uint16_t end = DMA_RX_BUFFER_SIZE
+      - (DMA_TCD0_CITER_ELINKNO & DMA_CITER_ELINKNO_CITER_MASK);
+
+  // Copy the new data in at most two spans, the second one after the ring wraps
+  while (DMARxIndex != end)
+  {
+    uint16_t length = (end > DMARxIndex ? end : DMA_RX_BUFFER_SIZE)
+        - DMARxIndex;
+
+    // Whatever does not fit in the RxFIFO is dropped
+    uint16_t free = UARTRxFIFO_Free(rxFIFO);
+    UARTRxFIFO_PutBlock(rxFIFO, &DMARxBuffer[DMARxIndex],
+        length < free ? length : free);
+    if (length > free)
+      rxFIFO->Dropped += length - free;
+    DMARxIndex = (DMARxIndex + length) % DMA_RX_BUFFER_SIZE;
+
+    // Hand the new data on, which wakes the main loop
+    Received(DMALink);
+  }
+}
+
+/*! @brief Starts the transmit DMA channel on the next contiguous span of the transmit FIFOs.
+ *
+ *  Between blocks of the TxFIFO the span comes from the priority transmit FIFO,
+ *  and a span of the TxFIFO stops at the end of its block.
+ *  @return void
+ *  @note Must be called with interrupts disabled or from the transmit DMA interrupt.
+ */
+static void DMATxStart(void)
+{
+  // Only one span can be in flight at a time
+  if (DMATxLength != 0)
+    return;
+
+  const uint8_t* data;
+  uint16_t length = DMALink->txInBlock ? 0 :
+      UARTPriorityFIFO_Span(&DMALink->TxPriorityFIFO, &data);
+  DMATxPriority = (length != 0);
+
+  if (length == 0)
+  {
+    // Send up to the end of the buffer, the wrapped part goes with the next span
+    TUARTTxFIFO* const txFIFO = &DMALink->TxFIFO;
+    length = UARTTxFIFO_Span(txFIFO, &data);
+
+    // Stop at the end of the block so that priority data can go next
+    TUARTTxFIFOIndex mark;
+    if (NextMark(DMALink, &mark))
+    {
+      uint16_t toMark = (TUARTTxFIFOIndex) (mark - txFIFO->Start);
+      if (toMark > 0 && toMark < length)
+        length = toMark;
+    }
+  }
+  if (length == 0)
+    return;
+
+  DMATxLength = length;
+  DMA_TCD1_SADDR = (uint32_t) data;
+  DMA_TCD1_CITER_ELINKNO = DMA_CITER_ELINKNO_CITER(length);
+  DMA_TCD1_BITER_ELINKNO = DMA_BITER_ELINKNO_BITER(length);
+  DMA_SERQ = DMA_SERQ_SERQ(DMA_CHANNEL_TX);
+
+  // With TDMAS set the transmit interrupt enable raises DMA requests instead
+  UART_C2_REG(DMALink->registers) |= UART_C2_TIE_MASK;
+}
+#endif
+
+/*! @brief Works out the depth of a hardware FIFO from its PFIFO size field.
+ *
+ *  @param size The RXFIFOSIZE or TXFIFOSIZE field.
+ *  @return uint8_t - The number of entries in the FIFO.
+ */
+static uint8_t FIFODepth(const uint8_t size)
+{
+  // A size of 0 is a single data register, otherwise the FIFO holds 2^(size + 1) entries
+  return (size == 0) ? 1 : (2 << size);
+}
+
+/*! @brief Enables the hardware FIFOs of the UART if they hold more than one byte.
+ *
+ *  @param uart The serial link.
+ *  @return void
+ *  @note Must be called while the transmitter and receiver are disabled.
+ */
+static void HardwareFIFOInit(TUART * const uart)
+{
+  UART_MemMapPtr const registers = uart->registers;
+
+  uint8_t pfifo = UART_PFIFO_REG(registers);
+  uart->rxDepth = FIFODepth((pfifo & UART_PFIFO_RXFIFOSIZE_MASK) >> UART_PFIFO_RXFIFOSIZE_SHIFT);
+  uart->txDepth = FIFODepth((pfifo & UART_PFIFO_TXFIFOSIZE_MASK) >> UART_PFIFO_TXFIFOSIZE_SHIFT);
+
+  if (uart->rxDepth > 1)
+  {
+    // Interrupt once the watermark is reached, the rest of the FIFO covers the
+    // interrupt latency. The DMA channel takes a request for every byte instead.
+    UART_RWFIFO_REG(registers) = (uart->dma || UART_RX_WATERMARK >= uart->rxDepth) ?
+        1 : UART_RX_WATERMARK;
+    UART_PFIFO_REG(registers) |= UART_PFIFO_RXFE_MASK;
+  }
+
+  if (uart->txDepth > 1)
+  {
+    // Interrupt once the FIFO has drained down to the watermark
+    UART_TWFIFO_REG(registers) = (UART_TX_WATERMARK >= uart->txDepth) ?
+        0 : UART_TX_WATERMARK;
+    UART_PFIFO_REG(registers) |= UART_PFIFO_TXFE_MASK;
+  }
+
+  // Empty the FIFOs so they start with their pointers in step
+  UART_CFIFO_REG(registers) |= UART_CFIFO_RXFLUSH_MASK | UART_CFIFO_TXFLUSH_MASK;
+}
+
+/*! @brief Gets the number of bytes waiting in the receiver.
+ *
+ *  @param uart The serial link.
+ *  @param status The value of S1 read in this interrupt.
+ *  @return uint8_t - The number of bytes that can be read from the data register.
+ */
+static inline uint8_t RxCount(const TUART * const uart, const uint8_t status)
+{
+  if (uart->rxDepth > 1)
+    return UART_RCFIFO_REG(uart->registers);
+  return (status & UART_S1_RDRF_MASK) ? 1 : 0;
+}
+
+/*! @brief Clears the idle line flag once the receiver is empty.
+ *
+ *  @param uart The serial link.
+ *  @return void
+ *  @note Assumes S1 has just been read with IDLE set.
+ */
+static void ClearIdle(const TUART * const uart)
+{
+  UART_MemMapPtr const registers = uart->registers;
 
-  // Assign PTE16 pin to ALT3 functionality (UART2_TX)
-  PORTE_PCR16 |= PORT_PCR_MUX(3);
+  // IDLE is cleared by reading S1 then D, which underflows an empty hardware FIFO
+  (void) UART_D_REG(registers);
 
-  // Assign PTE17 pin to ALT3 functionality (UART2_RX)
-  PORTE_PCR17 |= PORT_PCR_MUX(3);
+  // An underflow leaves the FIFO pointers out of step until it is flushed
+  if (UART_SFIFO_REG(registers) & UART_SFIFO_RXUF_MASK)
+  {
+    UART_CFIFO_REG(registers) |= UART_CFIFO_RXFLUSH_MASK;
+    UART_SFIFO_REG(registers) = UART_SFIFO_RXUF_MASK;
+  }
+}
 
+/*! @brief Sets the baud rate divisor and fine adjustment of a UART module.
+ *
+ *  @param registers The registers of the UART module.
+ *  @param baudRate The desired baud rate in bits/sec.
+ *  @param moduleClk The module clock rate in Hz.
+ *  @return void
+ *  @note The transmitter and receiver must be idle.
+ */
+static void SetBaudRate(UART_MemMapPtr const registers, const uint32_t baudRate,
+    const uint32_t moduleClk)
+{
   // Calculate the baud rate divisor
   uint16union_t baudRateDivisor = { .l = moduleClk / (baudRate * 16) };
 
-  // Clear baud rate fine adjust (BFRA) bit
-  UART2_C4 &= ~UART_C4_BRFA_MASK; //TODO - REMOVE THIS!.. or not
-
   // Set last 5 bits of BDH to the bits to the last 5 bits
   // of the high byte of the baud rate divisor
-  UART2_BDH |= UART_BDH_SBR(baudRateDivisor.s.Hi);
+  UART_BDH_REG(registers) = (UART_BDH_REG(registers) & ~UART_BDH_SBR_MASK)
+      | UART_BDH_SBR(baudRateDivisor.s.Hi);
 
   // Set BDL to the low byte of the baud rate divisor
-  UART2_BDL = baudRateDivisor.s.Lo;
+  UART_BDL_REG(registers) = baudRateDivisor.s.Lo;
 
   // Calculate the baud rate fine adjustment
   uint16_t bfra = (moduleClk * 32 / (baudRate * 16)) - baudRateDivisor.l * 32;
 
-  // Enable the baud rate fine adjust
-  UART2_C4 |= UART_C4_BRFA(bfra);
+  // Replace the baud rate fine adjust (BRFA) field in one write
+  UART_C4_REG(registers) = (UART_C4_REG(registers) & ~UART_C4_BRFA_MASK)
+      | UART_C4_BRFA(bfra);
+}
+
+/*! @brief Sets up a UART interface before first use.
+ *
+ *  The hardware FIFOs of UART0 and UART1 are enabled with the UART_RX_WATERMARK and
+ *  UART_TX_WATERMARK watermarks, the idle line interrupt picks up the tail of a
+ *  burst that stops below the receive watermark.
+ *  @param uart The serial link to set up.
+ *  @param instance The UART module to use, which must not be used by another link.
+ *  @param baudRate The desired baud rate in bits/sec.
+ *  @param moduleClk The module clock rate in Hz, the system clock for UART0 and UART1 and the bus clock for the others.
+ *  @param rxEvent The event to post when data has arrived.
+ *  @param txEvent The event to post when the transmit FIFO has drained.
+ *  @return bool - TRUE if the UART was successfully initialized.
+ */
+bool UART_Init(TUART * const uart, const TUARTInstance instance,
+    const uint32_t baudRate, const uint32_t moduleClk, const uint32_t rxEvent,
+    const uint32_t txEvent)
+{
+  if (instance >= UART_NB_INSTANCES || Links[instance] != NULL)
+    return false;
+
+  const TUARTHardware* const hardware = &Hardware[instance];
+  UART_MemMapPtr const registers = hardware->uart;
+
+  uart->registers = registers;
+  uart->irq = hardware->irq;
+  uart->dma = UART_USE_DMA && (instance == UART_DMA_INSTANCE);
+  uart->rxEvent = rxEvent;
+  uart->rxCallback.callbackFunction = NULL;
+  uart->txEvent = txEvent;
+  uart->flow = UART_FLOW_DROP;
+  uart->flowTimeout = 0;
+
+  // Initialize the RxFIFO for input packets
+  UARTRxFIFO_Init(&uart->RxFIFO);
+
+  // Initialize the TxFIFO for output packets
+  UARTTxFIFO_Init(&uart->TxFIFO);
+  UARTPriorityFIFO_Init(&uart->TxPriorityFIFO);
+  UARTTxMarks_Init(&uart->txMarks);
+  uart->txInBlock = false;
+
+  // Enable clock gate control bit for the UART
+  SIM_SCGC4 |= hardware->clockMask;
+
+  // Enable clock gate control bit for the port of its pins
+  SIM_SCGC5 |= hardware->portMask;
+
+  // Clear TE bit to disable UART transmitter
+  UART_C2_REG(registers) &= ~UART_C2_TE_MASK;
+
+  // Clear RE to disable UART receiver
+  UART_C2_REG(registers) &= ~UART_C2_RE_MASK;
+
+  // Clear M bit so the tower is working with 8 data bits
+  UART_C1_REG(registers) &= ~UART_C1_M_MASK;
+
+  // Clear PE bit to disable (no) parity
+  UART_C1_REG(registers) &= ~UART_C1_PE_MASK;
+
+  // Assign the transmit pin to ALT3 functionality (UARTn_TX)
+  *hardware->txPCR |= PORT_PCR_MUX(3);
+
+  // Assign the receive pin to ALT3 functionality (UARTn_RX)
+  *hardware->rxPCR |= PORT_PCR_MUX(3);
+
+  // Set the baud rate from the module clock
+  uart->baudRate = baudRate;
+  SetBaudRate(registers, baudRate, moduleClk);
+
+  // Use the hardware FIFOs of the modules that have them
+  HardwareFIFOInit(uart);
+
+  // Start counting an idle line after the stop bit, so a long last character is not taken for idle time
+  UART_C1_REG(registers) |= UART_C1_ILT_MASK;
 
   // Disable the transmit interrupt
-  UART2_C2 &= ~UART_C2_TIE_MASK;
+  UART_C2_REG(registers) &= ~UART_C2_TIE_MASK;
 
   // Enable the receive interrupt
-  UART2_C2 |= UART_C2_RIE_MASK;
+  UART_C2_REG(registers) |= UART_C2_RIE_MASK;
+
+#if UART_USE_DMA
+  if (uart->dma)
+  {
+    DMAInit(uart, instance);
 
-  // Clear any pending interrupts from UART2 TX_RX
-  NVICICPR1 |= (1 << 17);
+    // Turn receive and transmit interrupt requests into DMA requests
+    UART_C5_REG(registers) |= UART_C5_RDMAS_MASK | UART_C5_TDMAS_MASK;
+
+    // Use the idle line interrupt to pick up the tail of a burst that does
+    // not reach the half-full mark of the receive buffer
+    UART_C2_REG(registers) |= UART_C2_ILIE_MASK;
+  }
+#endif
 
-  // Turn on NVIC for UART2
-  NVICISER1 |= (1 << 17);
+  // Use the idle line interrupt to pick up the tail of a burst that does
+  // not reach the receive watermark
+  if (uart->rxDepth > 1)
+    UART_C2_REG(registers) |= UART_C2_ILIE_MASK;
+
+  // The interrupt service routine can find the link from now on
+  Links[instance] = uart;
+
+  // Clear any pending interrupts from the UART status source
+  NVICICPR1 |= (1 << (uart->irq - 32));
+
+  // Turn on NVIC for the UART status source
+  NVICISER1 |= (1 << (uart->irq - 32));
 
   // Enable UART transmitter
-  UART2_C2 |= UART_C2_TE_MASK;
+  UART_C2_REG(registers) |= UART_C2_TE_MASK;
 
   // Enable UART reciever
-  UART2_C2 |= UART_C2_RE_MASK;
+  UART_C2_REG(registers) |= UART_C2_RE_MASK;
 
   return true;
 }
 
+/*! @brief Sets a function to consume received data from the receive interrupt.
+ *
+ *  The function becomes the consumer of the RxFIFO and is called whenever new data
+ *  has been put there, instead of rxEvent being posted.
+ *  @param uart The serial link.
+ *  @param userFunction is a pointer to the function, called from the receive interrupt.
+ *  @param userArguments is a pointer to the user arguments to use with the function.
+ *  @return void
+ *  @note Assumes that UART_Init has been called, call before interrupts are enabled.
+ */
+void UART_SetReceiveCallback(TUART * const uart, void (*userFunction)(void*),
+    void* userArguments)
+{
+  uart->rxCallback.callbackArguments = userArguments;
+  uart->rxCallback.callbackFunction = userFunction;
+}
+
+/*! @brief Selects what writing to a full transmit FIFO does.
+ *
+ *  A link starts with UART_FLOW_DROP. The waiting policies time the wait with the
+ *  PIT free running counter and rely on the transmit interrupt to make room, so
+ *  they do not wait while interrupts are disabled.
+ *  @param uart The serial link.
+ *  @param flow The policy.
+ *  @param timeout The longest a write waits for room, in microseconds.
+ *  @return bool - TRUE if the policy was selected, UART_FLOW_RTSCTS is only wired up on UART2.
+ *  @note Assumes that UART_Init and PIT_Init have been called.
+ */
+bool UART_SetFlowControl(TUART * const uart, const TUARTFlowControl flow,
+    const uint32_t timeout)
+{
+  const TUARTHardware* hardware = NULL;
+  for (int i = 0; i < UART_NB_INSTANCES; i++)
+  {
+    if (Links[i] == uart)
+      hardware = &Hardware[i];
+  }
+  if (!hardware)
+    return false;
+
+  UART_MemMapPtr const registers = uart->registers;
+
+  if (flow == UART_FLOW_RTSCTS)
+  {
+    if (!hardware->ctsPCR || !hardware->rtsPCR)
+      return false;
+
+    // Assign the handshake pins to ALT3 functionality (UARTn_CTS_b and UARTn_RTS_b)
+    *hardware->ctsPCR |= PORT_PCR_MUX(3);
+    *hardware->rtsPCR |= PORT_PCR_MUX(3);
+
+    // Only start a character while CTS is asserted, and deassert RTS while
+    // the receiver is full
+    UART_MODEM_REG(registers) |= UART_MODEM_TXCTSE_MASK | UART_MODEM_RXRTSE_MASK;
+  }
+  else
+    UART_MODEM_REG(registers) &= ~(UART_MODEM_TXCTSE_MASK | UART_MODEM_RXRTSE_MASK);
+
+  uart->flowTimeout = timeout;
+  uart->flow = flow;
+  return true;
+}
+
+/*! @brief Sets the baud rate divisors of every link again for new module clocks.
+ *
+ *  @param systemClk The new system clock rate in Hz, the clock of UART0 and UART1.
+ *  @param busClk The new bus clock rate in Hz, the clock of the other modules.
+ *  @return void
+ *  @note Assumes that UART_Idle is TRUE, a character on the wire would be garbled.
+ */
+void UART_SetClock(const uint32_t systemClk, const uint32_t busClk)
+{
+  for (int i = 0; i < UART_NB_INSTANCES; i++)
+  {
+    if (Links[i] != NULL)
+      SetBaudRate(Links[i]->registers, Links[i]->baudRate,
+          (i < UART_2) ? systemClk : busClk);
+  }
+}
+
+/*! @brief Checks whether every link has finished sending.
+ *
+ *  @return bool - TRUE if the transmit FIFOs are empty and the last stop bit has gone out.
+ */
+bool UART_Idle(void)
+{
+  for (int i = 0; i < UART_NB_INSTANCES; i++)
+  {
+    const TUART* const uart = Links[i];
+    if (uart != NULL
+        && (UARTTxFIFO_Count(&uart->TxFIFO) != 0
+            || UARTPriorityFIFO_Count(&uart->TxPriorityFIFO) != 0
+            || !(UART_S1_REG(uart->registers) & UART_S1_TC_MASK)))
+      return false;
+  }
+  return true;
+}
+
+/*! @brief Makes the start bit of a character received on any link wake the processor from stop.
+ *
+ *  @param enable TRUE before the processor stops, FALSE once it has woken up.
+ *  @return void
+ *  @note The character itself is lost, it arrives while the module clock is stopped.
+ */
+void UART_WakeOnReceive(const bool enable)
+{
+  for (int i = 0; i < UART_NB_INSTANCES; i++)
+  {
+    if (Links[i] == NULL)
+      continue;
+
+    UART_MemMapPtr const registers = Links[i]->registers;
+    if (enable)
+    {
+      // Only an edge from now on wakes the processor
+      UART_S2_REG(registers) = UART_S2_RXEDGIF_MASK;
+      UART_BDH_REG(registers) |= UART_BDH_RXEDGIE_MASK;
+    }
+    else
+      UART_BDH_REG(registers) &= ~UART_BDH_RXEDGIE_MASK;
+  }
+}
+
+/*! @brief Connects the transmitter of a link straight to its receiver, or back to the pins.
+ *
+ *  In loop mode the receive pin is ignored and every character sent is also received.
+ *  @param uart The serial link.
+ *  @param loop TRUE for loop mode, FALSE for normal operation.
+ *  @return void
+ *  @note Assumes that UART_Init has been called, a character on the wire is lost.
+ */
+void UART_SetLoopback(TUART * const uart, const bool loop)
+{
+  // RSRC is left clear, so the receiver is fed from the transmitter inside the module
+  if (loop)
+    UART_C1_REG(uart->registers) |= UART_C1_LOOPS_MASK;
+  else
+    UART_C1_REG(uart->registers) &= ~UART_C1_LOOPS_MASK;
+}
+
 /*! @brief Get a character from the receive FIFO if it is not empty.
  *
+ *  @param uart The serial link.
  *  @param dataPtr A pointer to memory to store the retrieved byte.
  *  @return bool - TRUE if the receive FIFO returned a character.
  *  @note Assumes that UART_Init has been called.
  */
-bool UART_InChar(uint8_t * const dataPtr)
+bool UART_InChar(TUART * const uart, uint8_t * const dataPtr)
+{
+  return UARTRxFIFO_Get(&uart->RxFIFO, dataPtr);
+}
+
+/*! @brief Get up to a block of bytes from the receive FIFO.
+ *
+ *  @param uart The serial link.
+ *  @param data A pointer to memory to store the retrieved bytes.
+ *  @param length The maximum number of bytes to retrieve.
+ *  @return uint16_t - The number of bytes retrieved from the receive FIFO.
+ *  @note Assumes that UART_Init has been called.
+ */
+uint16_t UART_Read(TUART * const uart, uint8_t * const data,
+    const uint16_t length)
 {
-  return FIFO_Get(&RxFIFO, dataPtr);
+  return UARTRxFIFO_GetBlock(&uart->RxFIFO, data, length);
+}
+
+/*! @brief Starts the transmitter on the data that has been placed in the transmit FIFO.
+ *
+ *  @param uart The serial link.
+ *  @return void
+ */
+static void StartTransmit(TUART * const uart)
+{
+#if UART_USE_DMA
+  if (uart->dma)
+  {
+    // Hand the new data to the transmit DMA channel if it is idle
+    EnterCritical();
+    DMATxStart();
+    ExitCritical();
+    return;
+  }
+#endif
+
+  // Enable the transmit interrupt
+  UART_C2_REG(uart->registers) |= UART_C2_TIE_MASK;
+}
+
+/*! @brief Reads whether interrupts are disabled on the core.
+ *
+ *  @return bool - TRUE if PRIMASK is set.
+ *  @note May be replaced by defining UART_INTERRUPTS_DISABLED, to run off the target.
+ */
+#ifndef UART_INTERRUPTS_DISABLED
+static inline bool InterruptsDisabled(void)
+{
+  uint32_t primask;
+  __asm volatile ("mrs %0, primask" : "=r" (primask));
+  return (primask & 1);
+}
+#define UART_INTERRUPTS_DISABLED() InterruptsDisabled()
+#endif
+
+/*! @brief Waits for the transmitter to make room in a transmit FIFO, if the flow control of the link allows it.
+ *
+ *  @param uart The serial link.
+ *  @param priority TRUE to wait for the priority transmit FIFO, FALSE for the TxFIFO.
+ *  @param length The number of bytes that need to fit.
+ *  @return void
+ */
+static void WaitForRoom(const TUART * const uart, const bool priority,
+    const uint16_t length)
+{
+  // A block that never fits is not worth waiting for
+  if (uart->flow == UART_FLOW_DROP
+      || length > (priority ? UART_TX_PRIORITY_FIFO_SIZE : UART_TX_FIFO_SIZE))
+    return;
+
+  // With interrupts disabled nothing would make room
+  if (UART_INTERRUPTS_DISABLED())
+    return;
+
+  uint64_t start = PIT_Now();
+  while ((priority ? UARTPriorityFIFO_Free(&uart->TxPriorityFIFO) :
+      UARTTxFIFO_Free(&uart->TxFIFO)) < length)
+  {
+    if (PIT_TicksToNs(PIT_Now() - start) >= uart->flowTimeout * 1000ULL)
+      return;
+  }
 }
 
 /*! @brief Put a byte in the transmit FIFO if it is not full.
  *
+ *  A full FIFO is handled according to the flow control of the link.
+ *  @param uart The serial link.
  *  @param data The byte to be placed in the transmit FIFO.
  *  @return bool - TRUE if the data was placed in the transmit FIFO.
  *  @note Assumes that UART_Init has been called.
  */
-bool UART_OutChar(const uint8_t data)
+bool UART_OutChar(TUART * const uart, const uint8_t data)
+{
+  if (UARTTxFIFO_Free(&uart->TxFIFO) < 1)
+    WaitForRoom(uart, false, 1);
+
+  bool status = UARTTxFIFO_Put(&uart->TxFIFO, data);
+  if (status == true)
+  {
+    MarkBlock(uart);
+    StartTransmit(uart);
+  }
+  return status;
+}
+
+/*! @brief Put a block of bytes in the transmit FIFO if there is room for all of them.
+ *
+ *  The block is sent in one piece, the priority transmit FIFO only gets in between blocks.
+ *  A full FIFO is handled according to the flow control of the link.
+ *  @param uart The serial link.
+ *  @param data A pointer to the bytes to be placed in the transmit FIFO.
+ *  @param length The number of bytes to be placed in the transmit FIFO.
+ *  @return bool - TRUE if all of the data was placed in the transmit FIFO.
+ *  @note Assumes that UART_Init has been called.
+ */
+bool UART_Write(TUART * const uart, const uint8_t * const data,
+    const uint16_t length)
 {
-  bool status = FIFO_Put(&TxFIFO, data);
+  if (UARTTxFIFO_Free(&uart->TxFIFO) < length)
+    WaitForRoom(uart, false, length);
+
+  bool status = UARTTxFIFO_PutBlock(&uart->TxFIFO, data, length);
+
+  // Start the transmitter once for the whole block
   if (status == true)
   {
-    // Enable the transmit interrupt
-    UART2_C2 |= UART_C2_TIE_MASK;
+    MarkBlock(uart);
+    StartTransmit(uart);
   }
   return status;
 }
 
+/*! @brief Put a block of bytes in the priority transmit FIFO if there is room for all of them.
+ *
+ *  The block goes out as soon as the block of the transmit FIFO on its way out has
+ *  been sent, ahead of everything else waiting there.
+ *  A full FIFO is handled according to the flow control of the link.
+ *  @param uart The serial link.
+ *  @param data A pointer to the bytes to be placed in the priority transmit FIFO.
+ *  @param length The number of bytes to be placed in the priority transmit FIFO.
+ *  @return bool - TRUE if all of the data was placed in the priority transmit FIFO.
+ *  @note Assumes that UART_Init has been called.
+ */
+bool UART_WritePriority(TUART * const uart, const uint8_t * const data,
+    const uint16_t length)
+{
+  if (UARTPriorityFIFO_Free(&uart->TxPriorityFIFO) < length)
+    WaitForRoom(uart, true, length);
+
+  // The blocks are put in whole, so the transmitter never sees part of one
+  bool status = UARTPriorityFIFO_PutBlock(&uart->TxPriorityFIFO, data, length);
+  if (status == true)
+    StartTransmit(uart);
+  return status;
+}
+
 /*! @brief Poll the UART status register to try and receive and/or transmit one character.
  *
+ *  @param uart The serial link.
  *  @return void
  *  @note Assumes that UART_Init has been called.
  */
-void UART_Poll(void)
+void UART_Poll(TUART * const uart)
 {
-  // Check the RDRF bit to see if the receive data register is full
-  bool readyToRead = UART2_S1 & UART_S1_RDRF_MASK;
+  UART_MemMapPtr const registers = uart->registers;
+  uint8_t status = UART_S1_REG(registers);
+
+  // Check for a received byte, with the hardware FIFO RDRF is only set at the watermark
+  bool readyToRead = RxCount(uart, status) > 0;
 
   // Check the TDRE bit to see if the transmit data register is empty
-  bool readyToTransmit = UART2_S1 & UART_S1_TDRE_MASK;
+  bool readyToTransmit = status & UART_S1_TDRE_MASK;
 
-  // If RDRF is set, read in the data and add it to the RxFIFO
+  // If a byte was received, read in the data and add it to the RxFIFO
   if (readyToRead)
   {
     // Read and store data from the data register into a local variable
-    uint8_t input = UART2_D;
+    uint8_t input = UART_D_REG(registers);
 
     // Put the data stored in our local variable into the RxFIFO
-    FIFO_Put(&RxFIFO, input);
+    UARTRxFIFO_Put(&uart->RxFIFO, input);
   }
 
   // If TDRE is set, get a byte from TxFIFO and output it to the data register
@@ -156,84 +860,181 @@ void UART_Poll(void)
   {
     uint8_t data;
 
-    // Check if there is a byte in TxFIFO that ready to be transmitted
+    // Check if there is a byte in the transmit FIFOs that ready to be transmitted
     // If there is, get that byte and store it in our local variable (data)
-    bool result = FIFO_Get(&TxFIFO, &data);
+    bool result = NextTxByte(uart, &data);
 
     // If there is data to be transmitted
     if (result == true)
     {
       // Set the UART data register to the output data
-      UART2_D = data;
+      UART_D_REG(registers) = data;
     }
   }
 }
 
-void __attribute__ ((interrupt)) UART_ISR0(void)
+/*! @brief Services the status interrupt of a serial link.
+ *
+ *  @param uart The serial link, or NULL if its UART has not been set up.
+ *  @return void
+ */
+static void Service(TUART * const uart)
 {
-  if ((UART2_S1 & UART_S1_TDRE_MASK) && (UART2_C2 & UART_C2_TIE_MASK)) // if the TDRE and TIE flag is set
-  {
-    if (!FIFO_Get(&TxFIFO, (uint8_t * const ) &UART2_D)) // Checks if it can get data from the FIFO
-      UART2_C2 &= ~UART_C2_TIE_MASK;               // disable interrupt requests
-  }
+  // A stray interrupt from a module without a link is ignored
+  if (uart == NULL)
+    return;
+
+  uint32_t start = Stats_Now();
+  UART_MemMapPtr const registers = uart->registers;
+
+  // Reading S1 is the first step of clearing RDRF, TDRE and IDLE
+  uint8_t status = UART_S1_REG(registers);
+
+  // An edge that woke the processor from stop only needs acknowledging, the
+  // other bits of S2 are left at their reset values by this driver
+  if (UART_S2_REG(registers) & UART_S2_RXEDGIF_MASK)
+    UART_S2_REG(registers) = UART_S2_RXEDGIF_MASK;
 
-  if ((UART2_S1 & UART_S1_RDRF_MASK) && (UART2_C2 & UART_C2_RIE_MASK)) // if the RDRF and RIE flag is set
+#if UART_USE_DMA
+  // The DMA channels own RDRF and TDRE, so the only interrupt left is the idle line
+  if (uart->dma)
   {
-    FIFO_Put(&RxFIFO, UART2_D);                         // Puts data on the FIFO
+    if (status & UART_S1_IDLE_MASK)
+    {
+      // Acknowledge interrupt, unless the channel has yet to take the last bytes
+      // in which case the interrupt comes back once it has
+      if (RxCount(uart, status) == 0)
+        ClearIdle(uart);
+
+      // Flush the partial burst into the RxFIFO
+      DMARxDrain();
+    }
+
+    Stats_Record(&Stats_ISRs[STATS_ISR_UART], start);
+    return;
   }
-}
+#endif
 
-void __attribute__ ((interrupt)) UART_ISR(void)
-{
   // If the receive interrupt is enabled
-  if (UART2_C2 & UART_C2_RIE_MASK)
+  if (UART_C2_REG(registers) & UART_C2_RIE_MASK)
   {
-    // If RDRF flag is set, read a character
-    if (UART2_S1 & UART_S1_RDRF_MASK)
+    // The idle line only interrupts when the hardware FIFO is in use
+    uint8_t flags = UART_S1_RDRF_MASK;
+    if (UART_C2_REG(registers) & UART_C2_ILIE_MASK)
+      flags |= UART_S1_IDLE_MASK;
+
+    // On the watermark or at the end of a burst, empty the receiver
+    if (status & flags)
     {
-      // Acknowledge interrupt, clear interrupt flag bit
-      UART2_S1 &= ~UART_S1_RDRF_MASK;
+      uint8_t count = RxCount(uart, status);
 
-      // Read and store data from the data register into a local variable
-      uint8_t input = UART2_D;
+      // Reading the data register clears RDRF and IDLE
+      if (count == 0)
+        ClearIdle(uart);
+      else
+      {
+        for (; count > 0; count--)
+          UARTRxFIFO_Put(&uart->RxFIFO, UART_D_REG(registers));
 
-      // Put the data stored in our local variable into the RxFIFO
-      FIFO_Put(&RxFIFO, input);
-      //return;
+        // Hand the new data on, which wakes the main loop
+        Received(uart);
+      }
     }
   }
 
   // If the transmit interrupt is enabled
-  if (UART2_C2 & UART_C2_TIE_MASK)
+  if (UART_C2_REG(registers) & UART_C2_TIE_MASK)
   {
-    // If TDRE flag is set, transmit a character
-    if (UART2_S1 & UART_S1_TDRE_MASK)
+    // If TDRE flag is set, the transmitter has drained to the watermark
+    if (status & UART_S1_TDRE_MASK)
     {
-      // Acknowledge interrupt, clear interrupt flag bit
-      UART2_S1 &= ~UART_S1_TDRE_MASK;
-
+      // Top the transmitter up, writing the data register clears TDRE
+      uint8_t space = (uart->txDepth > 1) ?
+          uart->txDepth - UART_TCFIFO_REG(registers) : 1;
       uint8_t data;
 
-      // Check if there is a byte in TxFIFO that ready to be transmitted
-      // If there is, get that byte and store it in our local variable (data)
-      bool result = FIFO_Get(&TxFIFO, &data);
-
-      // If there is data to be transmitted
-      if (result == true)
+      while (space > 0 && NextTxByte(uart, &data))
       {
-        // Set the UART data register to the output data
-        UART2_D = data;
+        UART_D_REG(registers) = data;
+        space--;
       }
-      // FIFO empty
-      else
+
+      // Both transmit FIFOs empty
+      if (space > 0)
       {
         // Disable the transmit interrupt
-        UART2_C2 &= ~UART_C2_TIE_MASK;
+        UART_C2_REG(registers) &= ~UART_C2_TIE_MASK;
+
+        // Let the main loop know there is room to send more
+        Event_Post(uart->txEvent);
       }
-      //return;
     }
   }
+
+  Stats_Record(&Stats_ISRs[STATS_ISR_UART], start);
+}
+
+void __attribute__ ((interrupt)) UART0_ISR(void)
+{
+  Service(Links[UART_0]);
+}
+
+void __attribute__ ((interrupt)) UART1_ISR(void)
+{
+  Service(Links[UART_1]);
+}
+
+void __attribute__ ((interrupt)) UART2_ISR(void)
+{
+  Service(Links[UART_2]);
+}
+
+#if UART_USE_DMA
+void __attribute__ ((interrupt)) UART_DMARx_ISR(void)
+{
+  uint32_t start = Stats_Now();
+
+  // Acknowledge interrupt, clear the channel interrupt request
+  DMA_CINT = DMA_CINT_CINT(DMA_CHANNEL_RX);
+
+  // Move the half of the ring that has just been filled into the RxFIFO
+  DMARxDrain();
+
+  Stats_Record(&Stats_ISRs[STATS_ISR_UART], start);
+}
+
+void __attribute__ ((interrupt)) UART_DMATx_ISR(void)
+{
+  uint32_t start = Stats_Now();
+
+  // Acknowledge interrupt, clear the channel interrupt request
+  DMA_CINT = DMA_CINT_CINT(DMA_CHANNEL_TX);
+
+  // Release the span that has just been sent, the DMA channel is the only consumer
+  if (DMATxPriority)
+    UARTPriorityFIFO_Skip(&DMALink->TxPriorityFIFO, DMATxLength);
+  else
+  {
+    UARTTxFIFO_Skip(&DMALink->TxFIFO, DMATxLength);
+    DMALink->txInBlock = !BlockEnded(DMALink);
+  }
+  DMATxLength = 0;
+
+  // Stop transmit requests if there is nothing left to send
+  if (UARTTxFIFO_Count(&DMALink->TxFIFO) == 0
+      && UARTPriorityFIFO_Count(&DMALink->TxPriorityFIFO) == 0)
+  {
+    UART_C2_REG(DMALink->registers) &= ~UART_C2_TIE_MASK;
+
+    // Let the main loop know there is room to send more
+    Event_Post(DMALink->txEvent);
+  }
+  else
+    DMATxStart();
+
+  Stats_Record(&Stats_ISRs[STATS_ISR_UART], start);
 }
+#endif
 
 /*!
  ** @}
@@ -16,46 +16,269 @@
 
 // new types
 #include "types.h"
+#include "FIFO.h"
+#include "MK70F12.h"
 
-/*! @brief Sets up the UART interface before first use.
+//!< Enum for the UART modules the tower can use
+typedef enum
+{
+  UART_0, /*!< UART0 on PTB16 (RX) and PTB17 (TX), with an 8 byte hardware FIFO */
+  UART_1, /*!< UART1 on PTE1 (RX) and PTE0 (TX), with an 8 byte hardware FIFO */
+  UART_2, /*!< UART2 on PTE17 (RX) and PTE16 (TX), the serial port of the tower */
+  UART_NB_INSTANCES
+} TUARTInstance;
+
+//@{
+//!< Hardware FIFO watermarks: interrupt once this many bytes have been received, or once only this many are left to send
+#ifndef UART_RX_WATERMARK
+#define UART_RX_WATERMARK 6
+#endif
+#ifndef UART_TX_WATERMARK
+#define UART_TX_WATERMARK 2
+#endif
+//@}
+
+#if UART_RX_WATERMARK < 1
+#error "UART_RX_WATERMARK must be at least 1"
+#endif
+
+//!< Set to 1 to service the reception and transmission of one UART through the eDMA engine
+#ifndef UART_USE_DMA
+#define UART_USE_DMA 0
+#endif
+
+//!< The UART module served by the eDMA engine when UART_USE_DMA is set
+#ifndef UART_DMA_INSTANCE
+#define UART_DMA_INSTANCE UART_2
+#endif
+
+//@{
+//!< The capacities of the software FIFOs of a link as powers of two, the RxFIFO only has to cover the time until the receive interrupt frames the data
+#ifndef UART_RX_FIFO_BITS
+#define UART_RX_FIFO_BITS 7
+#endif
+#ifndef UART_TX_FIFO_BITS
+#define UART_TX_FIFO_BITS 9
+#endif
+#ifndef UART_TX_PRIORITY_FIFO_BITS
+#define UART_TX_PRIORITY_FIFO_BITS 7
+#endif
+//@}
+
+//@{
+//!< The number of bytes each software FIFO of a link holds
+#define UART_RX_FIFO_SIZE (1u << UART_RX_FIFO_BITS)
+#define UART_TX_FIFO_SIZE (1u << UART_TX_FIFO_BITS)
+#define UART_TX_PRIORITY_FIFO_SIZE (1u << UART_TX_PRIORITY_FIFO_BITS)
+//@}
+
+//!< Number of TxFIFO blocks whose ends are remembered as a power of two, further blocks are sent as one with the next
+#define UART_TX_MARKS_BITS 4
+
+FIFO_DECLARE(TUARTRxFIFO, UARTRxFIFO, uint8_t, UART_RX_FIFO_BITS)
+FIFO_DECLARE(TUARTTxFIFO, UARTTxFIFO, uint8_t, UART_TX_FIFO_BITS)
+FIFO_DECLARE(TUARTPriorityFIFO, UARTPriorityFIFO, uint8_t, UART_TX_PRIORITY_FIFO_BITS)
+FIFO_DECLARE(TUARTTxMarks, UARTTxMarks, TUARTTxFIFOIndex, UART_TX_MARKS_BITS)
+
+//!< Enum for what writing to a full transmit FIFO does
+typedef enum
+{
+  UART_FLOW_DROP, /*!< The data is dropped straight away */
+  UART_FLOW_BLOCK, /*!< The write waits up to the timeout for the transmitter to make room */
+  UART_FLOW_RTSCTS /*!< As UART_FLOW_BLOCK, and the transmitter is also held off by CTS and holds off the PC with RTS */
+} TUARTFlowControl;
+
+//!< Struct for one serial link, the UART module with its FIFOs
+typedef struct
+{
+  UART_MemMapPtr registers; /*!< The registers of the UART module */
+  TUARTRxFIFO RxFIFO; /*!< FIFO for input data */
+  TUARTTxFIFO TxFIFO; /*!< FIFO for bulk output data */
+  TUARTPriorityFIFO TxPriorityFIFO; /*!< FIFO for output data that goes out ahead of the TxFIFO, between two of its blocks */
+  TUARTTxMarks txMarks; /*!< The TxFIFO End after each block written there that has not been sent yet, removed by the transmitter */
+  bool txInBlock; /*!< TRUE while a TxFIFO block is part way out, so the TxPriorityFIFO has to wait */
+  uint8_t irq; /*!< The status interrupt of the UART module */
+  uint8_t rxDepth; /*!< The depth of the receive hardware FIFO, 1 if it is not enabled */
+  uint8_t txDepth; /*!< The depth of the transmit hardware FIFO, 1 if it is not enabled */
+  bool dma; /*!< TRUE if the link is served by the eDMA engine */
+  uint32_t rxEvent; /*!< The event posted when data has arrived in the RxFIFO */
+  Callback rxCallback; /*!< Called from the receive interrupt instead of posting rxEvent, if set */
+  uint32_t txEvent; /*!< The event posted when the TxFIFO has drained */
+  TUARTFlowControl flow; /*!< What writing to a full TxFIFO does */
+  uint32_t flowTimeout; /*!< The longest a write waits for room in the TxFIFO, in microseconds */
+  uint32_t baudRate; /*!< The baud rate in bits/sec, kept to set the divisors again when the module clock changes */
+} TUART;
+
+/*! @brief Sets up a UART interface before first use.
  *
+ *  The hardware FIFOs of UART0 and UART1 are enabled with the UART_RX_WATERMARK and
+ *  UART_TX_WATERMARK watermarks, the idle line interrupt picks up the tail of a
+ *  burst that stops below the receive watermark.
+ *  @param uart The serial link to set up.
+ *  @param instance The UART module to use, which must not be used by another link.
  *  @param baudRate The desired baud rate in bits/sec.
- *  @param moduleClk The module clock rate in Hz
+ *  @param moduleClk The module clock rate in Hz, the system clock for UART0 and UART1 and the bus clock for the others.
+ *  @param rxEvent The event to post when data has arrived.
+ *  @param txEvent The event to post when the transmit FIFO has drained.
  *  @return bool - TRUE if the UART was successfully initialized.
  */
-bool UART_Init(const uint32_t baudRate, const uint32_t moduleClk);
+bool UART_Init(TUART * const uart, const TUARTInstance instance,
+    const uint32_t baudRate, const uint32_t moduleClk, const uint32_t rxEvent,
+    const uint32_t txEvent);
+
+/*! @brief Sets a function to consume received data from the receive interrupt.
+ *
+ *  The function becomes the consumer of the RxFIFO and is called whenever new data
+ *  has been put there, instead of rxEvent being posted.
+ *  @param uart The serial link.
+ *  @param userFunction is a pointer to the function, called from the receive interrupt.
+ *  @param userArguments is a pointer to the user arguments to use with the function.
+ *  @return void
+ *  @note Assumes that UART_Init has been called, call before interrupts are enabled.
+ */
+void UART_SetReceiveCallback(TUART * const uart, void (*userFunction)(void*),
+    void* userArguments);
+
+/*! @brief Selects what writing to a full transmit FIFO does.
+ *
+ *  A link starts with UART_FLOW_DROP. The waiting policies time the wait with the
+ *  PIT free running counter and rely on the transmit interrupt to make room, so
+ *  they do not wait while interrupts are disabled.
+ *  @param uart The serial link.
+ *  @param flow The policy.
+ *  @param timeout The longest a write waits for room, in microseconds.
+ *  @return bool - TRUE if the policy was selected, UART_FLOW_RTSCTS is only wired up on UART2.
+ *  @note Assumes that UART_Init and PIT_Init have been called.
+ */
+bool UART_SetFlowControl(TUART * const uart, const TUARTFlowControl flow,
+    const uint32_t timeout);
+
+/*! @brief Sets the baud rate divisors of every link again for new module clocks.
+ *
+ *  @param systemClk The new system clock rate in Hz, the clock of UART0 and UART1.
+ *  @param busClk The new bus clock rate in Hz, the clock of the other modules.
+ *  @return void
+ *  @note Assumes that UART_Idle is TRUE, a character on the wire would be garbled.
+ */
+void UART_SetClock(const uint32_t systemClk, const uint32_t busClk);
+
+/*! @brief Checks whether every link has finished sending.
+ *
+ *  @return bool - TRUE if the transmit FIFOs are empty and the last stop bit has gone out.
+ */
+bool UART_Idle(void);
+
+/*! @brief Makes the start bit of a character received on any link wake the processor from stop.
+ *
+ *  @param enable TRUE before the processor stops, FALSE once it has woken up.
+ *  @return void
+ *  @note The character itself is lost, it arrives while the module clock is stopped.
+ */
+void UART_WakeOnReceive(const bool enable);
+
+/*! @brief Connects the transmitter of a link straight to its receiver, or back to the pins.
+ *
+ *  In loop mode the receive pin is ignored and every character sent is also received.
+ *  @param uart The serial link.
+ *  @param loop TRUE for loop mode, FALSE for normal operation.
+ *  @return void
+ *  @note Assumes that UART_Init has been called, a character on the wire is lost.
+ */
+void UART_SetLoopback(TUART * const uart, const bool loop);
 
 /*! @brief Get a character from the receive FIFO if it is not empty.
  *
+ *  @param uart The serial link.
  *  @param dataPtr A pointer to memory to store the retrieved byte.
  *  @return bool - TRUE if the receive FIFO returned a character.
  *  @note Assumes that UART_Init has been called.
  */
-bool UART_InChar(uint8_t * const dataPtr);
+bool UART_InChar(TUART * const uart, uint8_t * const dataPtr);
+
+/*! @brief Get up to a block of bytes from the receive FIFO.
+ *
+ *  @param uart The serial link.
+ *  @param data A pointer to memory to store the retrieved bytes.
+ *  @param length The maximum number of bytes to retrieve.
+ *  @return uint16_t - The number of bytes retrieved from the receive FIFO.
+ *  @note Assumes that UART_Init has been called.
+ */
+uint16_t UART_Read(TUART * const uart, uint8_t * const data,
+    const uint16_t length);
 
 /*! @brief Put a byte in the transmit FIFO if it is not full.
  *
+ *  A full FIFO is handled according to the flow control of the link.
+ *  @param uart The serial link.
  *  @param data The byte to be placed in the transmit FIFO.
  *  @return bool - TRUE if the data was placed in the transmit FIFO.
  *  @note Assumes that UART_Init has been called.
  */
-bool UART_OutChar(const uint8_t data);
+bool UART_OutChar(TUART * const uart, const uint8_t data);
+
+/*! @brief Put a block of bytes in the transmit FIFO if there is room for all of them.
+ *
+ *  The block is sent in one piece, the priority transmit FIFO only gets in between blocks.
+ *  A full FIFO is handled according to the flow control of the link.
+ *  @param uart The serial link.
+ *  @param data A pointer to the bytes to be placed in the transmit FIFO.
+ *  @param length The number of bytes to be placed in the transmit FIFO.
+ *  @return bool - TRUE if all of the data was placed in the transmit FIFO.
+ *  @note Assumes that UART_Init has been called.
+ */
+bool UART_Write(TUART * const uart, const uint8_t * const data,
+    const uint16_t length);
+
+/*! @brief Put a block of bytes in the priority transmit FIFO if there is room for all of them.
+ *
+ *  The block goes out as soon as the block of the transmit FIFO on its way out has
+ *  been sent, ahead of everything else waiting there.
+ *  A full FIFO is handled according to the flow control of the link.
+ *  @param uart The serial link.
+ *  @param data A pointer to the bytes to be placed in the priority transmit FIFO.
+ *  @param length The number of bytes to be placed in the priority transmit FIFO.
+ *  @return bool - TRUE if all of the data was placed in the priority transmit FIFO.
+ *  @note Assumes that UART_Init has been called.
+ */
+bool UART_WritePriority(TUART * const uart, const uint8_t * const data,
+    const uint16_t length);
 
 /*! @brief Poll the UART status register to try and receive and/or transmit one character.
  *
+ *  @param uart The serial link.
  *  @return void
  *  @note Assumes that UART_Init has been called.
  */
-void UART_Poll(void);
+void UART_Poll(TUART * const uart);
 
 /*!
  ** @}
  */
 
-/*! @brief Interrupt service routine for the UART.
+//@{
+/*! @brief Interrupt service routines for the status interrupt of each UART module.
  *
- *  @note Assumes the transmit and receive FIFOs have been initialized.
+ *  @note Assumes that UART_Init has been called for the module.
  */
-void __attribute__ ((interrupt)) UART_ISR(void);
+void __attribute__ ((interrupt)) UART0_ISR(void);
+void __attribute__ ((interrupt)) UART1_ISR(void);
+void __attribute__ ((interrupt)) UART2_ISR(void);
+//@}
+
+#if UART_USE_DMA
+/*! @brief Interrupt service routine for the UART receive DMA channel.
+ *
+ *  Triggered when the circular receive buffer is half and completely full.
+ *  @note Assumes that UART_Init has been called.
+ */
+void __attribute__ ((interrupt)) UART_DMARx_ISR(void);
+
+/*! @brief Interrupt service routine for the UART transmit DMA channel.
+ *
+ *  Triggered when a span of the transmit FIFO has been sent.
+ *  @note Assumes that UART_Init has been called.
+ */
+void __attribute__ ((interrupt)) UART_DMATx_ISR(void);
+#endif
 
 #endif
@@ -0,0 +1,106 @@
+/*! @file BenchFIFO.c
+ *
+ *  @brief Benchmark of the FIFO routines on the host.
+ *
+ *  This pushes bytes through a receive FIFO one at a time and in blocks, the way
+ *  the UART interrupt and the packet decoder do, and reports the bytes/sec.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Bench_module Bench module documentation
+ **  @{
+ */
+#include "UART.h"
+#include "PIT.h"
+#include <stdio.h>
+
+//!< The number of bytes pushed through the FIFO in each run
+#define BENCH_BYTES (64u * 1024u * 1024u)
+
+//!< The size of the blocks moved by PutBlock and GetBlock
+#define BENCH_BLOCK 32
+
+static TUARTRxFIFO FIFO; //!< The FIFO under test
+
+/*! @brief Reports the rate of one run.
+ *
+ *  @param name The name of the run.
+ *  @param bytes The number of bytes moved.
+ *  @param start The PIT_Now reading taken when the run started.
+ *  @param sum The sum of the bytes taken out, so that the work can not be optimised away.
+ *  @return void
+ */
+static void Report(const char * const name, const uint64_t bytes,
+    const uint64_t start, const uint32_t sum)
+{
+  double seconds = PIT_TicksToNs(PIT_Now() - start) / 1e9;
+
+  printf("  %-28s %8.1f Mbytes/sec (sum %08x)\n", name, bytes / seconds / 1e6,
+      (unsigned) sum);
+}
+
+/*! @brief Moves bytes one at a time, filling the FIFO half way and emptying it again.
+ *
+ *  @return void
+ */
+static void RunBytes(void)
+{
+  uint64_t start = PIT_Now();
+  uint32_t sum = 0;
+  uint8_t data = 0;
+
+  UARTRxFIFO_Init(&FIFO);
+  for (uint32_t moved = 0; moved < BENCH_BYTES; moved += UART_RX_FIFO_SIZE / 2)
+  {
+    for (int i = 0; i < UART_RX_FIFO_SIZE / 2; i++)
+      (void) UARTRxFIFO_Put(&FIFO, data++);
+
+    uint8_t byte;
+    while (UARTRxFIFO_Get(&FIFO, &byte))
+      sum += byte;
+  }
+
+  Report("Put/Get", BENCH_BYTES, start, sum);
+}
+
+/*! @brief Moves bytes in blocks, keeping the FIFO half full so the blocks wrap around its end.
+ *
+ *  @return void
+ */
+static void RunBlocks(void)
+{
+  uint8_t in[BENCH_BLOCK], out[BENCH_BLOCK];
+  uint32_t sum = 0;
+
+  for (int i = 0; i < BENCH_BLOCK; i++)
+    in[i] = i;
+
+  UARTRxFIFO_Init(&FIFO);
+  for (int i = 0; i < UART_RX_FIFO_SIZE / 2; i += BENCH_BLOCK)
+    (void) UARTRxFIFO_PutBlock(&FIFO, in, BENCH_BLOCK);
+
+  uint64_t start = PIT_Now();
+  for (uint32_t moved = 0; moved < BENCH_BYTES; moved += BENCH_BLOCK)
+  {
+    (void) UARTRxFIFO_PutBlock(&FIFO, in, BENCH_BLOCK);
+    uint16_t count = UARTRxFIFO_GetBlock(&FIFO, out, BENCH_BLOCK);
+    sum += out[count - 1] + count;
+    in[0]++;
+  }
+
+  Report("PutBlock/GetBlock (32 bytes)", BENCH_BYTES, start, sum);
+}
+
+int main(void)
+{
+  printf("FIFO throughput, %u byte FIFO:\n", UART_RX_FIFO_SIZE);
+  RunBytes();
+  RunBlocks();
+  return 0;
+}
+
+/*!
+ ** @}
+ */
@@ -0,0 +1,112 @@
+/*! @file BenchFlash.c
+ *
+ *  @brief Benchmark of the Flash writes on the host.
+ *
+ *  This runs Flash_Write16 on the mock FTFE for the usual patterns of use, and
+ *  reports the sector erases and phrase programs each write costs. Every value
+ *  is read back from the simulated Flash after it is written.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Bench_module Bench module documentation
+ **  @{
+ */
+#include "MK70F12.h"
+#include "Flash.h"
+#include <stdio.h>
+#include <string.h>
+
+//!< The number of half-words the data region holds
+#define BENCH_VARS (FLASH_SIZE / 2)
+
+//!< The number of writes of a changed value in each run
+#define BENCH_CHANGES 100
+
+static volatile uint16_t* Vars[BENCH_VARS]; //!< The variables allocated in the Flash, in address order
+static uint32_t Failures; //!< The number of writes that failed or did not read back
+
+/*! @brief Erases the simulated Flash and sets the Flash module up on it.
+ *
+ *  @param nbVars The number of half-words to allocate.
+ *  @return void
+ */
+static void Start(const int nbVars)
+{
+  memset(MockFlash, 0xFF, MOCK_FLASH_SIZE);
+  (void) Flash_Init();
+
+  for (int i = 0; i < nbVars; i++)
+    (void) Flash_AllocateVar((volatile void**) &Vars[i], sizeof(uint16_t));
+}
+
+/*! @brief Writes a variable and checks the value that ends up in the Flash.
+ *
+ *  @param var The index of the variable.
+ *  @param value The value to write.
+ *  @return void
+ */
+static void Write(const int var, const uint16_t value)
+{
+  if (!Flash_Write16(Vars[var], value)
+      || _FH((uint32_t) (uintptr_t) Vars[var]) != value)
+    Failures++;
+}
+
+/*! @brief Reports the cost of a number of writes since the counts were cleared.
+ *
+ *  @param name What the writes were.
+ *  @param writes The number of writes.
+ *  @return void
+ */
+static void Report(const char * const name, const int writes)
+{
+  printf("  %-40s %4d writes %5.2f erases/write %5.2f programs/write"
+      " %u failed\n", name, writes, (double) MockFlash_Erases / writes,
+      (double) MockFlash_Programs / writes, (unsigned) Failures);
+
+  MockFlash_Erases = 0;
+  MockFlash_Programs = 0;
+  Failures = 0;
+}
+
+int main(void)
+{
+  printf("Flash_Write16 cost, %u byte data region in %u phrases:\n",
+      (unsigned) FLASH_SIZE, (unsigned) FLASH_DATA_PHRASES);
+
+  // Fill the region, the first variable of every phrase goes into an erased phrase
+  Start(BENCH_VARS);
+  for (int var = 0; var < BENCH_VARS; var += 4)
+    Write(var, var);
+  Report("first write, erased phrase", BENCH_VARS / 4);
+
+  // The rest share their phrase with data already programmed
+  for (int var = 0; var < BENCH_VARS; var++)
+    if (var % 4 != 0)
+      Write(var, var);
+  Report("first write, phrase in use", BENCH_VARS - BENCH_VARS / 4);
+
+  for (int var = 0; var < BENCH_VARS; var++)
+    Write(var, var);
+  Report("same value again", BENCH_VARS);
+
+  for (int i = 0; i < BENCH_CHANGES; i++)
+    Write(0, 0x8000 + i);
+  Report("changed value, region full", BENCH_CHANGES);
+
+  Start(1);
+  Write(0, 0);
+  MockFlash_Erases = 0;
+  MockFlash_Programs = 0;
+  for (int i = 0; i < BENCH_CHANGES; i++)
+    Write(0, 0x8000 + i);
+  Report("changed value, only variable", BENCH_CHANGES);
+
+  return 0;
+}
+
+/*!
+ ** @}
+ */
@@ -0,0 +1,190 @@
+/*! @file BenchPacket.c
+ *
+ *  @brief Benchmark of the packet decoder on the host.
+ *
+ *  This sends a stream of packets out of the mock UART2, corrupts some of its
+ *  bytes, and feeds it back in one receive interrupt per byte. Every packet is
+ *  taken out with Packet_Get and Packet_Release, and the packets/sec and the
+ *  packets that made it through are reported at several noise rates.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Bench_module Bench module documentation
+ **  @{
+ */
+#include "packet.h"
+#include "PIT.h"
+#include "MK70F12.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+//!< The number of packets sent in each run
+#define BENCH_PACKETS 1000000u
+
+//!< The number of payload bytes of each frame, the first two are its sequence number
+#define BENCH_FRAME_PAYLOAD 8
+
+//!< The baud rate and module clock the port is set up with, they do not change the timing on the host
+#define BENCH_BAUD_RATE 115200
+#define BENCH_MODULE_CLK 50000000
+
+//! The fraction of bytes replaced by a random byte in each run
+static const double NoiseRates[] = { 0.0, 0.001, 0.01, 0.1 };
+
+static TPacketPort Port; //!< The port under test, on UART2
+static uint8_t* Stream; //!< The bytes sent by the port
+static uint32_t StreamSize; //!< The number of bytes in Stream
+static uint32_t RandomState = 1; //!< The state of the random number generator
+
+/*! @brief Gets a pseudo random number, the same sequence on every host.
+ *
+ *  @return uint32_t - The number.
+ */
+static uint32_t Random(void)
+{
+  RandomState ^= RandomState << 13;
+  RandomState ^= RandomState >> 17;
+  RandomState ^= RandomState << 5;
+  return RandomState;
+}
+
+/*! @brief Sets the port up afresh in a given protocol.
+ *
+ *  @param mode The protocol.
+ *  @return void
+ */
+static void StartPort(const TPacketMode mode)
+{
+  (void) Packet_Init(&Port, UART_2, BENCH_BAUD_RATE, BENCH_MODULE_CLK, 0, 0);
+
+  // Packet_SetMode only takes effect on a release, there is no packet to release yet
+  Port.mode = mode;
+  Port.nextMode = mode;
+}
+
+/*! @brief Runs the transmit interrupt until the transmit FIFOs are empty, keeping every byte sent.
+ *
+ *  @return void
+ */
+static void Transmit(void)
+{
+  // The interrupt turns itself off once it finds nothing left to send
+  while (UART2_BASE_PTR->C2 & UART_C2_TIE_MASK)
+  {
+    UART2_BASE_PTR->S1 = UART_S1_TDRE_MASK;
+    UART2_ISR();
+    if (UART2_BASE_PTR->C2 & UART_C2_TIE_MASK)
+      Stream[StreamSize++] = UART2_BASE_PTR->D;
+  }
+  UART2_BASE_PTR->S1 = 0;
+}
+
+/*! @brief Builds the stream of packets sent in each run of one protocol.
+ *
+ *  Packet n carries n in its first two payload bytes, so that it can be told apart from the others.
+ *  @param mode The protocol.
+ *  @return void
+ */
+static void BuildStream(const TPacketMode mode)
+{
+  StartPort(mode);
+  StreamSize = 0;
+
+  for (uint32_t n = 0; n < BENCH_PACKETS; n++)
+  {
+    uint8_t payload[BENCH_FRAME_PAYLOAD];
+    payload[0] = (uint8_t) n;
+    payload[1] = (uint8_t) (n >> 8);
+    for (int i = 2; i < BENCH_FRAME_PAYLOAD; i++)
+      payload[i] = Random();
+
+    uint8_t length = (mode == PACKET_MODE_FRAMED) ?
+        BENCH_FRAME_PAYLOAD : PACKET_CLASSIC_PAYLOAD;
+    (void) Packet_PutBulk(&Port, Random() & 0x7F, payload, length);
+    Transmit();
+  }
+}
+
+/*! @brief Feeds the stream back in with some of its bytes corrupted, and reports the results.
+ *
+ *  @param mode The protocol.
+ *  @param noiseRate The fraction of bytes replaced by a random byte.
+ *  @return void
+ */
+static void Run(const TPacketMode mode, const double noiseRate)
+{
+  uint8_t* received = malloc(StreamSize);
+  uint32_t threshold = (uint32_t) (noiseRate * 4294967295.0);
+
+  for (uint32_t i = 0; i < StreamSize; i++)
+  {
+    received[i] = Stream[i];
+    if (noiseRate > 0 && Random() <= threshold)
+      received[i] = Random();
+  }
+
+  StartPort(mode);
+
+  uint32_t packets = 0, inOrder = 0;
+  uint16_t expected = 0;
+  uint64_t start = PIT_Now();
+
+  for (uint32_t i = 0; i < StreamSize; i++)
+  {
+    // One receive interrupt per byte, as UART2 has no hardware FIFO
+    UART2_BASE_PTR->D = received[i];
+    UART2_BASE_PTR->S1 = UART_S1_RDRF_MASK;
+    UART2_ISR();
+
+    TPacket* packet;
+    while ((packet = Packet_Get(&Port)) != NULL)
+    {
+      // A packet carrying a sequence number at or just after the last one is taken to be genuine
+      uint16_t sequence = packet->payload[0] | (packet->payload[1] << 8);
+      if ((uint16_t) (sequence - expected) < 256)
+      {
+        inOrder++;
+        expected = sequence + 1;
+      }
+      packets++;
+      Packet_Release(&Port);
+    }
+  }
+
+  double seconds = PIT_TicksToNs(PIT_Now() - start) / 1e9;
+  free(received);
+
+  printf("  %5.1f%% noise %9.0f packets/sec %6.2f Mbytes/sec"
+      "  received %6u/%u (%6.2f%%) stray %5u resyncs %6u discarded %7u\n",
+      noiseRate * 100, packets / seconds, StreamSize / seconds / 1e6,
+      (unsigned) inOrder, BENCH_PACKETS, 100.0 * inOrder / BENCH_PACKETS,
+      (unsigned) (packets - inOrder), (unsigned) Port.resyncs,
+      (unsigned) Port.bytesDiscarded);
+}
+
+int main(void)
+{
+  const TPacketMode modes[] = { PACKET_MODE_CLASSIC, PACKET_MODE_FRAMED };
+  const char * const names[] = { "classic", "framed" };
+
+  Stream = malloc(BENCH_PACKETS
+      * (BENCH_FRAME_PAYLOAD + PACKET_PAYLOAD_MAX + 8));
+
+  for (int m = 0; m < 2; m++)
+  {
+    BuildStream(modes[m]);
+    printf("Packet_Get throughput, %s, %u packets in %u bytes:\n", names[m],
+        BENCH_PACKETS, (unsigned) StreamSize);
+    for (int n = 0; n < sizeof(NoiseRates) / sizeof(NoiseRates[0]); n++)
+      Run(modes[m], NoiseRates[n]);
+  }
+
+  free(Stream);
+  return 0;
+}
+
+/*!
+ ** @}
+ */
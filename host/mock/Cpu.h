@@ -0,0 +1,28 @@
+/*! @file Cpu.h
+ *
+ *  @brief Mock of the Processor Expert CPU header, for building on a PC.
+ *
+ *  The host build runs everything on one thread, so critical sections do nothing.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Mock_module Mock module documentation
+ **  @{
+ */
+#ifndef CPU_H
+#define CPU_H
+
+#define CPU_BUS_CLK_HZ 50000000u
+#define CPU_CORE_CLK_HZ 100000000u
+#define CPU_XTAL32k_CLK_HZ 32768u
+
+#define EnterCritical() do {} while (0)
+#define ExitCritical() do {} while (0)
+
+#endif
+
+/*!
+ ** @}
+ */
@@ -0,0 +1,185 @@
+/*! @file MK70F12.h
+ *
+ *  @brief Mock of the peripheral register definitions, for building on a PC.
+ *
+ *  This contains the registers of the modules the host build uses. The UART and
+ *  FTFE registers are backed by a model of the hardware in Mock.c, everything
+ *  else is a plain variable.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Mock_module Mock module documentation
+ **  @{
+ */
+#ifndef MK70F12_H
+#define MK70F12_H
+
+#include <stdint.h>
+
+//!< Struct for the registers of one UART module
+typedef struct UART_MemMap
+{
+  uint8_t BDH; /*!< Baud rate register high */
+  uint8_t BDL; /*!< Baud rate register low */
+  uint8_t C1; /*!< Control register 1 */
+  uint8_t C2; /*!< Control register 2 */
+  uint8_t S1; /*!< Status register 1, set by the test to raise an interrupt */
+  uint8_t S2; /*!< Status register 2 */
+  uint8_t C3; /*!< Control register 3 */
+  uint8_t D; /*!< Data register, holds the byte received or the last byte sent */
+  uint8_t C4; /*!< Control register 4 */
+  uint8_t C5; /*!< Control register 5 */
+  uint8_t MODEM; /*!< Modem register */
+  uint8_t PFIFO; /*!< FIFO parameters, reads as one byte deep FIFOs */
+  uint8_t CFIFO; /*!< FIFO control register */
+  uint8_t SFIFO; /*!< FIFO status register */
+  uint8_t TWFIFO; /*!< Transmit watermark */
+  uint8_t TCFIFO; /*!< Transmit count */
+  uint8_t RWFIFO; /*!< Receive watermark */
+  uint8_t RCFIFO; /*!< Receive count */
+} volatile *UART_MemMapPtr;
+
+//! The registers of the UART modules
+extern struct UART_MemMap MockUART[3];
+
+#define UART0_BASE_PTR (&MockUART[0])
+#define UART1_BASE_PTR (&MockUART[1])
+#define UART2_BASE_PTR (&MockUART[2])
+
+#define UART_BDH_REG(base) ((base)->BDH)
+#define UART_BDL_REG(base) ((base)->BDL)
+#define UART_C1_REG(base) ((base)->C1)
+#define UART_C2_REG(base) ((base)->C2)
+#define UART_S1_REG(base) ((base)->S1)
+#define UART_S2_REG(base) ((base)->S2)
+#define UART_D_REG(base) ((base)->D)
+#define UART_C4_REG(base) ((base)->C4)
+#define UART_C5_REG(base) ((base)->C5)
+#define UART_MODEM_REG(base) ((base)->MODEM)
+#define UART_PFIFO_REG(base) ((base)->PFIFO)
+#define UART_CFIFO_REG(base) ((base)->CFIFO)
+#define UART_SFIFO_REG(base) ((base)->SFIFO)
+#define UART_TWFIFO_REG(base) ((base)->TWFIFO)
+#define UART_TCFIFO_REG(base) ((base)->TCFIFO)
+#define UART_RWFIFO_REG(base) ((base)->RWFIFO)
+#define UART_RCFIFO_REG(base) ((base)->RCFIFO)
+
+#define UART_BDH_SBR_MASK 0x1Fu
+#define UART_BDH_SBR(x) ((uint8_t)(x) & UART_BDH_SBR_MASK)
+#define UART_BDH_RXEDGIE_MASK 0x40u
+#define UART_C1_PE_MASK 0x02u
+#define UART_C1_ILT_MASK 0x04u
+#define UART_C1_M_MASK 0x10u
+#define UART_C1_LOOPS_MASK 0x80u
+#define UART_C2_RE_MASK 0x04u
+#define UART_C2_TE_MASK 0x08u
+#define UART_C2_ILIE_MASK 0x10u
+#define UART_C2_RIE_MASK 0x20u
+#define UART_C2_TIE_MASK 0x80u
+#define UART_S1_IDLE_MASK 0x10u
+#define UART_S1_RDRF_MASK 0x20u
+#define UART_S1_TC_MASK 0x40u
+#define UART_S1_TDRE_MASK 0x80u
+#define UART_S2_RXEDGIF_MASK 0x40u
+#define UART_C4_BRFA_MASK 0x1Fu
+#define UART_C4_BRFA(x) ((uint8_t)(x) & UART_C4_BRFA_MASK)
+#define UART_C5_RDMAS_MASK 0x20u
+#define UART_C5_TDMAS_MASK 0x80u
+#define UART_MODEM_TXCTSE_MASK 0x01u
+#define UART_MODEM_RXRTSE_MASK 0x08u
+#define UART_PFIFO_RXFIFOSIZE_MASK 0x07u
+#define UART_PFIFO_RXFIFOSIZE_SHIFT 0
+#define UART_PFIFO_RXFE_MASK 0x08u
+#define UART_PFIFO_TXFIFOSIZE_MASK 0x70u
+#define UART_PFIFO_TXFIFOSIZE_SHIFT 4
+#define UART_PFIFO_TXFE_MASK 0x80u
+#define UART_CFIFO_RXFLUSH_MASK 0x40u
+#define UART_CFIFO_TXFLUSH_MASK 0x80u
+#define UART_SFIFO_RXUF_MASK 0x01u
+
+//! The TDRE (transmit) and RDRF (receive) interrupts of UART2, run by the test
+void UART2_ISR(void);
+
+//! Struct for the registers of the Flash memory module
+typedef struct
+{
+  uint8_t FCNFG; /*!< Flash configuration register */
+  uint8_t FCCOB[12]; /*!< Flash common command object registers 0 to B */
+} TMockFTFE;
+
+//! The registers of the Flash memory module, apart from FSTAT
+extern TMockFTFE MockFTFE;
+
+/*! @brief Gives access to FSTAT, and runs the command launched by the last write to it.
+ *
+ *  @return uint8_t volatile* - The register.
+ */
+uint8_t volatile* MockFTFE_FSTAT(void);
+
+#define FTFE_FSTAT (*MockFTFE_FSTAT())
+#define FTFE_FCNFG (MockFTFE.FCNFG)
+#define FTFE_FCCOB0 (MockFTFE.FCCOB[0x0])
+#define FTFE_FCCOB1 (MockFTFE.FCCOB[0x1])
+#define FTFE_FCCOB2 (MockFTFE.FCCOB[0x2])
+#define FTFE_FCCOB3 (MockFTFE.FCCOB[0x3])
+#define FTFE_FCCOB4 (MockFTFE.FCCOB[0x4])
+#define FTFE_FCCOB5 (MockFTFE.FCCOB[0x5])
+#define FTFE_FCCOB6 (MockFTFE.FCCOB[0x6])
+#define FTFE_FCCOB7 (MockFTFE.FCCOB[0x7])
+#define FTFE_FCCOB8 (MockFTFE.FCCOB[0x8])
+#define FTFE_FCCOB9 (MockFTFE.FCCOB[0x9])
+#define FTFE_FCCOBA (MockFTFE.FCCOB[0xA])
+#define FTFE_FCCOBB (MockFTFE.FCCOB[0xB])
+
+#define FTFE_FSTAT_MGSTAT0_MASK 0x01u
+#define FTFE_FSTAT_FPVIOL_MASK 0x10u
+#define FTFE_FSTAT_ACCERR_MASK 0x20u
+#define FTFE_FSTAT_RDCOLERR_MASK 0x40u
+#define FTFE_FSTAT_CCIF_MASK 0x80u
+#define FTFE_FCNFG_CCIE_MASK 0x80u
+
+//! The first address and size of the simulated Flash, the sector used for data storage
+#define MOCK_FLASH_START 0x00080000u
+#define MOCK_FLASH_SIZE 0x1000u
+
+//! The simulated Flash
+extern uint8_t MockFlash[MOCK_FLASH_SIZE];
+
+/*! @brief Finds a Flash address in the simulated Flash.
+ *
+ *  @param address The Flash address.
+ *  @return uintptr_t - The host address of the byte, or of a spare erased phrase if it is not simulated.
+ */
+uintptr_t MockFlash_Map(const uint32_t address);
+
+// Read the Flash through the simulated array
+#define _FB(flashAddress)  *(uint8_t  volatile *)MockFlash_Map(flashAddress)
+#define _FH(flashAddress)  *(uint16_t volatile *)MockFlash_Map(flashAddress)
+#define _FW(flashAddress)  *(uint32_t volatile *)MockFlash_Map(flashAddress)
+#define _FP(flashAddress)  *(uint64_t volatile *)MockFlash_Map(flashAddress)
+
+//! The number of sector erases and phrase programs run by the Flash memory module
+extern uint32_t MockFlash_Erases, MockFlash_Programs;
+
+// The clock gates, pins, interrupt controller and cycle counter only hold what is written to them
+extern volatile uint32_t SIM_SCGC4, SIM_SCGC5, SIM_SCGC6, SIM_SCGC7;
+extern volatile uint32_t PORTB_PCR16, PORTB_PCR17, PORTE_PCR0, PORTE_PCR1,
+    PORTE_PCR16, PORTE_PCR17, PORTE_PCR18, PORTE_PCR19;
+extern volatile uint32_t NVICICPR0, NVICISER0, NVICICPR1, NVICISER1;
+extern volatile uint32_t DWT_CYCCNT;
+
+#define SIM_SCGC4_UART0_MASK 0x400u
+#define SIM_SCGC4_UART1_MASK 0x800u
+#define SIM_SCGC4_UART2_MASK 0x1000u
+#define SIM_SCGC5_PORTB_MASK 0x400u
+#define SIM_SCGC5_PORTE_MASK 0x2000u
+#define PORT_PCR_MUX_MASK 0x700u
+#define PORT_PCR_MUX(x) (((uint32_t)(x) << 8) & PORT_PCR_MUX_MASK)
+
+#endif
+
+/*!
+ ** @}
+ */
@@ -0,0 +1,190 @@
+/*! @file Mock.c
+ *
+ *  @brief Model of the hardware the host build runs the modules on.
+ *
+ *  This contains the registers behind the mock MK70F12.h, a Flash memory module
+ *  that runs its commands on a simulated Flash array, and stand-ins for the
+ *  modules that are not built on the host.
+ *
+ *  @author Aaron Coelho(10858126)
+ *  @date 28/04/2017
+ */
+/*!
+ **  @addtogroup Mock_module Mock module documentation
+ **  @{
+ */
+#include "MK70F12.h"
+#include "Stats.h"
+#include "PIT.h"
+#include "Event.h"
+#include "Power.h"
+#include <string.h>
+#include <time.h>
+
+// The FTFE commands that are modelled
+#define MOCK_PROGRAM_PHRASE_COMMAND 0x07
+#define MOCK_ERASE_FLASH_SECTOR_COMMAND 0x09
+
+//! A reserved bit of FSTAT, kept set in the register so that a write can be seen
+#define MOCK_FSTAT_UNWRITTEN 0x02u
+
+struct UART_MemMap MockUART[3];
+TMockFTFE MockFTFE;
+
+uint8_t MockFlash[MOCK_FLASH_SIZE] __attribute__ ((aligned (8))) =
+{ [0 ... MOCK_FLASH_SIZE - 1] = 0xFF };
+uint32_t MockFlash_Erases, MockFlash_Programs;
+
+volatile uint32_t SIM_SCGC4, SIM_SCGC5, SIM_SCGC6, SIM_SCGC7;
+volatile uint32_t PORTB_PCR16, PORTB_PCR17, PORTE_PCR0, PORTE_PCR1,
+    PORTE_PCR16, PORTE_PCR17, PORTE_PCR18, PORTE_PCR19;
+volatile uint32_t NVICICPR0, NVICISER0, NVICICPR1, NVICISER1;
+volatile uint32_t DWT_CYCCNT;
+
+TStatsCycles Stats_ISRs[STATS_NB_ISRS], Stats_FlashLaunch;
+
+static uint8_t FSTATStatus = FTFE_FSTAT_CCIF_MASK; //!< The real status of the module
+static uint8_t volatile FSTATRegister; //!< The register the code reads and writes
+
+//! Where reads outside of the simulated Flash end up, an erased phrase
+static uint64_t SparePhrase;
+
+/*! @brief Runs the command held in FCCOB.
+ *
+ *  @return void
+ */
+static void RunCommand(void)
+{
+  uint32_t address = ((uint32_t) FTFE_FCCOB1 << 16)
+      | ((uint32_t) FTFE_FCCOB2 << 8) | FTFE_FCCOB3;
+  uint32_t offset = address - MOCK_FLASH_START;
+
+  FSTATStatus &= ~FTFE_FSTAT_MGSTAT0_MASK;
+
+  switch (FTFE_FCCOB0)
+  {
+  case MOCK_ERASE_FLASH_SECTOR_COMMAND:
+    if (address < MOCK_FLASH_START || offset >= MOCK_FLASH_SIZE)
+    {
+      FSTATStatus |= FTFE_FSTAT_FPVIOL_MASK;
+      return;
+    }
+    memset(MockFlash, 0xFF, MOCK_FLASH_SIZE);
+    MockFlash_Erases++;
+    return;
+
+  case MOCK_PROGRAM_PHRASE_COMMAND:
+    if (address < MOCK_FLASH_START || offset >= MOCK_FLASH_SIZE)
+    {
+      FSTATStatus |= FTFE_FSTAT_FPVIOL_MASK;
+      return;
+    }
+    if (address & 0x7)
+    {
+      FSTATStatus |= FTFE_FSTAT_ACCERR_MASK;
+      return;
+    }
+
+    // Programming can only clear bits, a phrase must be erased before it is programmed again
+    for (int i = 0; i < 8; i++)
+      if (MockFlash[offset + i] != 0xFF)
+        FSTATStatus |= FTFE_FSTAT_MGSTAT0_MASK;
+
+    // FCCOB4..7 hold bytes 3..0 of the phrase and FCCOB8..B hold bytes 7..4
+    for (int i = 0; i < 4; i++)
+    {
+      MockFlash[offset + i] &= MockFTFE.FCCOB[0x7 - i];
+      MockFlash[offset + 4 + i] &= MockFTFE.FCCOB[0xB - i];
+    }
+    MockFlash_Programs++;
+    return;
+
+  default:
+    FSTATStatus |= FTFE_FSTAT_ACCERR_MASK;
+    return;
+  }
+}
+
+/*! @brief Gives access to FSTAT, and runs the command launched by the last write to it.
+ *
+ *  @return uint8_t volatile* - The register.
+ */
+uint8_t volatile* MockFTFE_FSTAT(void)
+{
+  // Act on the value written since the last access, the error flags are cleared
+  // by writing 1 to them and writing 1 to CCIF launches the command in FCCOB
+  if (!(FSTATRegister & MOCK_FSTAT_UNWRITTEN))
+  {
+    uint8_t written = FSTATRegister;
+
+    FSTATStatus &= ~(written
+        & (FTFE_FSTAT_ACCERR_MASK | FTFE_FSTAT_FPVIOL_MASK
+            | FTFE_FSTAT_RDCOLERR_MASK));
+
+    // The command runs to completion straight away
+    if ((written & FTFE_FSTAT_CCIF_MASK) && (FSTATStatus & FTFE_FSTAT_CCIF_MASK))
+      RunCommand();
+  }
+
+  FSTATRegister = FSTATStatus | MOCK_FSTAT_UNWRITTEN;
+  return &FSTATRegister;
+}
+
+/*! @brief Finds a Flash address in the simulated Flash.
+ *
+ *  @param address The Flash address.
+ *  @return uintptr_t - The host address of the byte, or of a spare erased phrase if it is not simulated.
+ */
+uintptr_t MockFlash_Map(const uint32_t address)
+{
+  if (address < MOCK_FLASH_START || address - MOCK_FLASH_START >= MOCK_FLASH_SIZE)
+  {
+    SparePhrase = ~0ULL;
+    return (uintptr_t) &SparePhrase;
+  }
+
+  return (uintptr_t) &MockFlash[address - MOCK_FLASH_START];
+}
+
+/*! @brief Reads the 64-bit free running counter, here the monotonic clock of the host.
+ *
+ *  @return uint64_t - The number of nanoseconds since some fixed point.
+ */
+uint64_t PIT_Now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*! @brief Converts a number of ticks of the free running counter to nanoseconds.
+ *
+ *  @param ticks The number of ticks, usually the difference of two PIT_Now readings.
+ *  @return uint64_t - The number of nanoseconds, the host counter already counts them.
+ */
+uint64_t PIT_TicksToNs(const uint64_t ticks)
+{
+  return ticks;
+}
+
+/*! @brief Posts one or more events, the host build has no main loop to wake.
+ *
+ *  @param events The event bits to set.
+ *  @return void
+ */
+void Event_Post(const uint32_t events)
+{
+}
+
+/*! @brief Leaves very low power run, the host always runs at full speed.
+ *
+ *  @return void
+ */
+void Power_Run(void)
+{
+}
+
+/*!
+ ** @}
+ */
@@ -32,34 +32,39 @@
 #include "types.h"
 #include "UART.h"
 #include "packet.h"
+#include "Command.h"
 #include "Flash.h"
+#include "Param.h"
 #include "LEDs.h"
 #include "RTC.h"
 #include "FTM.h"
 #include "PIT.h"
+#include "Event.h"
+#include "Deferred.h"
+#include "Timer.h"
+#include "Stats.h"
+#include "Telemetry.h"
+#include "Power.h"
+#include "SelfTest.h"
 
 #include <stdio.h>
+#include <string.h>
 
 // UART baud rate in Hertz (Hz)
 #define BAUD_RATE 115200 /*!< The baud rate the system is running at */
 
-#define CR 0x0D /*<! CR is a shortened name for the Carriage Return byte */
+//!< The UART module of the link to the PC
+#define PC_UART UART_2
+
+//@{
+//!< What the link to the PC does when its transmit FIFO is full, and how long a reply waits for room in microseconds
+#define PC_FLOW_CONTROL UART_FLOW_BLOCK
+#define PC_FLOW_TIMEOUT 20000
+//@}
 
-//!<Enum for Tower & PC packet commands with their respective values
-enum Commands
-{
-  TOWER_STARTUP = 0x04, /*!< The command byte for when the tower starts up */
-  SPECIAL_GET_STARTUP_VALUES = 0x04, /*!< The command byte for when the tower starts up (special) */
-  FLASH_PROGRAM_BYTE = 0x07, /*!< The command byte for programming a specific byte in the flash */
-  FLASH_READ_BYTE = 0x08, /*!< The command byte for reading a specific byte in the flash */
-  SPECIAL = 0x09, /*!< The command byte for special operations */
-  PROTOCOL_MODE = 0x0A, /*!< The command byte for ? */
-  TOWER_NUMBER = 0x0B, /*!< The command byte for handling get/set of the tower number */
-  TIME = 0x0C, /*!< The command byte for getting the current value of the tower RTC time */
-  SET_TIME = 0x0C, /*!< The command byte setting the value of the tower RTC */
-  TOWER_MODE = 0x0D, /*!< The command byte for handling get/set of the tower mode */
-  PRINT_FLASH = 0x55 /*!< The command byte for printing our specified flash area */
-};
+static TPacketPort PCPort; /*!< The packet link to the PC */
+
+#define CR 0x0D /*<! CR is a shortened name for the Carriage Return byte */
 
 //@{
 //!< Defining the default tower information
@@ -67,12 +72,6 @@ enum Commands
 #define TOWER_DEFAULT_MODE 0x0001
 //@}
 
-//@{
-//!< Defining the flash addresses for tower number and mode
-#define FLASH_TOWER_NUM_ADDR FLASH_DATA_START
-#define FLASH_TOWER_MODE_ADDR (FLASH_TOWER_NUM_ADDR+2)
-//@}
-
 //@{
 /*!< Static const wrapper structs for actions that will be executed
  * after certain interrupts, with obnoxiously long variable names */
@@ -80,226 +79,647 @@ static const LEDs_Callback_Args LEDS_CALLBACK_PIT_TOGGLE_GREEN_LED = {
     .command = LEDs_TOGGLE, .LED = LED_GREEN };
 static const RTC_Callback_Args RTC_CALLBACK_1S_TOGGLE_YELLOW_LED = { .command =
     RTC_SECOND_ELAPSED };
-static const FTM_Callback_Args LED_CALLBACK_FTM_BLUE_LED_OFF = { .command =
-    LEDs_OFF, .LED = LED_BLUE };
 //@}
 
-void FTM_Callback(void *arguments);
+//@{
+//!< Tower details stored in respective variables, the number and mode are the RAM copy of PARAM_TOWER_CONFIG
+static uint16union_t TowerVersion = { .s = { 0, 1 } };
+static uint16union_t TowerNumber = { .l = TOWER_DEFAULT_NUMBER };
+static uint16union_t TowerMode = { .l = TOWER_DEFAULT_MODE };
+//@}
+
+//!< The time the tower number and mode must go unchanged for before they are committed to flash, in milliseconds
+#ifndef TOWER_COMMIT_DELAY
+#define TOWER_COMMIT_DELAY 2000
+#endif
+
+//!< The number of commits of the tower number and mode that can wait for the flash at once
+#define TOWER_WRITES 4
+
+//!< Struct for a commit of the tower number and mode that is waiting for the flash
+typedef struct TTowerWrite
+{
+  uint32_t config; /*!< The tower number and mode being stored */
+  uint16_t changes; /*!< The value of TowerChanges being stored */
+  struct TTowerWrite* write; /*!< The commit whose parameter write stores the values, itself unless an earlier one already does */
+  void (*userFunction)(bool, void*); /*!< The function called when the values are in flash, or NULL */
+  void* userArguments; /*!< The arguments of the user function */
+  bool volatile busy; /*!< TRUE while the commit is waiting for the flash */
+} TTowerWrite;
+
+//@{
+//!< The tower number and mode differ from the flash while TowerStored lags TowerChanges
+static uint16_t TowerChanges; /*!< Counts the changes made to the tower number and mode */
+static uint16_t volatile TowerStored; /*!< The value of TowerChanges last stored in flash */
+//@}
+
+static TTowerWrite TowerWrites[TOWER_WRITES]; /*!< The commits waiting for the flash */
+static TTowerWrite* TowerLastWrite; /*!< The commit whose parameter write was queued last, or NULL */
+static bool volatile TowerRetry; /*!< Set when a commit fails, so the main loop schedules another one */
+static TTimerID TowerCommitTimer = TIMER_INVALID; /*!< The timer that commits the tower number and mode */
+
+//!< Struct for a packet whose acknowledgement waits for a flash operation to complete
+typedef struct
+{
+  TPacket packet; /*!< The packet, with the ACK bit cleared */
+  bool ACK; /*!< TRUE if the PC asked for acknowledgment */
+  bool volatile complete; /*!< Set by the flash completion callback */
+  bool volatile success; /*!< The result of the flash operation */
+} TPendingFlashPacket;
 
-/*!< The Channel settings for Channel0 of the FTM which are
- * used when setting the channel */
-static const TFTMChannel Channel0 = { .channelNb = 0, .delayCount =
-CPU_MCGFF_CLK_HZ_CONFIG_0, // CPU_MCGFF_CLK_HZ_CONFIG_0
-    .timerFunction = TIMER_FUNCTION_OUTPUT_COMPARE, .ioType =
-        TIMER_OUTPUT_DISCONNECT, .userFunction = FTM_Callback, .userArguments =
-        (void*) &LED_CALLBACK_FTM_BLUE_LED_OFF };
+//!< The number of packets that can wait for their flash operations at once, a power of 2
+#define PENDING_FLASH_SIZE 4
 
 //@{
-//!< Tower details stored in respective variables
-static uint16union_t TowerVersion = { .s = { 0, 1 } };
-static volatile uint16union_t *TowerNumber = FLASH_TOWER_NUM_ADDR;
-static volatile uint16union_t *TowerMode = FLASH_TOWER_MODE_ADDR;
+//!< The packets waiting for their flash operations, acknowledged in the order the operations were queued
+static TPendingFlashPacket PendingFlash[PENDING_FLASH_SIZE];
+static uint8_t PendingFlashStart;
+static uint8_t PendingFlashEnd;
 //@}
 
-//!< Local global variable which holds the command byte of packet
-static enum Commands Command;
+//!< Struct for a range of the flash that is being streamed in or out
+typedef struct
+{
+  uint8_t offset; /*!< The offset of the next byte from the start of the flash data region */
+  uint8_t remaining; /*!< The number of bytes still to be streamed */
+  TPacketPort* port; /*!< The port the range is streamed over */
+} TFlashStream;
+
+static TFlashStream ReadStream; /*!< The range still to be streamed out to the PC */
+static TFlashStream ProgramStream; /*!< The range still to be received from the PC */
+static uint8_t ProgramStart; /*!< The offset of the first byte of the block being received */
+static uint8_t ProgramLength; /*!< The number of bytes in the block being received */
+static uint8_t ProgramBuffer[FLASH_SIZE]; /*!< The block being received, indexed by offset */
 
-/*! @brief Helper function to "print" the flash bytes
+/*! @brief Gets ready for a new flash operation behind those still waiting to be acknowledged.
+ *
+ *  The slot is only kept once the handler returns COMMAND_PENDING.
+ *  @return TPendingFlashPacket* - The slot to pass to FlashCommandComplete, or NULL if every slot is in use.
+ */
+static TPendingFlashPacket* FlashBegin(void)
+{
+  if ((uint8_t) (PendingFlashEnd - PendingFlashStart) >= PENDING_FLASH_SIZE)
+    return NULL;
+
+  TPendingFlashPacket* const pending =
+      &PendingFlash[PendingFlashEnd & (PENDING_FLASH_SIZE - 1)];
+  pending->complete = false;
+  return pending;
+}
+
+/*! @brief Flash completion callback for operations started by packet handlers.
  *
+ *  Called from the FTFE interrupt, so it only records the result.
+ *  @param success TRUE if the flash operation completed without errors.
+ *  @param arguments The slot returned by FlashBegin for the operation.
  *  @return void
  */
-static void PrintFlash(void)
+static void FlashCommandComplete(bool success, void* arguments)
 {
-  Packet_Put(FLASH_READ_BYTE, 'v', 'v', 'v');
-  for (uint32_t i = FLASH_DATA_START; i <= FLASH_DATA_END; i++)
+  TPendingFlashPacket* const pending = (TPendingFlashPacket*) arguments;
+  pending->success = success;
+  pending->complete = true;
+
+  // Wake the main loop to send the acknowledgement
+  Event_Post(EVENT_FLASH);
+}
+
+/*! @brief Helper function to "print" the flash bytes
+ *
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandlePrintFlash(const TPacket* const packet)
+{
+  // The bytes are read from the RAM image, as a queued write may be running on the flash
+  uint8_t data[FLASH_SIZE];
+  if (!Flash_Read(0, data, FLASH_SIZE))
+    return COMMAND_FAILED;
+
+  // A framed port takes the flash in as few frames as it fits in
+  if (packet->port->mode == PACKET_MODE_FRAMED)
+  {
+    for (uint32_t i = 0; i < FLASH_SIZE; i += PACKET_PAYLOAD_MAX)
+    {
+      uint32_t length = FLASH_SIZE - i;
+      if (length > PACKET_PAYLOAD_MAX)
+        length = PACKET_PAYLOAD_MAX;
+      if (!Packet_PutBulk(packet->port, PRINT_FLASH, &data[i], length))
+        return COMMAND_FAILED;
+    }
+    return COMMAND_SUCCESS;
+  }
+
+  // The dump is bulk output, so replies to other commands can go out in between
+  static const uint8_t start[PACKET_CLASSIC_PAYLOAD] = { 'v', 'v', 'v' };
+  static const uint8_t end[PACKET_CLASSIC_PAYLOAD] = { '^', '^', '^' };
+
+  // A dump cut short by a full FIFO or a flow timeout is not a success
+  if (!Packet_PutBulk(packet->port, FLASH_READ_BYTE, start,
+      PACKET_CLASSIC_PAYLOAD))
+    return COMMAND_FAILED;
+  for (uint32_t i = 0; i < FLASH_SIZE; i++)
   {
-    Packet_Put(FLASH_READ_BYTE, 0, i - FLASH_DATA_START, _FB(i));
+    const uint8_t entry[PACKET_CLASSIC_PAYLOAD] = { 0, i, data[i] };
+    if (!Packet_PutBulk(packet->port, FLASH_READ_BYTE, entry,
+        PACKET_CLASSIC_PAYLOAD))
+      return COMMAND_FAILED;
   }
-  Packet_Put(FLASH_READ_BYTE, '^', '^', '^');
+  if (!Packet_PutBulk(packet->port, FLASH_READ_BYTE, end,
+      PACKET_CLASSIC_PAYLOAD))
+    return COMMAND_FAILED;
+  return COMMAND_SUCCESS;
 }
 
-/*! @brief Put start up packets in transmit buffer.
+/*! @brief Parameter write completion callback for the tower number and mode.
  *
+ *  Called from the FTFE interrupt. Finishes the commit that queued the write and every
+ *  commit that was waiting for it, and has the main loop try again if it failed.
+ *  @param success TRUE if the values are in flash.
+ *  @param arguments The commit that queued the write.
  *  @return void
  */
-static bool HandleTowerStartup(void)
+static void TowerWritten(bool success, void* arguments)
+{
+  const TTowerWrite* const write = (const TTowerWrite*) arguments;
+
+  for (int i = 0; i < TOWER_WRITES; i++)
+  {
+    TTowerWrite* const commit = &TowerWrites[i];
+    if (!commit->busy || commit->write != write)
+      continue;
+
+    // The commit that waited on the write covers the newer changes
+    if (success && (int16_t) (commit->changes - TowerStored) > 0)
+      TowerStored = commit->changes;
+    commit->busy = false;
+    if (commit->userFunction)
+      commit->userFunction(success, commit->userArguments);
+  }
+
+  // The values are still not in flash, so the quiet period starts again
+  if (!success)
+  {
+    TowerRetry = true;
+    Event_Post(EVENT_FLASH);
+  }
+}
+
+/*! @brief Queues the tower number and mode to be programmed into the flash if they have changed.
+ *
+ *  Both go in one record of the parameter store, so a power failure leaves
+ *  either the old or the new pair and never one of each. They are only taken
+ *  to be in flash once the write has completed, a failed write is tried again
+ *  after TOWER_COMMIT_DELAY.
+ *  @param userFunction is a pointer to a function called when the write completes, or NULL.
+ *  @param userArguments is a pointer to the user arguments to use with the user function.
+ *  @return bool - TRUE if the write was queued or nothing had to be written.
+ */
+static bool TowerCommit(void (*userFunction)(bool, void*), void* userArguments)
 {
-  // Check if the parameters match the packet command
-  if (Packet_Parameter1 == 0 && Packet_Parameter2 == 0
-      && Packet_Parameter3 == 0)
+  if (TowerStored == TowerChanges)
   {
+    if (userFunction)
+      userFunction(true, userArguments);
+    return true;
+  }
+
+  TTowerWrite* commit = NULL;
+  for (int i = 0; i < TOWER_WRITES && commit == NULL; i++)
+  {
+    if (!TowerWrites[i].busy)
+      commit = &TowerWrites[i];
+  }
+  if (commit == NULL)
+    return false;
+
+  uint32union_t config = { .s = { TowerNumber.l, TowerMode.l } };
+  commit->config = config.l;
+  commit->changes = TowerChanges;
+  commit->userFunction = userFunction;
+  commit->userArguments = userArguments;
+
+  // The parameter store has the values already if the last write queued
+  // carries them, so wait for that write instead of queueing another
+  EnterCritical();
+  bool waiting = (TowerLastWrite != NULL && TowerLastWrite->busy
+      && TowerLastWrite->config == commit->config);
+  if (waiting)
+  {
+    commit->write = TowerLastWrite;
+    commit->busy = true;
+  }
+  ExitCritical();
+  if (waiting)
+    return true;
+
+  commit->write = commit;
+  commit->busy = true;
+  if (!Param_WriteAsync(PARAM_TOWER_CONFIG, commit->config, TowerWritten,
+      commit))
+  {
+    commit->busy = false;
+    return false;
+  }
 
-    bool status = true;
+  TowerLastWrite = commit;
+  return true;
+}
+
+/*! @brief Commits the tower number and mode once they have gone unchanged for TOWER_COMMIT_DELAY.
+ *
+ *  Run from the main loop by the timer wheel.
+ *  @param arguments Unused.
+ *  @return void
+ */
+static void TowerCommitTimeout(void* arguments)
+{
+  TowerCommitTimer = TIMER_INVALID;
+
+  // Try again later if the flash queue is full
+  if (!TowerCommit(NULL, NULL))
+    TowerCommitTimer = Timer_Start(TOWER_COMMIT_DELAY, TowerCommitTimeout, NULL);
+}
 
-    status &= Packet_Put(TOWER_STARTUP, 0, 0, 0)
-        && Packet_Put(SPECIAL, 'v', TowerVersion.s.Hi, TowerVersion.s.Lo)
-        && Packet_Put(TOWER_NUMBER, 1, TowerNumber->s.Lo, TowerNumber->s.Hi)
-        && Packet_Put(TOWER_MODE, 1, TowerMode->s.Lo, TowerMode->s.Hi);
-    return status;
+/*! @brief Schedules another commit of the tower number and mode after one has failed.
+ *
+ *  @return void
+ */
+static void HandleTowerRetry(void)
+{
+  if (!TowerRetry)
+    return;
+
+  TowerRetry = false;
+  if (TowerStored != TowerChanges)
+  {
+    Timer_Cancel(TowerCommitTimer);
+    TowerCommitTimer = Timer_Start(TOWER_COMMIT_DELAY, TowerCommitTimeout,
+        NULL);
   }
-  return false;
 }
 
-/*! @brief Put tower version packet into transmit buffer.
+/*! @brief Marks the tower number or mode as changed and (re)starts the quiet period before the commit.
+ *
+ *  Changes made within TOWER_COMMIT_DELAY of each other cost a single record.
+ *  @return bool - TRUE if the commit has been scheduled.
+ */
+static bool TowerChanged(void)
+{
+  TowerChanges++;
+  Timer_Cancel(TowerCommitTimer);
+  TowerCommitTimer = Timer_Start(TOWER_COMMIT_DELAY, TowerCommitTimeout, NULL);
+  return TowerCommitTimer != TIMER_INVALID;
+}
+
+/*! @brief Put start up packets in transmit buffer.
  *
- *  @return bool - TRUE if the command executed successfully.
+ *  @param port The port to send the packets out of.
+ *  @return bool - TRUE if the packets were sent.
  */
-static bool HandleTowerGetVersion(void)
+static bool SendStartupValues(TPacketPort * const port)
 {
-  return Packet_Put(Command, 'v', TowerVersion.s.Hi, TowerVersion.s.Lo);
+  return Packet_Put(port, TOWER_STARTUP, 0, 0, 0)
+      && Packet_Put(port, SPECIAL, 'v', TowerVersion.s.Hi, TowerVersion.s.Lo)
+      && Packet_Put(port, TOWER_NUMBER, 1, TowerNumber.s.Lo, TowerNumber.s.Hi)
+      && Packet_Put(port, TOWER_MODE, 1, TowerMode.s.Lo, TowerMode.s.Hi);
+}
+
+/*! @brief Handles the tower startup command.
+ *
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandleTowerStartup(const TPacket* const packet)
+{
+  return SendStartupValues(packet->port) ? COMMAND_SUCCESS : COMMAND_FAILED;
 }
 
 /*! @brief Get or set the tower number.
  *
- *  @return bool - TRUE if the command executed successfully.
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
  */
-static bool HandleTowerNumber()
+static TCommandStatus HandleTowerNumber(const TPacket* const packet)
 {
   // If the PC has sent a get command, send the tower number
-  if (Packet_Parameter1 == 1 && Packet_Parameter2 == 0
-      && Packet_Parameter3 == 0)
-    return Packet_Put(Command, 1, TowerNumber->s.Lo, TowerNumber->s.Hi);
+  if (packet->parameter1 == 1 && packet->parameter2 == 0
+      && packet->parameter3 == 0)
+    return Packet_Put(packet->port, packet->command, 1, TowerNumber.s.Lo, TowerNumber.s.Hi) ?
+        COMMAND_SUCCESS : COMMAND_FAILED;
 
-  // If the PC has sent a set command, set the tower number variable (in flash)
-  // to the values passed in through the packet parameters
-  else if (Packet_Parameter1 == 2)
+  // If the PC has sent a set command, keep the tower number sent through
+  // the packet parameters, it is committed to flash once it settles
+  else if (packet->parameter1 == 2)
   {
-    bool status = true;
-
-    // If the flash is initialized (cleared) at the address of the tower number
-    if (_FH(FLASH_TOWER_NUM_ADDR) == 0xFFFF)
-    {
-      // Try to allocate flash memory for the tower number variable
-      if (Flash_AllocateVar(&TowerNumber, sizeof(*TowerNumber)))
-        // Write the default tower number
-        status &= Flash_Write16(TowerNumber, TOWER_DEFAULT_NUMBER);
-      else
-        status = false;
-    }
-    else
-    {
-      // Write the tower number sent through the parameters into the flash
-      uint16union_t newTowerNumber = { .s.Lo = Packet_Parameter2, .s.Hi =
-          Packet_Parameter3 };
-      status &= Flash_Write16(TowerNumber, newTowerNumber.l);
-    }
-    return status;
+    TowerNumber.s.Lo = packet->parameter2;
+    TowerNumber.s.Hi = packet->parameter3;
+    return TowerChanged() ? COMMAND_SUCCESS : COMMAND_FAILED;
   }
-  return false;
+  return COMMAND_FAILED;
 }
 
 /*! @brief Get or set the tower mode.
  *
- *  @return bool - TRUE if the command executed successfully.
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
  */
-static bool HandleTowerMode(void)
+static TCommandStatus HandleTowerMode(const TPacket* const packet)
 {
-
   // If the PC has sent a get command, send the tower mode
-  if (Packet_Parameter1 == 0x01)
-    return Packet_Put(Command, 0x01, TowerMode->s.Lo, TowerMode->s.Hi);
+  if (packet->parameter1 == 0x01)
+    return Packet_Put(packet->port, packet->command, 0x01, TowerMode.s.Lo, TowerMode.s.Hi) ?
+        COMMAND_SUCCESS : COMMAND_FAILED;
 
-  // If the PC has sent a set command, set the tower mode variable (in flash)
-  // to the values passed in through the packet parameters
-  else if (Packet_Parameter1 == 0x02)
-  {
-    bool status = true;
+  // Otherwise the PC has sent a set command, keep the tower mode sent
+  // through the packet parameters, it is committed to flash once it settles
+  TowerMode.s.Lo = packet->parameter2;
+  TowerMode.s.Hi = packet->parameter3;
+  return TowerChanged() ? COMMAND_SUCCESS : COMMAND_FAILED;
+}
 
-    // If the flash is initialized (cleared) at the address of the tower mode
-    if (_FH(FLASH_TOWER_MODE_ADDR) == 0xFFFF)
-    {
-      // Try to allocate flash memory for the tower mode variable
-      if (Flash_AllocateVar(&TowerMode, sizeof(*TowerMode)))
-        status &= Flash_Write16(TowerMode, TOWER_DEFAULT_MODE);
-      else
-        status = false;
-    }
-    else
-    {
-      // Write the tower number sent through the parameters into the flash
-      uint16union_t newTowerMode = { .s.Lo = Packet_Parameter2, .s.Hi =
-          Packet_Parameter3 };
-      status &= Flash_Write16(TowerMode, newTowerMode.l);
-    }
-    return status;
-  }
-  return false;
+/*! @brief Commit the tower number and mode to the flash without waiting for the quiet period.
+ *
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandleTowerCommit(const TPacket* const packet)
+{
+  TPendingFlashPacket* const pending = FlashBegin();
+  if (!pending)
+    return COMMAND_FAILED;
+
+  // Acknowledge the packet once the values are in flash
+  if (!TowerCommit(FlashCommandComplete, pending))
+    return COMMAND_FAILED;
+
+  Timer_Cancel(TowerCommitTimer);
+  TowerCommitTimer = TIMER_INVALID;
+  return COMMAND_PENDING;
 }
 
 /*! @brief Set a byte in the flash.
  *
- *  @return bool - TRUE if the command executed successfully.
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
  */
-static bool HandleFlashProgramByte(void)
+static TCommandStatus HandleFlashProgramByte(const TPacket* const packet)
 {
+  TPendingFlashPacket* const pending = FlashBegin();
+  if (!pending)
+    return COMMAND_FAILED;
+
+  bool status;
+
   // If the index is within the flash size then simply write the
   // data byte from the packet parameter
-  if (Packet_Parameter1 >= 0x00 && Packet_Parameter1 < 0x08)
-    return Flash_Write8(FLASH_DATA_START + Packet_Parameter1, Packet_Parameter3);
+  if (packet->parameter1 < 0x08)
+    status = Flash_Write8Async(
+        (volatile uint8_t*) (FLASH_DATA_START + packet->parameter1),
+        packet->parameter3, FlashCommandComplete, pending);
 
   // If the index is equal to the flash size then clear/erase the flash
-  else if (Packet_Parameter1 == 0x08)
-  {
-    bool status = Flash_Erase();
-    status &= Flash_Init();
-    return status;
-  }
+  else
+    status = Flash_EraseAsync(FlashCommandComplete, pending);
 
-  return false;
+  // Acknowledge the packet once the flash operation has completed
+  return status ? COMMAND_PENDING : COMMAND_FAILED;
 }
 
-/*! @brief Get a byte in the flash.
+/*! @brief Checks that a block lies inside the flash data region.
  *
- *  @return bool - TRUE if the command executed successfully.
+ *  @param offset The offset of the block from the start of the region.
+ *  @param length The number of bytes in the block.
+ *  @return bool - TRUE if the block is not empty and fits in the region.
  */
-static bool HandleFlashReadByte(void)
+static bool FlashBlockValid(const uint8_t offset, const uint8_t length)
 {
-  // If the byte index is within an acceptable range then simply
-  // put that data into the output fifo
-  if (Packet_Parameter1 >= 0 && Packet_Parameter1 < FLASH_SIZE)
-    return Packet_Put(Command, Packet_Parameter1, 0,
-        _FB(FLASH_DATA_START+Packet_Parameter1));
-  return false;
+  return length > 0 && offset < FLASH_SIZE && length <= FLASH_SIZE - offset;
 }
 
-/*! @brief Handles the special commands.
+/*! @brief Start streaming a range of the flash to the PC.
  *
- *  @return bool - TRUE if the command executed successfully.
+ *  Parameter 1 is the offset and parameter 2 the length of the range. The bytes are sent
+ *  three at a time, or a frame at a time, in FLASH_BLOCK_DATA packets by HandleFlashStream.
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
  */
-static bool HandleSpecial(void)
+static TCommandStatus HandleFlashReadBlock(const TPacket* const packet)
 {
-  // If the packet has these certain parameters, send the tower version
-  if (Packet_Parameter1
-      == 'v'&& Packet_Parameter2 == 'x' && Packet_Parameter3 == CR)
-    return HandleTowerGetVersion();
-  return false;
+  // Only one range can be streamed out at a time
+  if (ReadStream.remaining != 0
+      || !FlashBlockValid(packet->parameter1, packet->parameter2))
+    return COMMAND_FAILED;
+
+  ReadStream.offset = packet->parameter1;
+  ReadStream.remaining = packet->parameter2;
+  ReadStream.port = packet->port;
+  return COMMAND_SUCCESS;
 }
 
-/*! @brief Handles the time commands. More specifically, only sets time.
+/*! @brief Start receiving a block to be written into the flash.
  *
- *  @return bool - TRUE if the command executed successfully.
+ *  Parameter 1 is the offset and parameter 2 the length of the block. The bytes follow
+ *  three at a time, or a frame at a time, in FLASH_BLOCK_DATA packets.
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
  */
-static bool HandleTime(void)
+static TCommandStatus HandleFlashProgramBlock(const TPacket* const packet)
 {
-  if ((Packet_Parameter1 >= 0 && Packet_Parameter1 <= 23)
-      && (Packet_Parameter2 >= 0 && Packet_Parameter2 <= 59)
-      && (Packet_Parameter3 >= 0 && Packet_Parameter3 <= 59))
+  if (!FlashBlockValid(packet->parameter1, packet->parameter2))
+    return COMMAND_FAILED;
+
+  // A new block replaces any block that was not finished
+  ProgramStart = packet->parameter1;
+  ProgramLength = packet->parameter2;
+  ProgramStream.offset = packet->parameter1;
+  ProgramStream.remaining = packet->parameter2;
+  return COMMAND_SUCCESS;
+}
+
+/*! @brief Store the next bytes of the block being written into the flash.
+ *
+ *  Once the whole block has been received it is written with a single erase and program
+ *  of the flash, and the packet is acknowledged when that has completed.
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandleFlashBlockData(const TPacket* const packet)
+{
+  if (ProgramStream.remaining == 0)
+    return COMMAND_FAILED;
+
+  // Copy the bytes of this packet, three in classic mode or the payload of a
+  // frame, the last packet may be padded
+  for (int i = 0; i < packet->length && ProgramStream.remaining; i++)
   {
-    // 0,0,0 is bad input, don't set to 0 in accordance with manual
-    if (Packet_Parameter1 == 0 && Packet_Parameter2 == 0
-        && Packet_Parameter3 == 0)
-    {
-      return false;
-    }
-    RTC_Set(Packet_Parameter1, Packet_Parameter2, Packet_Parameter3);
-    return true;
+    ProgramBuffer[ProgramStream.offset++] = packet->payload[i];
+    ProgramStream.remaining--;
   }
-  else
+
+  if (ProgramStream.remaining != 0)
+    return COMMAND_SUCCESS;
+
+  // The block is complete, so commit it in one go
+  TPendingFlashPacket* const pending = FlashBegin();
+  if (!pending
+      || !Flash_WriteBlockAsync(
+          (volatile uint8_t*) (FLASH_DATA_START + ProgramStart),
+          &ProgramBuffer[ProgramStart], ProgramLength, FlashCommandComplete,
+          pending))
+    return COMMAND_FAILED;
+
+  // Acknowledge the packet once the flash operation has completed
+  return COMMAND_PENDING;
+}
+
+/*! @brief Send as much of the range being streamed out as the transmit buffer can take.
+ *
+ *  @return void
+ */
+static void HandleFlashStream(void)
+{
+  while (ReadStream.remaining != 0)
   {
-    return false;
+    // A frame carries as much of the range as fits, a classic packet three bytes
+    uint8_t size = Packet_PayloadSize(ReadStream.port);
+    uint8_t sent = (ReadStream.remaining < size) ? ReadStream.remaining : size;
+
+    // Pack the next bytes into one packet from the RAM image, which a running
+    // flash command can not disturb, padding a classic packet past the end of the range
+    uint8_t data[PACKET_PAYLOAD_MAX];
+    memset(data, 0xFF, size);
+    (void) Flash_Read(ReadStream.offset, data, sent);
+    uint8_t length = (ReadStream.port->mode == PACKET_MODE_FRAMED) ?
+        sent : size;
+
+    // Try again once the transmit FIFO has drained if the bulk output is full,
+    // rather than waiting for room and holding up the replies
+    if (UARTTxFIFO_Free(&ReadStream.port->uart.TxFIFO)
+        < Packet_WireSize(ReadStream.port, length)
+        || !Packet_PutBulk(ReadStream.port, FLASH_BLOCK_DATA, data, length))
+      return;
+
+    ReadStream.offset += sent;
+    ReadStream.remaining -= sent;
   }
 }
 
+/*! @brief Get a byte in the flash.
+ *
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandleFlashReadByte(const TPacket* const packet)
+{
+  // The byte index has been range checked, so simply put the byte from the
+  // RAM image into the output fifo, the flash itself may be busy
+  uint8_t data;
+  return Flash_Read(packet->parameter1, &data, 1)
+      && Packet_Put(packet->port, packet->command, packet->parameter1, 0, data) ?
+      COMMAND_SUCCESS : COMMAND_FAILED;
+}
+
+/*! @brief Handles the special commands, which for now only get the tower version.
+ *
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandleSpecial(const TPacket* const packet)
+{
+  return Packet_Put(packet->port, packet->command, 'v', TowerVersion.s.Hi,
+      TowerVersion.s.Lo) ? COMMAND_SUCCESS : COMMAND_FAILED;
+}
+
+/*! @brief Get or set the protocol spoken on the port the packet arrived on.
+ *
+ *  Parameter 1 is 1 to get or 2 to set, parameter 2 the new TPacketMode. The
+ *  reply to a set still uses the old protocol.
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandleProtocolMode(const TPacket* const packet)
+{
+  // If the PC has sent a get command, send the protocol mode
+  if (packet->parameter1 == 1)
+    return Packet_Put(packet->port, packet->command, 1, packet->port->mode, 0) ?
+        COMMAND_SUCCESS : COMMAND_FAILED;
+
+  // Otherwise switch the port once this packet has been handled
+  return Packet_SetMode(packet->port, packet->parameter2) ?
+      COMMAND_SUCCESS : COMMAND_FAILED;
+}
+
+/*! @brief Handles the time commands. More specifically, only sets time.
+ *
+ *  @param packet The received packet.
+ *  @return TCommandStatus - The result of the command.
+ */
+static TCommandStatus HandleTime(const TPacket* const packet)
+{
+  // 0,0,0 is bad input, don't set to 0 in accordance with manual
+  if (packet->parameter1 == 0 && packet->parameter2 == 0
+      && packet->parameter3 == 0)
+    return COMMAND_FAILED;
+
+  RTC_Set(packet->parameter1, packet->parameter2, packet->parameter3);
+  return COMMAND_SUCCESS;
+}
+
+/*! @brief Registers the tower commands and their parameter ranges.
+ *
+ *  @return bool - TRUE if every command was registered.
+ */
+static bool TowerCommandsInit(void)
+{
+  static const TCommandRange startup[3] = { COMMAND_EXACT(0), COMMAND_EXACT(0),
+      COMMAND_EXACT(0) };
+  static const TCommandRange special[3] = { COMMAND_EXACT('v'),
+      COMMAND_EXACT('x'), COMMAND_EXACT(CR) };
+  static const TCommandRange getSet[3] = { { 1, 2 }, COMMAND_ANY, COMMAND_ANY };
+  static const TCommandRange protocolMode[3] = { { 1, 2 }, { PACKET_MODE_CLASSIC,
+      PACKET_MODE_FRAMED }, COMMAND_EXACT(0) };
+
+  return Command_Register(SPECIAL_GET_STARTUP_VALUES, HandleTowerStartup,
+      startup)
+      && Command_Register(SPECIAL, HandleSpecial, special)
+      && Command_Register(TOWER_NUMBER, HandleTowerNumber, getSet)
+      && Command_Register(TOWER_MODE, HandleTowerMode, getSet)
+      && Command_Register(TOWER_COMMIT, HandleTowerCommit, startup)
+      && Command_Register(PROTOCOL_MODE, HandleProtocolMode, protocolMode);
+}
+
+/*! @brief Registers the flash commands and their parameter ranges.
+ *
+ *  @return bool - TRUE if every command was registered.
+ */
+static bool FlashCommandsInit(void)
+{
+  static const TCommandRange programByte[3] = { { 0x00, 0x08 }, COMMAND_ANY,
+      COMMAND_ANY };
+  static const TCommandRange readByte[3] = { { 0x00, FLASH_SIZE - 1 },
+      COMMAND_ANY, COMMAND_ANY };
+
+  return Command_Register(FLASH_PROGRAM_BYTE, HandleFlashProgramByte,
+      programByte)
+      && Command_Register(FLASH_READ_BYTE, HandleFlashReadByte, readByte)
+      && Command_Register(FLASH_READ_BLOCK, HandleFlashReadBlock, NULL)
+      && Command_Register(FLASH_PROGRAM_BLOCK, HandleFlashProgramBlock, NULL)
+      && Command_Register(FLASH_BLOCK_DATA, HandleFlashBlockData, NULL)
+      && Command_Register(PRINT_FLASH, HandlePrintFlash, NULL);
+}
+
+/*! @brief Registers the RTC commands and their parameter ranges.
+ *
+ *  @return bool - TRUE if every command was registered.
+ */
+static bool RTCCommandsInit(void)
+{
+  static const TCommandRange time[3] = { { 0, 23 }, { 0, 59 }, { 0, 59 } };
+
+  return Command_Register(SET_TIME, HandleTime, time);
+}
+
 /*! @brief Runs the necessary code when a packet has been
  *  received successfully.
  *
@@ -307,58 +727,51 @@ static bool HandleTime(void)
  */
 static void PacketSuccess(void)
 {
-  // Turn on the blue LED, set Channel0 of FTM and start the timer
-  LEDs_On(LED_BLUE);
-  FTM_Set(&Channel0);
-  FTM_StartTimer(&Channel0);
+  // The FTM keeps the blue LED on for a second after the last packet
+  LEDs_Activity(LED_BLUE);
 }
 
-/*! @brief Check if a full packet has been received.
+/*! @brief Check if any full packets have been received on a port.
  *
- *  If so then choose which action to take next.
+ *  If so then dispatch each of them to the handler of its command.
  *
+ *  @param port The packet port.
  *  @return void
  */
-static void HandlePacket(void)
+static void HandlePacket(TPacketPort * const port)
 {
-  // check if we have a full packet with correct checksum
-  if (Packet_Get())
+  // Handle every full packet with a correct checksum that has been received,
+  // straight from the slot the receive interrupt put it in
+  TPacket* packet;
+  while ((packet = Packet_Get(port)) != NULL)
   {
-    // Clear the ACK bit from Packet_Command to get the command
-    Command = Packet_Command & (~PACKET_ACK_MASK);
-    bool ACK = Packet_Command & PACKET_ACK_MASK;
-    bool success = true;
+    // Clear the ACK bit from the command of the packet to get the command
+    bool ACK = packet->command & PACKET_ACK_MASK;
+    packet->command &= ~PACKET_ACK_MASK;
+
+    // While a self-test runs, what comes back around the loop is its own
+    if (SelfTest_Receive(packet))
+    {
+      Packet_Release(port);
+      continue;
+    }
 
-    switch (Command)
+    TCommandStatus status = Command_Dispatch(packet);
+
+    if (status == COMMAND_PENDING)
     {
-    case SPECIAL_GET_STARTUP_VALUES:
-      success = HandleTowerStartup();
-      break;
-    case SPECIAL:
-      success = HandleSpecial();
-      break;
-    case TOWER_NUMBER:
-      success = HandleTowerNumber();
-      break;
-    case TOWER_MODE:
-      success = HandleTowerMode();
-      break;
-    case FLASH_PROGRAM_BYTE:
-      success = HandleFlashProgramByte();
-      break;
-    case FLASH_READ_BYTE:
-      success = HandleFlashReadByte();
-      break;
-    case TIME:
-      success = HandleTime();
-      break;
-    case PRINT_FLASH:
-      PrintFlash();
-      break;
-    default:
-      break;
+      // The handler has started a flash operation, so save the packet in the
+      // slot it took from FlashBegin and finish handling it in HandleFlashComplete
+      TPendingFlashPacket* const pending =
+          &PendingFlash[PendingFlashEnd & (PENDING_FLASH_SIZE - 1)];
+      pending->packet = *packet;
+      pending->ACK = ACK;
+      PendingFlashEnd++;
+      Packet_Release(port);
+      continue;
     }
 
+    bool success = (status == COMMAND_SUCCESS);
     if (success)
     {
       // If handling this packet was successful, call PacketSuccess
@@ -368,91 +781,123 @@ static void HandlePacket(void)
     {
       // If the PC asked for acknowledgment, set the ACK depending
       // on whether the command was handled successfully
-      Packet_Put(success << 7 | Command, Packet_Parameter1, Packet_Parameter2,
-          Packet_Parameter3);
+      Packet_Put(port, success << 7 | packet->command, packet->parameter1,
+          packet->parameter2, packet->parameter3);
     }
+    Packet_Release(port);
   }
 }
 
-/*! @brief Initialize the flash module.
+/*! @brief Finish handling the packets whose flash operations have completed.
  *
- *  @return bool - TRUE if the flash was initialized successfully.
+ *  @return void
  */
-extern bool Flash_Init(void)
+static void HandleFlashComplete(void)
 {
-  bool status = true;
-  // If the flash is initialized at the tower number block, allocate space
-  if (_FH(FLASH_TOWER_NUM_ADDR) == 0xFFFF)
+  // The flash runs its operations in order, so acknowledge them in order too
+  while (PendingFlashStart != PendingFlashEnd)
   {
-    // If the space is successfully allocated then write the tower number
-    // into the newly allocated flash space
-    if (Flash_AllocateVar(&TowerNumber, sizeof(*TowerNumber)))
+    TPendingFlashPacket* const pending =
+        &PendingFlash[PendingFlashStart & (PENDING_FLASH_SIZE - 1)];
+    if (!pending->complete)
+      return;
+
+    if (pending->success)
     {
-      status &= Flash_Write16(TowerNumber, TOWER_DEFAULT_NUMBER);
+      // If the flash operation was successful, call PacketSuccess
+      PacketSuccess();
     }
-    else
+    if (pending->ACK)
     {
-      status = false;
+      // If the PC asked for acknowledgment, set the ACK depending
+      // on whether the flash operation was successful
+      Packet_Put(pending->packet.port, pending->success << 7 | pending->packet.command,
+          pending->packet.parameter1, pending->packet.parameter2,
+          pending->packet.parameter3);
     }
+    PendingFlashStart++;
   }
-  // If the flash is initialized at the tower mode block, allocate space
-  if (_FH(FLASH_TOWER_MODE_ADDR) == 0xFFFF)
+}
+
+/*! @brief Notes that the parameters written on boot have reached the Flash.
+ *
+ *  Called by the Flash once the queued write completes.
+ *  @param success TRUE if the write completed without errors.
+ *  @param arguments Unused.
+ *  @return void
+ */
+static void TowerParamsStored(bool success, void* arguments)
+{
+  Stats_BootStage(STATS_BOOT_PARAMS);
+}
+
+/*! @brief Load the tower number and mode from the parameter store.
+ *
+ *  If they have never been set together they are queued to be stored, with their
+ *  default values the first time, so the boot does not wait for the Flash.
+ *  @return bool - TRUE if the tower parameters were loaded successfully.
+ */
+static bool TowerParamsInit(void)
+{
+  if (!Param_Init())
+    return false;
+
+  uint32union_t config;
+  uint32_t value;
+
+  // Load the tower number and mode, which older firmware stored as separate records
+  if (Param_Read(PARAM_TOWER_CONFIG, &config.l))
   {
-    // If the space is successfully allocated then write the tower mode
-    // into the newly allocated flash space
-    if (Flash_AllocateVar(&TowerMode, sizeof(*TowerMode)))
-    {
-      status &= Flash_Write16(TowerMode, TOWER_DEFAULT_MODE);
-    }
-    else
-    {
-      status = false;
-    }
+    TowerNumber.l = config.s.Lo;
+    TowerMode.l = config.s.Hi;
+    Stats_BootStage(STATS_BOOT_PARAMS);
+    return true;
   }
-  return status;
+  if (Param_Read(PARAM_TOWER_NUMBER, &value))
+    TowerNumber.l = value;
+  if (Param_Read(PARAM_TOWER_MODE, &value))
+    TowerMode.l = value;
+
+  // Store the defaults on first boot, or move the old records into one
+  TowerChanges++;
+  return TowerCommit(TowerParamsStored, NULL);
 }
 
+/*! @brief PIT callback, deferred to the main loop by the PIT interrupt.
+ *
+ *  @param arguments Unused.
+ *  @return void
+ */
 void PIT_Callback(void *arguments){
   LEDs_Toggle(LED_GREEN);
 }
 
-void FTM_Callback(void *arguments){
-  LEDs_Off(LED_BLUE);
-}
-
 /*! @brief A callback function that handles specific
  *  callback information
  *
+ *  Deferred to the main loop by the RTC interrupt, so it is safe to send packets.
  *  @param arguments - An address to the argument struct else NULL
  *  @return void
  *  @note Assumes the RTC has been initialized.
  */
 extern void RTC_Callback(void *arguments)
 {
-  LEDs_Toggle(LED_YELLOW);
-  return;
-
-  /*
   // Convert the arguments pointer into the specified struct pointer
   // so callback information can be read
-  RTC_Callback_Args* callbackInfo = (RTC_Callback_Args*) arguments;
+  const RTC_Callback_Args* callbackInfo = (const RTC_Callback_Args*) arguments;
   switch (callbackInfo->command)
   {
   // If the RTC 1 second interrupt has been triggered
   case RTC_SECOND_ELAPSED:
     LEDs_Toggle(LED_YELLOW);
     uint8_t hours, minutes, seconds;
-    //EnterCritical()
-    // TODO - Verify if critical section needed
     // Get the time and send it to the tower
     RTC_Get(&hours, &minutes, &seconds);
-    Packet_Put(TIME, hours, minutes, seconds);
-    //ExitCritical();
+    Packet_Put(&PCPort, TIME, hours, minutes, seconds);
     break;
   default:
     break;
   }
-  */
 }
 
 /*! @brief Initialize the Tower for first use.
@@ -463,30 +908,58 @@ static bool TowerInit(void)
 {
   // Use a variable to keep the status of initializing all modules
   bool init = true;
-  init &= Packet_Init(BAUD_RATE, CPU_BUS_CLK_HZ);
+  init &= Command_Init();
+  init &= Stats_Init();
+  init &= Event_Init();
+  init &= Deferred_Init();
+  init &= Packet_Init(&PCPort, PC_UART, BAUD_RATE, CPU_BUS_CLK_HZ,
+      EVENT_UART_RX, EVENT_UART_TX);
+
+  // The tower values only need the Flash to be read, writing any missing
+  // ones is left to the Flash interrupt
   init &= Flash_Init();
-  init &= LEDs_Init();
+  init &= TowerParamsInit();
+
+  // Queue the startup packets first, they go out as soon as interrupts are enabled
+  if (init)
+    SendStartupValues(&PCPort);
+  Stats_BootStage(STATS_BOOT_LINK);
 
-  init &= FTM_Init(FTM_Callback);
+  // Register the handlers of every command the tower understands
+  init &= TowerCommandsInit();
+  init &= FlashCommandsInit();
+  init &= RTCCommandsInit();
+  init &= LEDs_Init();
+  init &= LEDs_SetPattern(LED_BLUE, LED_PATTERN_ACTIVITY);
 
-  // TODO - Perhaps initialize the RTC counter might stop the weird stuff
+  init &= FTM_Init();
+  init &= Timer_Init(CPU_MCGFF_CLK_HZ_CONFIG_0);
 
-  // Initialize the RTC and set up the specific callback information
+  // Initialize the RTC and set up the specific callback information, it
+  // finishes from a timer once the oscillator has settled
   init &= RTC_Init(RTC_Callback, (void*) &RTC_CALLBACK_1S_TOGGLE_YELLOW_LED);
 
-  //RTC_Set(0, 0, 1);
-
-  // Initialize the PIT and set up the specific callback information
-  init &= PIT_Init(CPU_BUS_CLK_HZ / 2, PIT_Callback,
+  // Initialize the PIT and set up channel 0 to toggle the green LED every half second
+  init &= PIT_Init(CPU_BUS_CLK_HZ);
+  init &= PIT_SetCallback(0, PIT_Callback,
       (void*) &LEDS_CALLBACK_PIT_TOGGLE_GREEN_LED);
+  init &= PIT_Set(0, 500000000, true);
+
+  // Replies wait for room in the transmit FIFO from now on, the wait is timed with the PIT
+  init &= UART_SetFlowControl(&PCPort.uart, PC_FLOW_CONTROL, PC_FLOW_TIMEOUT);
+
+  // The telemetry stream samples on the other PIT channel once the PC starts it
+  init &= Telemetry_Init();
+
+  // Run at full speed and wait for events until the PC selects other modes
+  init &= Power_Init();
+  init &= SelfTest_Init();
 
   // If all modules were initialized successfully then turn on the LED
   // and prepare to handle packets
   if (init)
-  {
     LEDs_On(LED_ORANGE);
-    HandleTowerStartup();
-  }
+  Stats_BootStage(STATS_BOOT_MODULES);
   return init;
 }
 
@@ -513,15 +986,31 @@ int main(void)
     __EI()
     ;
 
-    // Loop infinitely
+    // Loop infinitely, sleeping until an interrupt posts an event
     for (;;)
     {
-      //Poll the UART <- DON'T, WE'RE USING INTERRUPTS NOW
-      //UART_Poll();
+      uint32_t events = Event_Wait();
 
       // Call handlePacket to check whether a full packet has been received
       // If so, the function executes the desired action
-      HandlePacket();
+      if (events & EVENT_UART_RX)
+        HandlePacket(&PCPort);
+
+      // Send the acknowledgment of any flash operation that has completed
+      if (events & EVENT_FLASH)
+      {
+        HandleFlashComplete();
+        HandleTowerRetry();
+      }
+
+      // Carry on streaming any range of the flash the PC has asked for,
+      // once a read has been handled or the transmit FIFO has drained
+      if (events & (EVENT_UART_RX | EVENT_UART_TX))
+        HandleFlashStream();
+
+      // Run the callbacks the PIT, FTM and RTC interrupts have left behind
+      if (events & EVENT_DEFERRED)
+        Deferred_Run();
     }
   }
   /*** Don't write any code pass this line, or it will be deleted during code generation. ***/
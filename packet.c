@@ -2,7 +2,8 @@
  *
  *  @brief Routines to implement packet encoding and decoding for the serial port.
  *
- *  This contains the functions for implementing the "Tower to PC Protocol" 5-byte packets.
+ *  This contains the functions for implementing the "Tower to PC Protocol" 5-byte packets,
+ *  and the framed mode with length-prefixed frames and a CRC-16.
  *
  *  @author Aaron Coelho(10858126)
  *  @date 28/04/2017
@@ -12,29 +13,82 @@
  **  @{
  */
 #include "packet.h"
-#include "Cpu.h"
 #include "UART.h"
+#include "PIT.h"
+#include "Event.h"
+#include "Cpu.h"
+#include <string.h>
 
 //!< The ACK bit is at pos 7 in the command byte of the packet
 #define PACKET_ACK_SHIFT 7
 
+//!< The number of bytes in a packet, including the checksum
+#define PACKET_SIZE 5
+
 //!< This macro takes a bool 'x' and converts it into ACK form
 #define PACKET_ACK(x) (((uint8_t)(((uint8_t)(x))<<PACKET_ACK_SHIFT))&PACKET_ACK_MASK)
 
 //!<Mask for the 7th bit in Packet_Command
 const uint8_t PACKET_ACK_MASK = 128u;
 
+/*
+ * Framed mode:
+ The start of frame byte, the payload length, the command, the payload and the
+ CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF) of the length, command
+ and payload, most significant byte first. The ACK bit is in the command as in
+ classic mode.
+ */
+
 //@{
-//!< Initialize extern global variables
-uint8_t Packet_Command = 0;
-uint8_t Packet_Parameter1 = 0;
-uint8_t Packet_Parameter2 = 0;
-uint8_t Packet_Parameter3 = 0;
-uint8_t Packet_Checksum = 0;
+//!< Layout of a frame
+#define PACKET_FRAME_SOF 0x7E
+#define PACKET_FRAME_HEADER 3
+#define PACKET_FRAME_OVERHEAD (PACKET_FRAME_HEADER + 2)
 //@}
 
-//static int variable to keep count of bytes received in packet
-static int ByteCount = 0;
+#if PACKET_WINDOW_SIZE < PACKET_PAYLOAD_MAX + PACKET_FRAME_OVERHEAD
+#error "PACKET_WINDOW_SIZE must hold the largest frame"
+#endif
+
+//!< The initial value of the CRC of a frame
+#define PACKET_CRC_INIT 0xFFFF
+
+//!< The CRC-16/CCITT of every byte value, so the CRC takes one lookup per byte
+static const uint16_t CRCTable[256] =
+{
+0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+  0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+  0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+  0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+  0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+  0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+  0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+  0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+  0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+  0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+  0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+  0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+  0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+  0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+  0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+  0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+  0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+  0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+  0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+  0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+  0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+  0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
 
 /*! @brief Calculates the checksum of the packet bytes.
  *
@@ -51,101 +105,380 @@ static uint8_t calculateChecksum(const uint8_t command,
   return (command ^ parameter1 ^ parameter2 ^ parameter3);
 }
 
-/*! @brief Initializes the packets by calling the initialization routines of the supporting software modules.
+/*! @brief Calculates the CRC-16 of a block of bytes.
+ *
+ *  @param data The bytes.
+ *  @param length The number of bytes.
+ *  @return uint16_t - The CRC of the bytes.
+ */
+static uint16_t calculateCRC(const uint8_t * const data, const uint8_t length)
+{
+  uint16_t crc = PACKET_CRC_INIT;
+  for (uint8_t i = 0; i < length; i++)
+    crc = (crc << 8) ^ CRCTable[(crc >> 8) ^ data[i]];
+  return crc;
+}
+
+/*! @brief Checks whether the window starts with a valid classic packet.
+ *
+ *  @param packet The slot the packet is given to if it is valid.
+ *  @param candidate The bytes at the start of the window.
+ *  @param available The number of bytes in the window.
+ *  @return int16_t - The size of the packet if it is valid, 0 if more bytes are needed, -1 if it is not valid.
+ */
+static int16_t MatchClassic(TPacket * const packet,
+    const uint8_t * const candidate, const uint8_t available)
+{
+  if (available < PACKET_SIZE)
+    return 0;
+
+  if (calculateChecksum(candidate[0], candidate[1], candidate[2],
+      candidate[3]) != candidate[4])
+    return -1;
+
+  // The bytes are in the right order, hand the packet out
+  packet->command = candidate[0];
+  packet->parameter1 = candidate[1];
+  packet->parameter2 = candidate[2];
+  packet->parameter3 = candidate[3];
+  packet->checksum = candidate[4];
+  memcpy(packet->payload, &candidate[1], PACKET_CLASSIC_PAYLOAD);
+  packet->length = PACKET_CLASSIC_PAYLOAD;
+  return PACKET_SIZE;
+}
+
+/*! @brief Checks whether the window starts with a valid frame.
+ *
+ *  @param packet The slot the frame is given to if it is valid.
+ *  @param candidate The bytes at the start of the window.
+ *  @param available The number of bytes in the window.
+ *  @return int16_t - The size of the frame if it is valid, 0 if more bytes are needed, -1 if it is not valid.
+ */
+static int16_t MatchFrame(TPacket * const packet,
+    const uint8_t * const candidate, const uint8_t available)
+{
+  if (available < 2)
+    return 0;
+
+  // Only a start of frame byte followed by a sensible length can begin a frame
+  uint8_t length = candidate[1];
+  if (candidate[0] != PACKET_FRAME_SOF || length > PACKET_PAYLOAD_MAX)
+    return -1;
+
+  uint8_t size = length + PACKET_FRAME_OVERHEAD;
+  if (available < size)
+    return 0;
+
+  uint16_t crc = calculateCRC(&candidate[1], length + 2);
+  if (crc != ((candidate[size - 2] << 8) | candidate[size - 1]))
+    return -1;
+
+  // The frame is intact, the parameters are the first three bytes of its payload
+  const uint8_t * const payload = &candidate[PACKET_FRAME_HEADER];
+  packet->command = candidate[2];
+  packet->parameter1 = (length > 0) ? payload[0] : 0;
+  packet->parameter2 = (length > 1) ? payload[1] : 0;
+  packet->parameter3 = (length > 2) ? payload[2] : 0;
+  packet->checksum = crc;
+  memcpy(packet->payload, payload, length);
+  packet->length = length;
+  return size;
+}
+
+/*! @brief Frames and checks the data received on a port, queueing every valid packet.
  *
+ *  Everything waiting in the receive FIFO is pulled into a small window
+ *  which is searched for a valid packet one byte position at a time. Data is
+ *  left waiting while the queue is full.
+ *  @param port The packet port.
+ *  @return void
+ *  @note Must be called with interrupts disabled or from the receive interrupt.
+ */
+static void Decode(TPacketPort * const port)
+{
+  uint8_t * const window = port->window;
+
+  for (;;)
+  {
+    // Slide along the window until a candidate packet is valid
+    while (port->windowEnd > port->windowStart)
+    {
+      // Leave the rest for Packet_Release to pick up once a slot is free
+      TPacket * const packet = PacketQueue_Reserve(&port->queue);
+      if (packet == NULL)
+        return;
+
+      const uint8_t * const candidate = &window[port->windowStart];
+      uint8_t available = port->windowEnd - port->windowStart;
+      int16_t size = (port->mode == PACKET_MODE_FRAMED) ?
+          MatchFrame(packet, candidate, available) :
+          MatchClassic(packet, candidate, available);
+
+      // Wait for the rest of the candidate
+      if (size == 0)
+        break;
+
+      if (size > 0)
+      {
+        // Publish the slot once it is filled in, and wake the main loop
+        packet->timestamp = PIT_Now();
+        PacketQueue_Commit(&port->queue);
+        port->windowStart += size;
+        port->inSync = true;
+        Event_Post(port->uart.rxEvent);
+        continue;
+      }
+
+      // The bytes are out of order, drop the oldest one and try again
+      if (port->inSync)
+      {
+        port->resyncs++;
+        port->inSync = false;
+      }
+      port->bytesDiscarded++;
+      port->windowStart++;
+    }
+
+    // Move the partial packet to the front of the window
+    uint8_t remaining = port->windowEnd - port->windowStart;
+    memmove(window, &window[port->windowStart], remaining);
+    port->windowStart = 0;
+    port->windowEnd = remaining;
+
+    // Top the window up from the receive FIFO, stop when it has run dry
+    uint16_t count = UART_Read(&port->uart, &window[port->windowEnd],
+        PACKET_WINDOW_SIZE - port->windowEnd);
+    if (count == 0)
+      return;
+    port->windowEnd += count;
+  }
+}
+
+/*! @brief Receive callback of the serial link of a port.
+ *
+ *  @param arguments The packet port.
+ *  @return void
+ */
+static void Received(void* arguments)
+{
+  Decode((TPacketPort*) arguments);
+}
+
+/*! @brief Initializes a packet port by calling the initialization routines of the supporting software modules.
+ *
+ *  @param port The packet port to set up.
+ *  @param instance The UART module of the port.
  *  @param baudRate The desired baud rate in bits/sec.
  *  @param moduleClk The module clock rate in Hz
+ *  @param rxEvent The event to post when a packet has been received on the port.
+ *  @param txEvent The event to post when the port has finished sending.
  *  @return bool - TRUE if the packet module was successfully initialized.
  */
-bool Packet_Init(const uint32_t baudRate, const uint32_t moduleClk)
+bool Packet_Init(TPacketPort * const port, const TUARTInstance instance,
+    const uint32_t baudRate, const uint32_t moduleClk, const uint32_t rxEvent,
+    const uint32_t txEvent)
 {
-  return UART_Init(baudRate, moduleClk);
+  port->mode = PACKET_MODE_CLASSIC;
+  port->nextMode = PACKET_MODE_CLASSIC;
+  PacketQueue_Init(&port->queue);
+  port->bytesDiscarded = 0;
+  port->resyncs = 0;
+  port->windowStart = 0;
+  port->windowEnd = 0;
+  port->inSync = true;
+
+  // Every slot belongs to the port, replies to it go back out of the same port
+  for (int i = 0; i < (1 << PACKET_QUEUE_BITS); i++)
+    port->queue.Buffer[i].port = port;
+
+  if (!UART_Init(&port->uart, instance, baudRate, moduleClk, rxEvent, txEvent))
+    return false;
+
+  // Frame the data in the receive interrupt as it arrives
+  UART_SetReceiveCallback(&port->uart, Received, port);
+  return true;
 }
 
-/*! @brief Builds a packet and places it in the transmit FIFO buffer.
+/*! @brief Gets the oldest packet received on a port.
  *
- *  @return bool - TRUE if a valid packet was sent.
+ *  Packets are framed and checked by the receive interrupt as the bytes arrive,
+ *  so this only looks at the queue. The packet stays in its slot, and can be
+ *  changed in place, until Packet_Release is called.
+ *
+ *  @param port The packet port.
+ *  @return TPacket* - The packet, or NULL if no packet is waiting.
+ *  @note Call only from the main loop.
+ */
+TPacket* Packet_Get(TPacketPort * const port)
+{
+  return PacketQueue_Peek(&port->queue);
+}
+
+/*! @brief Hands the slot of the packet returned by Packet_Get back to the decoder.
+ *
+ *  A protocol change asked for while handling the packet takes effect here, and
+ *  the decoder carries on with any data that was waiting for a free slot.
+ *  @param port The packet port.
+ *  @return void
+ *  @note Call only from the main loop, after a packet has been returned by Packet_Get.
  */
-bool Packet_Get(void)
+void Packet_Release(TPacketPort * const port)
 {
-  // local variable to store first byte from transmit FIFO buffer
-  uint8_t data;
+  // The decoder state is shared with the receive interrupt
+  EnterCritical();
+
+  PacketQueue_Release(&port->queue);
+
+  // Switch protocol once the reply to the packet that asked for it has been sent
+  if (port->mode != port->nextMode)
+  {
+    port->mode = port->nextMode;
+    port->inSync = true;
+  }
 
-  // if the transmit FIFO buffer is empty, early exit and return false
-  if (!UART_InChar(&data))
+  // Pick up anything the decoder had to leave while the queue was full
+  Decode(port);
+
+  ExitCritical();
+}
+
+/*! @brief Builds a packet carrying a block of bytes and places it in one of the transmit FIFOs of a port.
+ *
+ *  @param port The packet port.
+ *  @param command The command of the packet.
+ *  @param data The bytes to send.
+ *  @param length The number of bytes, at most Packet_PayloadSize.
+ *  @param bulk TRUE to send the packet behind the bulk output, FALSE to send it ahead.
+ *  @return bool - TRUE if a valid packet was sent.
+ */
+static bool PutPacket(TPacketPort * const port, const uint8_t command,
+    const uint8_t * const data, const uint8_t length, const bool bulk)
+{
+  if (length > Packet_PayloadSize(port))
     return false;
 
-  // check how many bytes are currently in the packet then
-  // take next action (move to next state)
-  switch (ByteCount)
+  uint8_t packet[PACKET_PAYLOAD_MAX + PACKET_FRAME_OVERHEAD];
+  uint8_t size;
+
+  if (port->mode == PACKET_MODE_CLASSIC)
   {
-  case 0:
-    // If there are 0 bytes in packet, set Packet_Command to data
-    Packet_Command = data;
-    break;
-  case 1:
-    // If there is 1 byte in packet, set Parameter1 to data
-    Packet_Parameter1 = data;
-    break;
-  case 2:
-    // If there are 2 bytes in packet, set Parameter2 to data
-    Packet_Parameter2 = data;
-    break;
-  case 3:
-    // If there are 3 bytes in packet, set Parameter3 to data
-    Packet_Parameter3 = data;
-    break;
-  case 4:
-    // If we have 4 bytes in the packet, set checksum to data
-    Packet_Checksum = data;
-
-    // Check if the checksum of the first 4 bytes is equal to
-    // Packet_Checksum
-    if (calculateChecksum(Packet_Command, Packet_Parameter1, Packet_Parameter2,
-        Packet_Parameter3) == Packet_Checksum)
-    {
-      // If the checksums are equal then the bytes in the packet
-      // are all in the right order. Set the byteCount back to 0
-      // and return true.
-      ByteCount = 0;
-      return true;
-    }
-    else
-    {
-      // If the checksums are not equal then the bytes in the
-      // packet are out of order. Shift every byte to leftwards
-      // (to the previous state)
-      Packet_Command = Packet_Parameter1;
-      Packet_Parameter1 = Packet_Parameter2;
-      Packet_Parameter2 = Packet_Parameter3;
-      Packet_Parameter3 = Packet_Checksum;
-      return false;
-    }
+    // Missing parameters are sent as 0
+    packet[0] = command;
+    for (int i = 0; i < PACKET_CLASSIC_PAYLOAD; i++)
+      packet[1 + i] = (i < length) ? data[i] : 0;
+    packet[4] = calculateChecksum(packet[0], packet[1], packet[2], packet[3]);
+    size = PACKET_SIZE;
+  }
+  else
+  {
+    packet[0] = PACKET_FRAME_SOF;
+    packet[1] = length;
+    packet[2] = command;
+    memcpy(&packet[PACKET_FRAME_HEADER], data, length);
+
+    uint16union_t crc = { .l = calculateCRC(&packet[1], length + 2) };
+    packet[PACKET_FRAME_HEADER + length] = crc.s.Hi;
+    packet[PACKET_FRAME_HEADER + length + 1] = crc.s.Lo;
+    size = length + PACKET_FRAME_OVERHEAD;
   }
 
-  // Increase the byteCount and return false as not enough bytes
-  // have been received into the packet
-  ByteCount++;
-  return false;
+  // Build the whole packet so it goes into the transmit FIFO in one go,
+  // a full FIFO then drops the packet instead of sending part of it
+  return bulk ? UART_Write(&port->uart, packet, size) :
+      UART_WritePriority(&port->uart, packet, size);
 }
 
-/*! @brief Builds a packet and places it in the transmit FIFO buffer.
+/*! @brief Builds a packet and places it in the transmit FIFO buffer of a port.
  *
+ *  The packet is a reply, so it goes out ahead of any bulk output.
+ *  @param port The packet port.
  *  @return bool - TRUE if a valid packet was sent.
+ *  @note The transmit FIFO has a single producer, so only call this from the main loop.
  */
-bool Packet_Put(const uint8_t command, const uint8_t parameter1,
-    const uint8_t parameter2, const uint8_t parameter3)
+bool Packet_Put(TPacketPort * const port, const uint8_t command,
+    const uint8_t parameter1, const uint8_t parameter2,
+    const uint8_t parameter3)
 {
-  EnterCritical();
-  bool success = (UART_OutChar(command) && UART_OutChar(parameter1)
-      && UART_OutChar(parameter2) && UART_OutChar(parameter3)
-      && UART_OutChar(
-          calculateChecksum(command, parameter1, parameter2, parameter3)));
-  ExitCritical();
-  return success;
+  const uint8_t parameters[PACKET_CLASSIC_PAYLOAD] = { parameter1, parameter2,
+      parameter3 };
+  return PutPacket(port, command, parameters, PACKET_CLASSIC_PAYLOAD, false);
+}
+
+/*! @brief Builds a packet carrying a block of bytes and places it in the transmit FIFO buffer of a port.
+ *
+ *  In framed mode the bytes are the payload of one frame, in classic mode they are
+ *  the parameters of one packet and missing parameters are sent as 0.
+ *  The packet is a reply, so it goes out ahead of any bulk output.
+ *  @param port The packet port.
+ *  @param command The command of the packet.
+ *  @param data The bytes to send.
+ *  @param length The number of bytes, at most Packet_PayloadSize.
+ *  @return bool - TRUE if a valid packet was sent.
+ *  @note The transmit FIFO has a single producer, so only call this from the main loop.
+ */
+bool Packet_PutPayload(TPacketPort * const port, const uint8_t command,
+    const uint8_t * const data, const uint8_t length)
+{
+  return PutPacket(port, command, data, length, false);
+}
+
+/*! @brief Builds a packet carrying a block of bytes and places it behind the bulk output of a port.
+ *
+ *  As Packet_PutPayload, for data streamed out in many packets. The FIFO_Free of
+ *  port->uart.TxFIFO is the room left for such packets.
+ *  @param port The packet port.
+ *  @param command The command of the packet.
+ *  @param data The bytes to send.
+ *  @param length The number of bytes, at most Packet_PayloadSize.
+ *  @return bool - TRUE if a valid packet was sent.
+ *  @note The transmit FIFO has a single producer, so only call this from the main loop.
+ */
+bool Packet_PutBulk(TPacketPort * const port, const uint8_t command,
+    const uint8_t * const data, const uint8_t length)
+{
+  return PutPacket(port, command, data, length, true);
+}
+
+/*! @brief Gets the largest payload a port can carry in one packet.
+ *
+ *  @param port The packet port.
+ *  @return uint8_t - PACKET_PAYLOAD_MAX in framed mode, PACKET_CLASSIC_PAYLOAD in classic mode.
+ */
+uint8_t Packet_PayloadSize(const TPacketPort * const port)
+{
+  return (port->mode == PACKET_MODE_FRAMED) ?
+      PACKET_PAYLOAD_MAX : PACKET_CLASSIC_PAYLOAD;
+}
+
+/*! @brief Gets the number of bytes a packet carrying a block of bytes takes in the transmit FIFO.
+ *
+ *  @param port The packet port.
+ *  @param length The number of bytes carried, at most Packet_PayloadSize.
+ *  @return uint8_t - The number of bytes the packet is sent as.
+ */
+uint8_t Packet_WireSize(const TPacketPort * const port, const uint8_t length)
+{
+  return (port->mode == PACKET_MODE_FRAMED) ?
+      length + PACKET_FRAME_OVERHEAD : PACKET_SIZE;
+}
+
+/*! @brief Switches the protocol spoken on a port.
+ *
+ *  The new mode takes effect from the next call to Packet_Release, so the reply to the
+ *  packet being handled still goes out in the current mode.
+ *  @param port The packet port.
+ *  @param mode The new protocol.
+ *  @return bool - TRUE if the mode is valid.
+ */
+bool Packet_SetMode(TPacketPort * const port, const TPacketMode mode)
+{
+  if (mode != PACKET_MODE_CLASSIC && mode != PACKET_MODE_FRAMED)
+    return false;
+
+  port->nextMode = mode;
+  return true;
 }
 
 /*!
  ** @}
  */
-
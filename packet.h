@@ -17,16 +17,62 @@
 
 // new types
 #include "types.h"
+#include "UART.h"
 
 //!< extern global variable mask for the command packets ACK bit
 extern const uint8_t PACKET_ACK_MASK;
 
-//! A struct for storing the latest recieved packet
-extern uint8_t Packet_Command, /*!< The packet's command */
-Packet_Parameter1, /*!< The packet's 1st parameter */
-Packet_Parameter2, /*!< The packet's 2nd parameter */
-Packet_Parameter3, /*!< The packet's 3rd parameter */
-Packet_Checksum; /*!< The packet's checksum */
+//!< The largest payload of a frame in framed mode
+#define PACKET_PAYLOAD_MAX 64
+
+//!< The payload of a packet in classic mode, its three parameters
+#define PACKET_CLASSIC_PAYLOAD 3
+
+//!< Number of bytes the decoder pulls from the receive FIFO at a time, enough for the largest frame
+#define PACKET_WINDOW_SIZE 96
+
+//!< Enum for the protocol spoken on a packet port
+typedef enum
+{
+  PACKET_MODE_CLASSIC, /*!< The 5-byte "Tower to PC Protocol" packets with an XOR checksum */
+  PACKET_MODE_FRAMED /*!< Length-prefixed frames of up to PACKET_PAYLOAD_MAX bytes with a CRC-16 */
+} TPacketMode;
+
+//!< Number of received packets that can wait for the main loop as a power of two
+#define PACKET_QUEUE_BITS 2
+
+typedef struct TPacketPort TPacketPort;
+
+//!< Struct for a packet with its command and parameters
+typedef struct
+{
+  uint8_t command; /*!< The packet's command */
+  uint8_t parameter1; /*!< The packet's 1st parameter */
+  uint8_t parameter2; /*!< The packet's 2nd parameter */
+  uint8_t parameter3; /*!< The packet's 3rd parameter */
+  TPacketPort* port; /*!< The port the packet was received on, which its replies are sent back out of */
+  uint8_t length; /*!< The number of bytes in the payload */
+  uint8_t payload[PACKET_PAYLOAD_MAX]; /*!< The payload, the parameters are its first three bytes */
+  uint16_t checksum; /*!< The packet's checksum, or the CRC of a frame */
+  uint64_t timestamp; /*!< The PIT_Now reading taken when the packet was taken out of the received data */
+} TPacket;
+
+FIFO_DECLARE(TPacketQueue, PacketQueue, TPacket, PACKET_QUEUE_BITS)
+
+//!< Struct for one packet link, a serial link with its own decoder
+struct TPacketPort
+{
+  TUART uart; /*!< The serial link */
+  TPacketMode mode; /*!< The protocol the port is speaking */
+  TPacketMode nextMode; /*!< The protocol the port switches to once the packet being handled is released */
+  TPacketQueue queue; /*!< The received packets waiting for the main loop, filled by the decoder */
+  uint32_t bytesDiscarded; /*!< The number of received bytes that were not part of a valid packet */
+  uint32_t resyncs; /*!< The number of times sync was lost */
+  uint8_t window[PACKET_WINDOW_SIZE]; /*!< Window of received bytes that is searched for a valid packet */
+  uint8_t windowStart; /*!< The index of the first byte of the candidate packet */
+  uint8_t windowEnd; /*!< The index after the last byte received */
+  bool inSync; /*!< FALSE while bytes are being discarded to regain sync */
+};
 
 /*! @brief Check if a full packet has been received.
  *
@@ -36,26 +82,106 @@ Packet_Checksum; /*!< The packet's checksum */
  */
 extern void Packet_Handle(void);
 
-/*! @brief Initializes the packets by calling the initialization routines of the supporting software modules.
+/*! @brief Initializes a packet port by calling the initialization routines of the supporting software modules.
  *
+ *  @param port The packet port to set up.
+ *  @param instance The UART module of the port.
  *  @param baudRate The desired baud rate in bits/sec.
  *  @param moduleClk The module clock rate in Hz
+ *  @param rxEvent The event to post when data has arrived on the port.
+ *  @param txEvent The event to post when the port has finished sending.
  *  @return bool - TRUE if the packet module was successfully initialized.
  */
-bool Packet_Init(const uint32_t baudRate, const uint32_t moduleClk);
+bool Packet_Init(TPacketPort * const port, const TUARTInstance instance,
+    const uint32_t baudRate, const uint32_t moduleClk, const uint32_t rxEvent,
+    const uint32_t txEvent);
+
+/*! @brief Gets the oldest packet received on a port.
+ *
+ *  Packets are framed and checked by the receive interrupt as the bytes arrive,
+ *  so this only looks at the queue. The packet stays in its slot, and can be
+ *  changed in place, until Packet_Release is called.
+ *
+ *  @param port The packet port.
+ *  @return TPacket* - The packet, or NULL if no packet is waiting.
+ *  @note Call only from the main loop.
+ */
+TPacket* Packet_Get(TPacketPort * const port);
+
+/*! @brief Hands the slot of the packet returned by Packet_Get back to the decoder.
+ *
+ *  A protocol change asked for while handling the packet takes effect here, and
+ *  the decoder carries on with any data that was waiting for a free slot.
+ *  @param port The packet port.
+ *  @return void
+ *  @note Call only from the main loop, after a packet has been returned by Packet_Get.
+ */
+void Packet_Release(TPacketPort * const port);
+
+/*! @brief Builds a packet and places it in the transmit FIFO buffer of a port.
+ *
+ *  The packet is a reply, so it goes out ahead of any bulk output.
+ *  @param port The packet port.
+ *  @return bool - TRUE if a valid packet was sent.
+ *  @note The transmit FIFO has a single producer, so only call this from the main loop.
+ */
+bool Packet_Put(TPacketPort * const port, const uint8_t command,
+    const uint8_t parameter1, const uint8_t parameter2,
+    const uint8_t parameter3);
 
-/*! @brief Attempts to get a packet from the received data.
+/*! @brief Builds a packet carrying a block of bytes and places it in the transmit FIFO buffer of a port.
  *
- *  @return bool - TRUE if a valid packet was received.
+ *  In framed mode the bytes are the payload of one frame, in classic mode they are
+ *  the parameters of one packet and missing parameters are sent as 0.
+ *  The packet is a reply, so it goes out ahead of any bulk output.
+ *  @param port The packet port.
+ *  @param command The command of the packet.
+ *  @param data The bytes to send.
+ *  @param length The number of bytes, at most Packet_PayloadSize.
+ *  @return bool - TRUE if a valid packet was sent.
+ *  @note The transmit FIFO has a single producer, so only call this from the main loop.
  */
-bool Packet_Get(void);
+bool Packet_PutPayload(TPacketPort * const port, const uint8_t command,
+    const uint8_t * const data, const uint8_t length);
 
-/*! @brief Builds a packet and places it in the transmit FIFO buffer.
+/*! @brief Builds a packet carrying a block of bytes and places it behind the bulk output of a port.
  *
+ *  As Packet_PutPayload, for data streamed out in many packets. The FIFO_Free of
+ *  port->uart.TxFIFO is the room left for such packets.
+ *  @param port The packet port.
+ *  @param command The command of the packet.
+ *  @param data The bytes to send.
+ *  @param length The number of bytes, at most Packet_PayloadSize.
  *  @return bool - TRUE if a valid packet was sent.
+ *  @note The transmit FIFO has a single producer, so only call this from the main loop.
+ */
+bool Packet_PutBulk(TPacketPort * const port, const uint8_t command,
+    const uint8_t * const data, const uint8_t length);
+
+/*! @brief Gets the largest payload a port can carry in one packet.
+ *
+ *  @param port The packet port.
+ *  @return uint8_t - PACKET_PAYLOAD_MAX in framed mode, PACKET_CLASSIC_PAYLOAD in classic mode.
+ */
+uint8_t Packet_PayloadSize(const TPacketPort * const port);
+
+/*! @brief Gets the number of bytes a packet carrying a block of bytes takes in the transmit FIFO.
+ *
+ *  @param port The packet port.
+ *  @param length The number of bytes carried, at most Packet_PayloadSize.
+ *  @return uint8_t - The number of bytes the packet is sent as.
+ */
+uint8_t Packet_WireSize(const TPacketPort * const port, const uint8_t length);
+
+/*! @brief Switches the protocol spoken on a port.
+ *
+ *  The new mode takes effect from the next call to Packet_Release, so the reply to the
+ *  packet being handled still goes out in the current mode.
+ *  @param port The packet port.
+ *  @param mode The new protocol.
+ *  @return bool - TRUE if the mode is valid.
  */
-bool Packet_Put(const uint8_t command, const uint8_t parameter1,
-    const uint8_t parameter2, const uint8_t parameter3);
+bool Packet_SetMode(TPacketPort * const port, const TPacketMode mode);
 
 #endif
 